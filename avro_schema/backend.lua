@@ -8,7 +8,8 @@ local ffi_sizeof     = ffi.sizeof
 local format, rep    = string.format, string.rep
 local byte, max      = string.byte, math.max
 local insert, remove = table.insert, table.remove
-local concat         = table.concat
+local concat, sort   = table.concat, table.sort
+local floor          = math.floor
 local band, rshift   = bit.band, bit.rshift
 
 local rt_C           = ffi.load(rt.C_path)
@@ -43,6 +44,81 @@ local function sched_func_variables(func)
     return sched_variables_helper(func, 0, varmap, {}), varmap
 end
 
+local function branch_key(il, branch)
+    local head = branch[1]
+    return head.op == opcode.SBRANCH and il.get_extra(head) or head.ci
+end
+
+-- Profile-guided code (opts.profile). Conditionals are numbered in
+-- the order met, hence a profile collected with one build applies to
+-- another build of the same schemas. A profile lists hit counts of
+-- the branches, keyed by the conditional number and the branch key.
+-- Switch arms are ordered by hit count; a conditional taking a single
+-- branch almost always is marked (profile_hot), see peel_annotate.
+-- The whole tree is numbered before any arms move, nested conditionals
+-- keep the numbers of the profiling build.
+local profile_number
+profile_number = function(il, block)
+    if block.profile_id ~= nil then return end -- tree already processed
+    local head = block[1]
+    if head.op >= opcode.IFSET and head.op <= opcode.STRSWITCH then
+        il.profile_nblocks = il.profile_nblocks + 1
+        block.profile_id = il.profile_nblocks
+    else
+        block.profile_id = false
+    end
+    for i = 2, #block do
+        if type(block[i]) == 'table' then
+            profile_number(il, block[i])
+        end
+    end
+end
+
+local profile_apply
+profile_apply = function(il, block)
+    if block.profile_applied then return end -- tree already processed
+    block.profile_applied = true
+    local head = block[1]
+    local profile = block.profile_id and type(il.profile) == 'table' and
+                    il.profile[block.profile_id]
+    if type(profile) == 'table' then
+        local total, hot = 0, nil
+        for i = 2, #block do
+            local branch = block[i]
+            branch.profile_count = tonumber(
+                profile[branch_key(il, branch)]) or 0
+            branch.profile_order = i
+            total = total + branch.profile_count
+            if not hot or branch.profile_count > hot.profile_count then
+                hot = branch
+            end
+        end
+        if total > 0 and hot.profile_count >= 0.95 * total then
+            block.profile_hot = hot
+        end
+        if head.op == opcode.INTSWITCH or head.op == opcode.STRSWITCH then
+            local arms = { unpack(block, 2) }
+            sort(arms, function(a, b)
+                if a.profile_count ~= b.profile_count then
+                    return a.profile_count > b.profile_count
+                end
+                return a.profile_order < b.profile_order
+            end)
+            for i = 1, #arms do block[i + 1] = arms[i] end
+        end
+    end
+    for i = 2, #block do
+        if type(block[i]) == 'table' then
+            profile_apply(il, block[i])
+        end
+    end
+end
+
+local function profile_annotate(il, func)
+    profile_number(il, func)
+    profile_apply(il, func)
+end
+
 -- Due to the quirks of the tracing JIT-compiler, it's
 -- beneficial to get rid of nested loops and to transform the code
 -- into a state-machine wrapped in the single top-level for loop.
@@ -63,12 +139,17 @@ peel_annotate = function(block, k)
         if type(o) == 'table' then
             local head = o[1]
             if head.op >= opcode.IFSET and head.op <= opcode.STRSWITCH then
-                -- too many conditionals in a row
-                if k >= 2 then o.break_jit_trace = true; k = 0; peel = true end
+                -- too many conditionals in a row; one almost always
+                -- taking the same branch (profile_hot) doesn't count
+                local hot = o.profile_hot
+                if k >= 2 and not hot then
+                    o.break_jit_trace = true; k = 0; peel = true
+                end
                 local nk = 0
                 for j = 2, #o do
                     local branch = o[j]
-                    local bp, bk = peel_annotate(branch, k+1)
+                    local bp, bk = peel_annotate(branch,
+                                                 branch == hot and k or k+1)
                     peel = peel or bp
                     if bk > nk then nk = bk end
                 end
@@ -269,6 +350,12 @@ r.ot[%s] = %d; r.ov[%s].xlen = %d; r.ov[%s].xoff = %d]],
         insert(res, format('r.ot[%s] = %d; r.ov[%s].%s = r.v[%s].%s',
                             pos, opt[1], pos, opt[2],
                             varref(o.ipv, o.ipo, varmap), opt[3]))
+    elseif o.op == opcode.PUTSPAN   then
+        local pos = varref(0, o.offset, varmap)
+        local ipos = varref(o.ipv, o.ipo, varmap)
+        insert(res, format('r.ot[%s] = 21; r.ov[%s].xoff = r.bo[%s]; ' ..
+                           'r.ov[%s].xlen = r.bo[%s]-r.bo[%s+r.v[%s].xoff]',
+                           pos, pos, ipos, pos, ipos, ipos, ipos))
     -----------------------------------------------------------
     elseif o.op == opcode.PUTENUMI2S then
         il.emit_putenumi2s(o, res, varmap)
@@ -346,6 +433,20 @@ end
 
 local emit_nested_block
 
+-- Count hits of a branch in a profiling build.
+local function emit_profile_counter(ctx, block, branch, res)
+    local il = ctx.il
+    if not il.profile_counters then return end
+    local counter = branch.profile_counter
+    if not counter then
+        insert(il.profile_counters, { block.profile_id, branch_key(il, branch) })
+        counter = #il.profile_counters - 1
+        branch.profile_counter = counter
+    end
+    insert(res, format('rt_profile[%d] = rt_profile[%d] + 1',
+                       counter, counter))
+end
+
 local function emit_if_block(ctx, block, cc, res)
     local varmap  = ctx.varmap
     local head, branch1, branch2 = block[1], block[2], block[3]
@@ -359,17 +460,77 @@ local function emit_if_block(ctx, block, cc, res)
                             varref(head.ipv, head.ipo, varmap),
                             branch1[1].ci == 0 and '==' or '~='))
     end
+    emit_profile_counter(ctx, block, branch1, res)
     emit_nested_block(ctx, branch1, cc, res)
     if branch2 then
         assert(branch2[1].op == opcode.IBRANCH)
         assert(branch2[1].ci ~= branch1[1].ci)
         insert(res, 'else')
+        emit_profile_counter(ctx, block, branch2, res)
         emit_nested_block(ctx, branch2, cc, res)
     end
     insert(res, 'end')
 end
 
+-- Binary search over the values of a large INTSWITCH; order lists
+-- branches sorted by value. If the values are dense, the range is
+-- checked upfront, otherwise leaves check for equality.
+local function emit_intswitch_tree(ctx, block, order, dense, lo, hi, pos,
+                                   cc, res)
+    if lo == hi then
+        local branch = block[order[lo]]
+        if not dense then
+            insert(res, format('if r.v[%s].ival ~= %d then', pos,
+                               branch[1].ci))
+            insert(res, format('rt_err_value(r, %s)\nend', pos))
+        end
+        emit_profile_counter(ctx, block, branch, res)
+        return emit_nested_block(ctx, branch, cc, res)
+    end
+    local mid = floor((lo + hi + 1) / 2)
+    insert(res, format('if r.v[%s].ival < %d then', pos,
+                       block[order[mid]][1].ci))
+    emit_intswitch_tree(ctx, block, order, dense, lo, mid - 1, pos, cc, res)
+    insert(res, 'else')
+    emit_intswitch_tree(ctx, block, order, dense, mid, hi, pos, cc, res)
+    insert(res, 'end')
+end
+
+-- A wide union: the branch is picked with about log2(n) compares
+-- regardless of its position.
+local function emit_large_intswitch_block(ctx, block, cc, res)
+    local head  = block[1]
+    local pos   = varref(head.ipv, head.ipo, ctx.varmap)
+    local hot   = block.profile_hot
+    local order = {}
+    if hot then
+        insert(res, format('if r.v[%s].ival == %d then', pos, hot[1].ci))
+        emit_profile_counter(ctx, block, hot, res)
+        emit_nested_block(ctx, hot, cc, res)
+        insert(res, 'else')
+    end
+    for i = 2, #block do
+        assert(block[i][1].op == opcode.IBRANCH)
+        if block[i] ~= hot then insert(order, i) end
+    end
+    sort(order, function(a, b) return block[a][1].ci < block[b][1].ci end)
+    local n = #order
+    local min, max = block[order[1]][1].ci, block[order[n]][1].ci
+    local dense = max - min == n - 1
+    if dense then
+        insert(res, format([[
+if r.v[%s].ival < %d or r.v[%s].ival > %d then
+    rt_err_value(r, %s)
+end]], pos, min, pos, max, pos))
+    end
+    emit_intswitch_tree(ctx, block, order, dense, 1, n, pos, cc, res)
+    if hot then insert(res, 'end') end
+end
+
 local function emit_intswitch_block(ctx, block, cc, res)
+    if #block - 1 > ctx.il.intswitch_threshold then
+        return emit_large_intswitch_block(ctx, block, cc, res)
+    end
     local varmap = ctx.varmap
     local head   = block[1]
     local pos    = varref(head.ipv, head.ipo, varmap)
@@ -381,6 +542,7 @@ local function emit_intswitch_block(ctx, block, cc, res)
 
         insert(res, format('%s r.v[%s].ival == %d then',
                             if_or_elseif, pos, branch_head.ci))
+        emit_profile_counter(ctx, block, branch, res)
         emit_nested_block(ctx, branch, cc, res)
     end
     insert(res, 'else')
@@ -402,8 +564,60 @@ local function create_strswitch_hash_func(il, block)
                                  random_bytes, #random_bytes)
 end
 
+-- Binary search over the slots a large STRSWITCH maps keys to;
+-- order lists branches sorted by slot. The slot is verified already,
+-- hence no equality checks.
+local function emit_strswitch_tree(ctx, block, order, slots, lo, hi, cc, res)
+    if lo == hi then
+        emit_profile_counter(ctx, block, block[order[lo]], res)
+        return emit_nested_block(ctx, block[order[lo]], cc, res)
+    end
+    local mid = floor((lo + hi + 1) / 2)
+    insert(res, format('if t < %d then', slots[order[mid]]))
+    emit_strswitch_tree(ctx, block, order, slots, lo, mid - 1, cc, res)
+    insert(res, 'else')
+    emit_strswitch_tree(ctx, block, order, slots, mid, hi, cc, res)
+    insert(res, 'end')
+end
+
+local function emit_large_strswitch_block(ctx, block, cc, res)
+    local il     = ctx.il
+    local head   = block[1]
+    local pos    = varref(head.ipv, head.ipo, ctx.varmap)
+    local strings, order = {}, {}
+    for i = 2, #block do
+        local branch_head = block[i][1]
+        assert(branch_head.op == opcode.SBRANCH)
+        insert(strings, il.get_extra(branch_head))
+    end
+    local index, slots = il.emit_strswitch_index(strings, pos, res), {}
+    for i = 2, #block do
+        slots[i] = index[i - 1]
+    end
+    -- the branch taken almost always is checked first
+    local hot = block.profile_hot
+    for i = 2, #block do
+        if block[i] == hot then
+            insert(res, format('if t == %d then', slots[i]))
+            emit_profile_counter(ctx, block, hot, res)
+            emit_nested_block(ctx, hot, cc, res)
+            insert(res, 'else')
+        else
+            insert(order, i)
+        end
+    end
+    sort(order, function(a, b) return slots[a] < slots[b] end)
+    if order[1] then
+        emit_strswitch_tree(ctx, block, order, slots, 1, #order, cc, res)
+    end
+    if hot then insert(res, 'end') end
+end
+
 local function emit_strswitch_block(ctx, block, cc, res)
     local il     = ctx.il
+    if il.enable_fast_strings and #block - 1 > il.strswitch_threshold then
+        return emit_large_strswitch_block(ctx, block, cc, res)
+    end
     local varmap = ctx.varmap
     local head   = block[1]
     local func   = create_strswitch_hash_func(il, block)
@@ -431,6 +645,7 @@ if rt_C.schema_rt_key_eq(r.b2-%d, r.b1-r.v[%s].xoff, %d, r.v[%s].xlen) ~= 0 then
             insert(res, format('%s t == %q then',
                                if_or_elseif, str))
         end
+        emit_profile_counter(ctx, block, branch, res)
         emit_nested_block(ctx, branch, cc, res)
     end
     insert(res, 'else')
@@ -612,6 +827,7 @@ local function emit_func_body(il, func, nlocals_min, res)
                            'local x%d, x%d, x%d, x%d',
                            i, i+1, i+2, i+3))
     end
+    profile_annotate(il, func)
     if il.enable_loop_peeling then
         peel_annotate(func, 0)
     end
@@ -811,17 +1027,52 @@ r.ov[%s].xoff = (%s)[r.v[%s].ival*2+1];]],
         emit(o, res, varmap)
     end
 
+    -- Build a string phf mapping s[0..n-1] into 0..m range
+    -- (m is typically 1.1x n). Returns index (index[i] is the slot of
+    -- s[i]), m and a function emitting the slot computation, hence t,
+    -- given the input position.
+    local function string_phf_prepare(s, n)
+        local seed = 0
+        local phf = ffi.gc(ffi_new('struct schema_rt_phf'),
+                           rt_C.phf_destroy)
+        local k = ffi_new('struct schema_rt_phf_string[?]', n)
+        for i = 0, n-1 do
+            k[i].p, k[i].n = s[i], #s[i]
+        end
+        local res = rt_C.phf_init_string(phf, k, n, 4, 90, seed, 1)
+        if res ~= 0 then error('internal error: phf: '..res) end
+        rt_C.phf_compact(phf)
+        local g_width = byte('#\1#\2#\4', phf.g_op) -- 2:int8 4:int16 6:int32
+        local phf_hash = rt_C['phf_hash_string_band_raw'..g_width*8]
+        local r = tonumber(phf.r)
+        local m = tonumber(phf.m)
+        local index = {}
+        for i = 0, n-1 do
+            index[i] = phf_hash(phf.g, s[i], #s[i], seed, r, m)
+        end
+        cpool_align(4)
+        local g_offset = cpool_add_raw(ffi_string(phf.g, phf.r*(g_width)))
+        return index, m, function(pos, res)
+            insert(res, format([[
+t = rt_C.phf_hash_string_band_raw%d(r.b2-%d, r.b1-r.v[%s].xoff, r.v[%s].xlen, %d, %d, %d)]],
+                               g_width*8, g_offset, pos, pos, seed, r, m))
+        end
+    end
+
     -- Compute data tables for PUTENUMS2I
     --
-    -- <str> -(hash_fn)-> <any_int> -(phf_fn)-> index:0..m -(aux_table)-> res
+    -- <str> -(hash_fn)-> <any_int> -(search)-> index:0..n -(aux_table)-> res
+    -- <str> -(string phf)-> index:0..m -(aux_table)-> res
     --
-    -- First we build a perfect hash_func to map an input string to an int.
-    -- The result is highly dispersed, so we build an integer phf to compress
-    -- it into 0..m range (m is typically 1.1x the total number of entries).
+    -- A small enum is mapped to an int with a perfect hash_func first,
+    -- the result is highly dispersed, so it is searched in a sorted table.
+    -- A large one gets a string phf mapping the string into 0..m range
+    -- (m is typically 1.1x the total number of entries) directly.
     -- Finally, we add aux_table of m*3 elements filled with the triples:
     --   str_len, str_offset, v.
+    -- Yields a function emitting the index computation, hence t, given
+    -- the input position.
     local function putenums2i_prepare(tab)
-        local seed = 0
         local s = {}
         local n = 0
         local v_max = 0
@@ -832,52 +1083,43 @@ r.ov[%s].xoff = (%s)[r.v[%s].ival*2+1];]],
             s[n] = k
             n = n + 1
         end
-        local hash_func = 0
-        if il.enable_fast_strings then
-            local _s = ffi_new('const char * [?]', n)
+        local eval_index, m
+        local index = {}
+        if n > il.phf_threshold then
+            index, m, eval_index = string_phf_prepare(s, n)
+        else
+            local hash_func = 0
+            if il.enable_fast_strings then
+                local _s = ffi_new('const char * [?]', n)
+                for i = 0, n-1 do
+                    _s[i] = s[i]
+                end
+                hash_func = rt_C.create_hash_func(n, _s, random_bytes,
+                                                  #random_bytes)
+            end
+            assert(hash_func ~= 0) -- fixme
+            local h = ffi_new('uint32_t[?]', n)
             for i = 0, n-1 do
-                _s[i] = s[i]
+                h[i] = rt_C.eval_hash_func(hash_func, s[i], #s[i])
+                index[i] = i
             end
-            hash_func = rt_C.create_hash_func(n, _s, random_bytes,
-                                              #random_bytes)
-        end
-        assert(hash_func ~= 0) -- fixme
-        -- only use phf if enum is large
-        local phf = n > il.phf_threshold and
-                    ffi.gc(ffi_new('struct schema_rt_phf'),
-                           rt_C.phf_destroy)
-        local h = ffi_new('int32_t[?]', n)
-        for i = 0, n-1 do
-            h[i] = rt_C.eval_hash_func(hash_func, s[i], #s[i])
-        end
-        local eval_phf_func, m
-        if phf then
-            local res = rt_C.phf_init_uint32(phf, h, n, 4, 90, seed, 1)
-            if res ~= 0 then error('internal error: phf: '..res) end
-            rt_C.phf_compact(phf)
-            local g_width = byte('#\1#\2#\4', phf.g_op) -- 2:int8 4:int16 6:int32
-            cpool_align(4)
-            local g_offset = cpool_add_raw(ffi_string(phf.g, phf.r*(g_width)))
-            local r
-            r, m = tonumber(phf.r), tonumber(phf.m)
-            eval_phf_func = format([[
-t = rt_C.phf_hash_uint32_band_raw%d(r.b2-%d, t, %d, %d, %d)]],
-                                   g_width*8, g_offset, seed, r, m)
-        else
             local tab, tab_bits = cpool_add_uint_array(h, n)
-            m, eval_phf_func = n, format('t = rt_C.schema_rt_search%d(%s, t, %d)',
-                                         tab_bits, tab, n)
+            m = n
+            eval_index = function(pos, res)
+                emit_compute_hash_func(hash_func, pos, res)
+                insert(res, format('t = rt_C.schema_rt_search%d(%s, t, %d)',
+                                   tab_bits, tab, n))
+            end
         end
         local aux_table = {}
         for i = 0, n-1 do
             local str = s[i]
             local v   = tab[str]
-            local index = phf and rt_C.phf_hash_uint32(phf, h[i]) or i
-            aux_table[index*3    ] = #str
-            aux_table[index*3 + 1] = il.cpool_add(str)
-            aux_table[index*3 + 2] = v == -1 and v_max + 1 or v
+            aux_table[index[i]*3    ] = #str
+            aux_table[index[i]*3 + 1] = il.cpool_add(str)
+            aux_table[index[i]*3 + 2] = v == -1 and v_max + 1 or v
         end
-        return hash_func, eval_phf_func, is_sparse and v_max,
+        return eval_index, is_sparse and v_max,
                cpool_add_uint_array(aux_table, m*3)
     end
 
@@ -889,12 +1131,10 @@ t = rt_C.phf_hash_uint32_band_raw%d(r.b2-%d, t, %d, %d, %d)]],
         local tab  = il.get_extra(o)
         local emit = s2i_cache[tab]
         if not emit then
-            local hash_func, eval_phf_func, v_max, aux_table =
-                putenums2i_prepare(tab)
+            local eval_index, v_max, aux_table = putenums2i_prepare(tab)
             emit = function(o, res, varmap)
                 local pos = varref(o.ipv, o.ipo, varmap)
-                emit_compute_hash_func(hash_func, pos, res)
-                insert(res, eval_phf_func)
+                eval_index(pos, res)
                 insert(res, format([[
 if rt_C.schema_rt_key_eq(r.b2-(%s)[t*3+1], r.b1-r.v[%s].xoff, (%s)[t*3], r.v[%s].xlen) ~= 0 then
     rt_err_value(r, %s)
@@ -915,13 +1155,55 @@ r.ot[%s] = 4; r.ov[%s].ival = (%s)[t*3+2];]],
         emit(o, res, varmap)
     end
 
+    -- STRSWITCH handling (large switches)
+    -- Keys are mapped to slots with a string phf, aux_table holds
+    -- str_len, str_offset pairs for every slot (unused slots have zero
+    -- length, schema_rt_key_eq rejects those). Emits the code leaving
+    -- the slot in t (or raising an error if the key is unknown) and
+    -- returns the slot of every string. Switches on the same keys
+    -- (e.g. a record in flatten and xflatten) share the tables.
+    local strswitch_cache = {}
+    function il.emit_strswitch_index(strings, pos, res)
+        local key = concat(strings, '\0')
+        local emit = strswitch_cache[key]
+        if not emit then
+            local n, s = #strings, {}
+            for i = 0, n-1 do
+                s[i] = strings[i + 1]
+            end
+            local index, m, eval_index = string_phf_prepare(s, n)
+            local slots, aux_table = {}, {}
+            for i = 0, n-1 do
+                slots[i + 1] = index[i]
+                aux_table[index[i]*2    ] = #s[i]
+                aux_table[index[i]*2 + 1] = il.cpool_add(s[i])
+            end
+            aux_table = cpool_add_uint_array(aux_table, m*2)
+            emit = function(pos, res)
+                eval_index(pos, res)
+                insert(res, format([[
+if rt_C.schema_rt_key_eq(r.b2-(%s)[t*2+1], r.b1-r.v[%s].xoff, (%s)[t*2], r.v[%s].xlen) ~= 0 then
+    rt_err_value(r, %s)
+end]], aux_table, pos, aux_table, pos, pos))
+                return slots
+            end
+            strswitch_cache[key] = emit
+        end
+        return emit(pos, res)
+    end
+
     function il.emit_lua_func(func, res, opts)
         return emit_func(il, func, res, opts)
     end
 
     il.enable_loop_peeling = (opts.enable_loop_peeling ~= false)
     il.enable_fast_strings = (opts.enable_fast_strings ~= false)
-    il.phf_threshold       = (opts.phf_threshold or 8)
+    il.phf_threshold       = (opts.phf_threshold or 64)
+    il.strswitch_threshold = (opts.strswitch_threshold or 8)
+    il.intswitch_threshold = (opts.intswitch_threshold or 8)
+    il.profile             = opts.profile
+    il.profile_nblocks     = 0
+    il.profile_counters    = opts.profile == true and {} or nil
 
     return il
 end
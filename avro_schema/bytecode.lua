@@ -0,0 +1,335 @@
+local ffi            = require('ffi')
+local ffi_new        = ffi.new
+local ffi_string     = ffi.string
+local ffi_sizeof     = ffi.sizeof
+local insert, sort   = table.insert, table.sort
+local concat         = table.concat
+
+local opcode = ffi_new('struct schema_il_Opcode')
+
+-- Bytecode for the interpreter in pipeline.c (schema_rt_interp).
+--
+-- Code is a sequence of 32 bit words. Instructions having an IL
+-- counterpart keep the IL opcode, the rest are listed below (see
+-- enum InterpOp for the operands). Nested IL blocks are turned into
+-- jumps, variables into registers of a function frame; register 0
+-- is $0, register 1 is the function argument.
+local FUNC, RET, JMP, JZ, JNZ, JNUL, JNOTNUL, FOREACH, PUTC =
+      0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09
+
+local NILREG = 0xffffffff
+
+-- output type of PUT*C
+local putc_type = {
+    [opcode.PUTNULC   ] =  1,
+    [opcode.PUTBOOLC  ] =  2,
+    [opcode.PUTINTC   ] =  4,
+    [opcode.PUTLONGC  ] =  4,
+    [opcode.PUTFLOATC ] =  6,
+    [opcode.PUTDOUBLEC] =  7,
+    [opcode.PUTARRAYC ] = 11,
+    [opcode.PUTMAPC   ] = 12,
+    [opcode.PUTDUMMYC ] = 17,
+    [opcode.PUTSTRC   ] = 18,
+    [opcode.PUTBINC   ] = 19,
+    [opcode.PUTXC     ] = 20
+}
+
+local raw64 = ffi_new('union { uint64_t u; int64_t i; double d; }')
+
+-- yields a word given a (possibly negative) 32 bit int
+local function word(i)
+    return i < 0 and i + 0x100000000 or i
+end
+
+-- lo, hi words of a 64 bit value
+local function words64(raw)
+    return tonumber(raw.u % 0x100000000ULL), tonumber(raw.u / 0x100000000ULL)
+end
+
+-- strings sorted by length first, matches interp_str_cmp()
+local function str_less(a, b)
+    if #a ~= #b then return #a < #b end
+    return a < b
+end
+
+local emit_block
+
+local function emit_instruction(ctx, o)
+    local emit, reg = ctx.emit, ctx.reg
+    local op = o.op
+    if     op == opcode.CALLFUNC then
+        emit(op, o.ripv == NILREG and NILREG or reg(o.ripv), reg(o.ipv),
+             word(o.ipo), word(o.k), ctx.func_label(ctx.il.get_extra(o)))
+    elseif op == opcode.MOVE or op == opcode.SKIP or op == opcode.PSKIP then
+        if o.ripv ~= NILREG then
+            emit(op, reg(o.ripv), reg(o.ipv), word(o.ipo))
+        end
+    elseif putc_type[op] then
+        local t, lo, hi = putc_type[op], 0, 0
+        if op == opcode.PUTBOOLC then
+            t = o.ci == 0 and 2 or 3
+        elseif op == opcode.PUTINTC or op == opcode.PUTARRAYC or
+               op == opcode.PUTMAPC then
+            raw64.i = o.ci
+            lo, hi = words64(raw64)
+        elseif op == opcode.PUTLONGC then
+            raw64.i = o.cl
+            lo, hi = words64(raw64)
+        elseif op == opcode.PUTFLOATC or op == opcode.PUTDOUBLEC then
+            raw64.d = o.cd
+            lo, hi = words64(raw64)
+        elseif op == opcode.PUTSTRC or op == opcode.PUTBINC or
+               op == opcode.PUTXC then
+            local str = ctx.il.get_extra(o)
+            lo, hi = #str, ctx.cpool_add(str)
+        end
+        emit(PUTC, o.offset, t, lo, hi)
+    elseif op == opcode.PUTINTKC then
+        emit(op, o.offset, word(o.ci))
+    elseif op >= opcode.PUTBOOL and op <= opcode.PUTBIN2STR or
+           op == opcode.PUTSPAN then
+        emit(op, o.offset, reg(o.ipv), word(o.ipo))
+    elseif op == opcode.PUTENUMI2S then
+        local tab = ctx.il.get_extra(o)
+        local sparse = 0
+        for i = 1, #tab do
+            if tab[i] == '' then sparse = 1 end
+        end
+        emit(op, o.offset, reg(o.ipv), word(o.ipo), #tab, sparse)
+        for i = 1, #tab do
+            emit(#tab[i], ctx.cpool_add(tab[i]))
+        end
+    elseif op == opcode.PUTENUMS2I then
+        local tab, keys = ctx.il.get_extra(o), {}
+        for k in pairs(tab) do insert(keys, k) end
+        sort(keys, str_less)
+        emit(op, o.offset, reg(o.ipv), word(o.ipo), #keys)
+        for _, k in ipairs(keys) do
+            emit(#k, ctx.cpool_add(k), word(tab[k]))
+        end
+    elseif op >= opcode.ISBOOL and op <= opcode.ISNULORMAP or
+           op == opcode.ERRVALUEV then
+        emit(op, reg(o.ipv), word(o.ipo))
+    elseif op == opcode.LENIS then
+        emit(op, reg(o.ipv), word(o.ipo), o.len)
+    elseif op == opcode.ISSET then
+        emit(op, reg(o.ripv), reg(o.ipv), word(o.ipo),
+             ctx.const_add(ctx.il.get_extra(o)))
+    elseif op == opcode.ISNOTSET or op == opcode.BEGINVAR then
+        emit(op, reg(o.ipv))
+    elseif op == opcode.CHECKOBUF then
+        if o.ipv == NILREG then
+            emit(op, o.offset, NILREG, 0, 0)
+        else
+            emit(op, o.offset, reg(o.ipv), word(o.ipo), o.scale)
+        end
+    elseif op == opcode.ERROR then
+        emit(op, ctx.const_add(ctx.il.get_extra(o)))
+    elseif op ~= opcode.ENDVAR then
+        assert(false)
+    end
+end
+
+local function emit_if_block(ctx, block)
+    local emit, reg, label, place = ctx.emit, ctx.reg, ctx.label, ctx.place
+    local head, branch1, branch2 = block[1], block[2], block[3]
+    assert(branch1[1].op == opcode.IBRANCH)
+    -- jump over branch1 unless it's condition holds
+    local skip = label()
+    if head.op == opcode.IFNUL then
+        emit(branch1[1].ci == 0 and JNUL or JNOTNUL,
+             reg(head.ipv), word(head.ipo), skip)
+    else
+        emit(branch1[1].ci == 0 and JNZ or JZ, reg(head.ipv), skip)
+    end
+    emit_block(ctx, branch1)
+    if branch2 then
+        assert(branch2[1].op == opcode.IBRANCH)
+        assert(branch2[1].ci ~= branch1[1].ci)
+        local done = label()
+        emit(JMP, done)
+        place(skip)
+        emit_block(ctx, branch2)
+        place(done)
+    else
+        place(skip)
+    end
+end
+
+-- INTSWITCH / STRSWITCH, the table is binary searched
+local function emit_switch_block(ctx, block)
+    local emit, label, place = ctx.emit, ctx.label, ctx.place
+    local head = block[1]
+    local cases, case_labels = {}, {}
+    for i = 2, #block do
+        local branch_head = block[i][1]
+        local case = { label = label() }
+        case_labels[i] = case.label
+        if head.op == opcode.INTSWITCH then
+            assert(branch_head.op == opcode.IBRANCH)
+            case.key = branch_head.ci
+        else
+            assert(branch_head.op == opcode.SBRANCH)
+            case.key = ctx.il.get_extra(branch_head)
+        end
+        insert(cases, case)
+    end
+    if head.op == opcode.INTSWITCH then
+        sort(cases, function(a, b) return a.key < b.key end)
+    else
+        sort(cases, function(a, b) return str_less(a.key, b.key) end)
+    end
+    emit(head.op, ctx.reg(head.ipv), word(head.ipo), #cases)
+    for _, case in ipairs(cases) do
+        if head.op == opcode.INTSWITCH then
+            emit(word(case.key), case.label)
+        else
+            emit(#case.key, ctx.cpool_add(case.key), case.label)
+        end
+    end
+    local done = label()
+    for i = 2, #block do
+        place(case_labels[i])
+        emit_block(ctx, block[i])
+        if i ~= #block then emit(JMP, done) end
+    end
+    place(done)
+end
+
+local function emit_objforeach_block(ctx, block)
+    local emit, reg, label, place = ctx.emit, ctx.reg, ctx.label, ctx.place
+    local head = block[1]
+    assert(head.ripv ~= NILREG)
+    local itervar = reg(head.ripv)
+    local loop, done = label(), label()
+    emit(opcode.MOVE, itervar, reg(head.ipv), word(head.ipo + 1 - head.step))
+    place(loop)
+    emit(FOREACH, itervar, reg(head.ipv), word(head.ipo), head.step, done)
+    emit_block(ctx, block)
+    emit(JMP, loop)
+    place(done)
+end
+
+emit_block = function(ctx, block)
+    for i = 2, #block do
+        local o = block[i]
+        if type(o) == 'cdata' then
+            emit_instruction(ctx, o)
+        else
+            local head = o[1]
+            if     head.op == opcode.IFSET or head.op == opcode.IFNUL then
+                emit_if_block(ctx, o)
+            elseif head.op == opcode.INTSWITCH or
+                   head.op == opcode.STRSWITCH then
+                emit_switch_block(ctx, o)
+            elseif head.op == opcode.OBJFOREACH then
+                emit_objforeach_block(ctx, o)
+            else
+                assert(false)
+            end
+        end
+    end
+end
+
+-- Translates IL functions into a program. Returns a table:
+--  .code    - bytecode (a string)
+--  .cpool   - string constants (accessed via r.b2, see backend.lua)
+--  .consts  - strings referenced by error reports
+--  .entries - entry of each function, in the il_code order
+local function gen_program(il, il_code)
+    local code, nwords = {}, 0
+    local fixups = {}
+    local func_labels = {}
+
+    -- cpool, offsets are relative to the END
+    local cpool, cpos, cpool_cache = {}, 0, {}
+    local function cpool_add(str)
+        local res = cpool_cache[str]
+        if res then return res end
+        insert(cpool, str)
+        cpos = cpos + #str
+        cpool_cache[str] = cpos
+        return cpos
+    end
+
+    local consts, consts_cache = {}, {}
+    local function const_add(str)
+        local res = consts_cache[str]
+        if res then return res end
+        insert(consts, str)
+        consts_cache[str] = #consts - 1
+        return #consts - 1
+    end
+
+    -- labels are tables, patched once placed
+    local function label() return {} end
+    local function place(l) l.pos = nwords end
+    local function emit(...)
+        for i = 1, select('#', ...) do
+            local w = select(i, ...)
+            if type(w) == 'table' then
+                insert(fixups, nwords)
+            end
+            code[nwords] = w
+            nwords = nwords + 1
+        end
+    end
+    local function func_label(name)
+        local l = func_labels[name]
+        if not l then
+            l = label()
+            func_labels[name] = l
+        end
+        return l
+    end
+
+    local ctx = {
+        il = il, emit = emit, label = label, place = place,
+        cpool_add = cpool_add, const_add = const_add,
+        func_label = func_label
+    }
+    local entries = {}
+    for i, func in ipairs(il_code) do
+        local head = func[1]
+        -- registers are allocated on the first use
+        local regs, nregs = { [0] = 0, [head.ipv] = 1 }, 2
+        ctx.reg = function(v)
+            local r = regs[v]
+            if not r then
+                r, nregs = nregs, nregs + 1
+                regs[v] = r
+            end
+            return r
+        end
+        local entry = func_label(head.name)
+        place(entry)
+        entries[i] = nwords
+        emit(FUNC, 0)
+        emit_block(ctx, func)
+        emit(RET)
+        code[entry.pos + 1] = nregs
+    end
+    for _, pos in ipairs(fixups) do
+        code[pos] = code[pos].pos
+    end
+
+    local buf = ffi_new('uint32_t[?]', nwords)
+    for i = 0, nwords - 1 do
+        buf[i] = code[i]
+    end
+    local cpool_data = {}
+    for i = #cpool, 1, -1 do
+        insert(cpool_data, cpool[i])
+    end
+    return {
+        code = ffi_string(buf, ffi_sizeof('uint32_t') * nwords),
+        cpool = concat(cpool_data),
+        consts = consts,
+        entries = entries
+    }
+end
+
+return {
+    gen_program = gen_program
+}
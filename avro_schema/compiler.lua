@@ -285,6 +285,22 @@ local ir2ilfuncs = {
     STR2BIN  = { is = 'isstr',    put = 'putstr2bin' }
 }
 
+-- Basic types whose conversion yields the input value as is; arrays
+-- and maps of these are copied from the input verbatim (PUTSPAN),
+-- elements are only checked. Floats are excluded since an integer is
+-- accepted and converted.
+local span_types = {
+    NUL = true, BOOL = true, INT = true, LONG = true, BIN = true,
+    STR = true, INT2LONG = true
+}
+
+local function is_span_type(ir)
+    if type(ir) == 'table' and ir.type then
+        return ir.type == 'FIXED'
+    end
+    return span_types[type(ir) == 'table' and ir[1] or ir] == true
+end
+
 --
 -- This function is helper for nullable type code emitting.
 -- It checks if the argument is nullable, then:
@@ -355,7 +371,15 @@ local function do_append_code(il, mode, code, ir, ipv, ipo, is_flatten)
         if find(mode, 'n') then insert(code, il.move(ipv, ipv, ipo + 1)) end
     elseif ir_type == 'ARRAY' then
         if find(mode, 'c') then insert(code, il.isarray(ipv, ipo)) end
-        if find(mode, 'x') then
+        if find(mode, 'x') and is_span_type(ir.nested) then
+            extend(code,
+                   il.checkobuf(1),
+                   il.putspan(0, ipv, ipo),
+                   il.move(0, 0, 1))
+            local loop_var, loop_body = append_objforeach(il, code,
+                ipv, ipo)
+            il:append_code('cn', loop_body, ir.nested, loop_var, 0)
+        elseif find(mode, 'x') then
             extend(code,
                    il.checkobuf(1),
                    il.putarray(0, ipv, ipo),
@@ -370,7 +394,13 @@ local function do_append_code(il, mode, code, ir, ipv, ipo, is_flatten)
         end
     elseif ir_type == 'MAP' then
         if find(mode, 'c') then insert(code, il.ismap(ipv, ipo)) end
-        if find(mode, 'x') then
+        if find(mode, 'x') and is_span_type(ir.nested) then
+            extend(code, il.checkobuf(1),
+                   il.putspan(0, ipv, ipo), il.move(0, 0, 1))
+            local loop_var, loop_body = append_objforeach(il, code, ipv, ipo)
+            insert(loop_body, il.isstr(loop_var, 0))
+            il:append_code('cn', loop_body, ir.nested, loop_var, 1)
+        elseif find(mode, 'x') then
             extend(code, il.checkobuf(1),
                    il.putmap(0, ipv, ipo), il.move(0, 0, 1))
             local loop_var, loop_body = append_objforeach(il, code, ipv, ipo)
@@ -1070,12 +1100,71 @@ local function emit_code(il, ir, service_fields, alpha_nullable_record_xflatten)
     -- xflatten: skip output cell #0 (array header)
     insert(funcs[3], 2, il.move(0, 0, 1))
 
+    -- validate, check_flat: flatten and unflatten checks only, helpers
+    -- they call go last
+    for i = 1, 2 do
+        local code = il.strip_output(funcs, i)
+        insert(funcs, 3 + i, code[1])
+        for j = 2, #code do
+            insert(funcs, code[j])
+        end
+    end
+
     return funcs,
            from and abs(schema_width(from)) or 1,
            to and abs(schema_width(to)) or 1
 end
 
+-----------------------------------------------------------------------
+-- skip plan
+
+-- Dropped ARRAY and MAP fields are only checked for type and skipped
+-- (mode 'cn'), hence the parser needn't store their contents.
+
+local function is_skippable(ir)
+    local ir_type = ir and ir.type
+    return ir_type == 'ARRAY' or ir_type == 'MAP'
+end
+
+-- flatten: keys in the root MAP
+local function skip_plan_flatten(ir)
+    local keys = {}
+    for i, field in ipairs(ir.from.fields) do
+        if not ir.i2o[i] and is_skippable(unwrap_ir(ir[i])) then
+            insert(keys, field.name)
+        end
+    end
+    return keys
+end
+
+-- unflatten: positions in the root ARRAY (records are inlined)
+local function skip_plan_unflatten(ir, pos, cn_mode, res)
+    local i2o, to_fields = ir.i2o, ir.to.fields
+    for i, field in ipairs(ir.from.fields) do
+        local o = i2o[i]
+        local field_cn_mode = cn_mode or not o or to_fields[o].hidden
+        local field_ir = unwrap_ir(ir[i])
+        if field_cn_mode and is_skippable(field_ir) then
+            insert(res, pos)
+        elseif field_ir.type == '__RECORD__' and not field_ir.from.nullable then
+            skip_plan_unflatten(field_ir, pos, field_cn_mode, res)
+        end
+        pos = pos + abs(schema_width(field.type))
+    end
+    return res
+end
+
+local function emit_skip_plan(ir, service_fields)
+    ir = unwrap_ir(ir)
+    if ir.type ~= '__RECORD__' or ir.from.nullable or ir.to.nullable then
+        return {}, {}
+    end
+    return skip_plan_flatten(ir),
+           skip_plan_unflatten(ir, #service_fields, false, {})
+end
+
 -----------------------------------------------------------------------
 return {
-    emit_code = emit_code
+    emit_code      = emit_code,
+    emit_skip_plan = emit_skip_plan
 }
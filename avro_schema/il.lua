@@ -116,6 +116,9 @@ if not loaded then
 
         static const int ERROR   = 0xfe;
 
+        // copy the item verbatim from the input, containers included
+        static const int PUTSPAN     = 0xff;
+
         static const unsigned NILREG  = 0xffffffff;
     };
 
@@ -166,7 +169,7 @@ local op2str = {
     [opcode.ISSET      ] = 'ISSET      ',   [opcode.ISNOTSET   ] = 'ISNOTSET   ',
     [opcode.BEGINVAR   ] = 'BEGINVAR   ',   [opcode.ENDVAR     ] = 'ENDVAR     ',
     [opcode.CHECKOBUF  ] = 'CHECKOBUF  ',   [opcode.ERRVALUEV  ] = 'ERRVALUEV  ',
-    [opcode.ERROR      ] = 'ERROR      ',
+    [opcode.ERROR      ] = 'ERROR      ',   [opcode.PUTSPAN    ] = 'PUTSPAN    ',
 }
 
 local function opcode_new(op)
@@ -287,6 +290,7 @@ local il_methods = {
     putflt2dbl  = opcode_ctor_offset_ipv_ipo(opcode.PUTFLT2DBL),
     putstr2bin  = opcode_ctor_offset_ipv_ipo(opcode.PUTSTR2BIN),
     putbin2str  = opcode_ctor_offset_ipv_ipo(opcode.PUTBIN2STR),
+    putspan     = opcode_ctor_offset_ipv_ipo(opcode.PUTSPAN),
     ----------------------------------------------------------------
     isbool      = opcode_ctor_ipv_ipo(opcode.ISBOOL),
     isint       = opcode_ctor_ipv_ipo(opcode.ISINT),
@@ -392,7 +396,8 @@ local function opcode_vis(o, extra)
         return format('%s [%s],\t%s', opname, rvis(0, o.offset), cvis(o, extra))
     elseif o.op == opcode.PUTXC then
         return format('%s [%s],\t%s', opname, rvis(0, o.offset), cvis(o, extra, msgpack_decode))
-    elseif o.op >= opcode.PUTBOOL and o.op <= opcode.PUTBIN2STR then
+    elseif o.op >= opcode.PUTBOOL and o.op <= opcode.PUTBIN2STR or
+           o.op == opcode.PUTSPAN then
         return format('%s [%s],\t[%s]', opname, rvis(0, o.offset), rvis(o.ipv, o.ipo))
     elseif o.op == opcode.PUTENUMI2S or o.op == opcode.PUTENUMS2I then
         return format('%s [%s],\t[%s],\t%s', opname,
@@ -532,7 +537,8 @@ local function vexecute(il, scope, o, res)
     if (o.op == opcode.CALLFUNC or
         o.op >= opcode.IFNUL and o.op <= opcode.PSKIP or
         o.op >= opcode.PUTBOOL and o.op <= opcode.ISSET or
-        o.op == opcode.CHECKOBUF or o.op == opcode.ERRVALUEV) and
+        o.op == opcode.CHECKOBUF or o.op == opcode.ERRVALUEV or
+        o.op == opcode.PUTSPAN) and
        o.ipv ~= opcode.NILREG then
 
         local vinfo = vlookup(scope, o.ipv)
@@ -540,7 +546,7 @@ local function vexecute(il, scope, o, res)
     end
     local fixoffset = 0
     if o.op >= opcode.PUTBOOLC and o.op <= opcode.PUTENUMS2I or
-       o.op == opcode.CHECKOBUF then
+       o.op == opcode.CHECKOBUF or o.op == opcode.PUTSPAN then
 
         local vinfo = vlookup(scope, 0)
         fixoffset = vinfo.inc
@@ -871,6 +877,70 @@ local function voptimize(il, code)
     return res
 end
 
+-- Output is stripped: PUT*, CHECKOBUF and $0 updates are dropped,
+-- PUTENUM* stay (they check the value), all writing to $0+0.
+local function strip_block(il, extra, block, funcs, res)
+    local strip_func = funcs.strip
+    for i = 1, #block do
+        local o = block[i]
+        if type(o) == 'table' then
+            insert(res, strip_block(il, extra, o, funcs, {}))
+        else
+            local op = o.op
+            if op == opcode.PUTENUMI2S or op == opcode.PUTENUMS2I then
+                funcs.obuf = true
+                o = ffi_new('struct schema_il_Opcode', o)
+                o.offset = 0
+                extra[o] = extra[block[i]]
+            elseif op == opcode.CHECKOBUF or op >= opcode.PUTBOOLC and
+                   op <= opcode.PUTBIN2STR or op == opcode.PUTSPAN or
+                   (op == opcode.MOVE or op == opcode.SKIP or
+                    op == opcode.PSKIP) and o.ripv == 0 then
+                o = nil
+            else
+                o = ffi_new('struct schema_il_Opcode', o)
+                if op == opcode.CALLFUNC then
+                    extra[o] = strip_func(extra[block[i]])
+                else
+                    extra[o] = extra[block[i]]
+                end
+            end
+            insert(res, o)
+        end
+    end
+    return res
+end
+
+-- Yields functions checking the input like code[entry] does, but
+-- producing no output. The entry comes first, followed by the
+-- functions it calls (directly or not), named anew.
+local function strip_output(il, extra, code, entry)
+    local by_name, names, res = {}, {}, {}
+    for _, func in ipairs(code) do
+        by_name[func[1].name] = func
+    end
+    local funcs = {}
+    funcs.strip = function(name)
+        local new_name = names[name]
+        if new_name then return new_name end
+        new_name = il.id()
+        names[name] = new_name
+        local pos, obuf = #res + 1, funcs.obuf
+        res[pos] = false
+        funcs.obuf = false
+        local func = strip_block(il, extra, by_name[name], funcs, {})
+        func[1].name = new_name
+        if funcs.obuf then
+            insert(func, 2, il.checkobuf(1))
+        end
+        funcs.obuf = obuf
+        res[pos] = func
+        return new_name
+    end
+    funcs.strip(code[entry][1].name)
+    return res
+end
+
 local function il_create()
 
     local extra = {}
@@ -939,6 +1009,9 @@ local function il_create()
             return opcode_vis(o, extra)
         end,
         optimize = function(code) return voptimize(il, code) end,
+        strip_output = function(code, entry)
+            return strip_output(il, extra, code, entry)
+        end,
     }, { __index = il_methods })
     return il
 end
@@ -1,26 +1,40 @@
+local ffi         = require('ffi')
 local digest      = require('digest')
+local fio         = require('fio')
 local front       = require('avro_schema.frontend')
 local c           = require('avro_schema.compiler')
 local il          = require('avro_schema.il')
 local backend_lua = require('avro_schema.backend')
+local bytecode    = require('avro_schema.bytecode')
+local native      = require('avro_schema.native')
 local rt          = require('avro_schema.runtime')
 local fingerprint = require('avro_schema.fingerprint')
 local utils       = require('avro_schema.utils')
+local version     = require('avro_schema.version')
 
 local format, find, sub = string.format, string.find, string.sub
+local gsub, byte        = string.gsub, string.byte
 local insert, concat = table.insert, table.concat
+local sort           = table.sort
 
 local base64_encode       = digest.base64_encode
 local f_create_schema     = front.create_schema
 local f_validate_data     = front.validate_data
 local f_create_ir         = front.create_ir
 local c_emit_code         = c.emit_code
+local c_emit_skip_plan    = c.emit_skip_plan
 local il_create           = il.il_create
 local rt_msgpack_encode   = rt.msgpack_encode
 local rt_lua_encode       = rt.lua_encode
+local rt_msgpack_encode_to = rt.msgpack_encode_to
+local rt_tuple_encode     = rt.tuple_encode
+local rt_convert_to       = rt.convert_to
 local rt_universal_decode = rt.universal_decode
+local rt_is_state         = rt.is_state
 local install_lua_backend = backend_lua.install
 
+local PUTSPAN = ffi.new('struct schema_il_Opcode').PUTSPAN
+
 -- We give away a handle but we never expose schema data.
 -- {schema=schema, options=options}
 local schema_by_handle = setmetatable( {}, { __mode = 'k' } )
@@ -227,7 +241,7 @@ local function gen_store_service_fields(service_fields)
             insert(code, format('r.ot[%d] = 3-ffi_cast("int", not a%d)', pos, i))
             pos = pos + 1
         elseif field == 'int' or field == 'long' then
-            insert(code, format('r.ov[%d].ival = a%d', pos, pos, i))
+            insert(code, format('r.ov[%d].ival = a%d', pos, i))
             pos = pos + 1
         elseif field == 'float' or field == 'double' then
             insert(code, format('r.ov[%d].dval = a%d',
@@ -267,8 +281,32 @@ x%d = ffi_string(r.b1-r.v[%d].xoff, r.v[%d].xlen)]], i, i, i))
     return code
 end
 
+-- 1 if the code copies input subtrees verbatim, the parser has to
+-- record item offsets then (track_bo)
+local function track_bo(block)
+    for i = 1, #block do
+        local o = block[i]
+        if type(o) == 'table' then
+            if track_bo(o) == 1 then return 1 end
+        elseif o.op == PUTSPAN then
+            return 1
+        end
+    end
+    return 0
+end
+
 local expand_lua_template
-local function gen_lua_code(args, il, il_code, service_fields)
+-- yields "{1, 2, 3}" or "{'a', 'b'}"
+local function list_literal(list)
+    local res = {}
+    for i, v in ipairs(list) do
+        res[i] = type(v) == 'string' and format('%q', v) or tostring(v)
+    end
+    return '{' .. concat(res, ', ') .. '}'
+end
+
+local function gen_lua_code(args, il, il_code, service_fields,
+                            flatten_plan, unflatten_plan)
     install_lua_backend(il, args)
     expand_lua_template = expand_lua_template or compile_template([=[
 -- v2.1
@@ -289,24 +327,46 @@ local rt_err_length    = rt.err_length
 local rt_err_missing   = rt.err_missing
 local rt_err_duplicate = rt.err_duplicate
 local rt_err_value     = rt.err_value
+local rt_batch_convert = rt.batch_convert
 local cpool      = digest.base64_decode([[
 ${cpool_data}
 ]])
+local flatten_plan     = rt.skip_plan(${flatten_plan})
+local unflatten_plan   = rt.skip_plan(${unflatten_plan})
+${profile_decls}
 ${outter_protos}
 ${outter_decls}
-local function linker(decode_proc, encode_proc)
+local function linker(decode_proc, encode_proc, r)
     decode_proc = decode_proc or rt.msgpack_decode
     encode_proc = encode_proc or rt.msgpack_encode
+    r = r or rt_regs
 ${inner_decls}
     return {
         flatten  = function(data${extra_params})
-            return pcall(flatten, data${extra_params})
+            return pcall(flatten, r, data${extra_params})
         end,
         unflatten  = function(data)
-            return pcall(unflatten, data)
+            return pcall(unflatten, r, data)
         end,
         xflatten  = function(data)
-            return pcall(xflatten, data)
+            return pcall(xflatten, r, data)
+        end,
+        validate  = function(data)
+            return pcall(validate, r, data)
+        end,
+        check_flat = function(data)
+            return pcall(check_flat, r, data)
+        end,
+        flatten_batch = flatten_step and function(data)
+            r.track_bo = ${track_bo}
+            return rt_batch_convert(r, flatten_step, flatten, cpool, data)
+        end,
+        unflatten_batch = unflatten_step and function(data)
+            r.track_bo = ${track_bo}
+            return rt_batch_convert(r, unflatten_step, unflatten, cpool, data)
+        end,
+        profile = rt_profile and function()
+            return rt.profile_report(rt_profile, rt_profile_keys)
         end
     }
 end
@@ -316,18 +376,19 @@ return linker
     local outter_decls = {}
     local inner_decls = {}
     local n = #service_fields
+    local track = track_bo(il_code)
 
     -- flatten
     local f_complete = gen_store_service_fields(service_fields)
     insert(f_complete, 'v0 = encode_proc(r, v0)')
 
     il.emit_lua_func(il_code[1], inner_decls, {
-        func_decl = format('local function flatten(data%s)', param_list(n)),
-        func_locals = 'local r, v0, v1, msgpack_data',
-        conversion_init = [[
-        r = rt_regs; v1 = 0; v0 = 0
-        msgpack_data = decode_proc(r, data)
-        r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool]],
+        func_decl = format('local function flatten(r, data%s)', param_list(n)),
+        func_locals = 'local v0, v1, msgpack_data',
+        conversion_init = format([[
+        v1 = 0; v0 = 0; r.track_bo = %d
+        msgpack_data = decode_proc(r, data, flatten_plan)
+        r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool]], track),
         conversion_complete = concat(f_complete, '\n'),
         func_return = 'return v0'
     })
@@ -337,13 +398,13 @@ return linker
     insert(u_complete, 'v0 = encode_proc(r, v0)')
 
     il.emit_lua_func(il_code[2], inner_decls, {
-        func_decl = 'local function unflatten(data)',
-        func_locals = 'local r, v0, v1, msgpack_data',
+        func_decl = 'local function unflatten(r, data)',
+        func_locals = 'local v0, v1, msgpack_data',
         nlocals_min = n,
-        conversion_init = [[
-r = rt_regs; v0 = 0; v1 = 0
-msgpack_data = decode_proc(r, data)
-r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool]],
+        conversion_init = format([[
+v0 = 0; v1 = 0; r.track_bo = %d
+msgpack_data = decode_proc(r, data, unflatten_plan)
+r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool]], track),
         conversion_complete = concat(u_complete, '\n'),
         func_return = 'return v0' .. param_list(n, 'x'),
         iter_prolog = 'if _ < 16 then goto continue end' -- artificially bump iter count
@@ -351,35 +412,251 @@ r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool]],
 
     -- xflatten
     il.emit_lua_func(il_code[3], inner_decls, {
-        func_decl = 'local function xflatten(data)',
-        func_locals = 'local r, v0, v1, msgpack_data',
+        func_decl = 'local function xflatten(r, data)',
+        func_locals = 'local v0, v1, msgpack_data',
         conversion_init = format([[
-r = rt_regs
-msgpack_data = decode_proc(r, data)
+r.track_bo = %d
+msgpack_data = decode_proc(r, data, flatten_plan)
 r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool
-r.k = %d; v0 = 0; v1 = 0]], n + 1),
+r.k = %d; v0 = 0; v1 = 0]], track, n + 1),
         conversion_complete = [[
 rt_C.schema_rt_xflatten_done(r, v0)
 v0 = encode_proc(r, v0)]],
         func_return = 'return v0'
     })
 
+    -- validate
+    il.emit_lua_func(il_code[4], inner_decls, {
+        func_decl = 'local function validate(r, data)',
+        func_locals = 'local v0, v1, msgpack_data',
+        conversion_init = [[
+v0 = 0; v1 = 0; r.track_bo = 0
+msgpack_data = decode_proc(r, data, flatten_plan)
+r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool]],
+        conversion_complete = '',
+        func_return = 'do return end'
+    })
+
+    -- check_flat
+    il.emit_lua_func(il_code[5], inner_decls, {
+        func_decl = 'local function check_flat(r, data)',
+        func_locals = 'local v0, v1, msgpack_data',
+        conversion_init = [[
+v0 = 0; v1 = 0; r.track_bo = 0
+msgpack_data = decode_proc(r, data, unflatten_plan)
+r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool]],
+        conversion_complete = '',
+        func_return = 'do return end'
+    })
+
+    -- batch steps, converting a single value out of many parsed
+    -- at once (service fields are stored at fixed positions, hence
+    -- no batch mode if there are any)
+    insert(inner_decls, 'local flatten_step, unflatten_step')
+    if n == 0 then
+        il.emit_lua_func(il_code[1], inner_decls, {
+            func_decl = 'flatten_step = function(r, v0, v1)',
+            func_return = 'do return v0 end'
+        })
+        il.emit_lua_func(il_code[2], inner_decls, {
+            func_decl = 'unflatten_step = function(r, v0, v1)',
+            func_return = 'do return v0 end'
+        })
+    end
+
     -- helper functions (if any)
-    for i = 4, #il_code do
+    for i = 6, #il_code do
         local func = il_code[i]
         insert(outter_protos, format('local f%d', func[1].name))
         il.emit_lua_func(func, outter_decls)
     end
 
+    -- branch hit counters of a profiling build
+    local profile_decls = 'local rt_profile, rt_profile_keys'
+    if il.profile_counters then
+        local keys = {}
+        for i, key in ipairs(il.profile_counters) do
+            keys[i] = list_literal(key)
+        end
+        profile_decls = format([[
+local rt_profile = ffi.new('double[?]', %d)
+local rt_profile_keys = {%s}]], #keys, concat(keys, ', '))
+    end
+
     return expand_lua_template({
         cpool_data = base64_encode(il.cpool_get_data()),
+        profile_decls = profile_decls,
         extra_params = param_list(n),
+        flatten_plan = '{}, ' .. list_literal(flatten_plan),
+        unflatten_plan = list_literal(unflatten_plan) .. ', {}',
+        track_bo = track,
         outter_protos = outter_protos,
         outter_decls = outter_decls,
         inner_decls = inner_decls
     })
 end
 
+local expand_program_template
+-- same as gen_lua_code(), but conversions run a program produced by
+-- the given backend (interp or native), a run(r, entry, v0, v1) function
+-- is defined by the program source
+local function gen_program_code(program_src, entries, il_code,
+                                service_fields, flatten_plan, unflatten_plan)
+    expand_program_template = expand_program_template or compile_template([=[
+-- v2.1 ${backend}
+local ffi        = require('ffi')
+local digest     = require('digest')
+local rt         = require('avro_schema.runtime')
+local pcall      = pcall
+local ffi_cast   = ffi.cast
+local ffi_string = ffi.string
+local rt_C       = ffi.load(rt.C_path)
+local rt_regs          = rt.regs
+local rt_batch_convert = rt.batch_convert
+${program}
+local flatten_plan     = rt.skip_plan(${flatten_plan})
+local unflatten_plan   = rt.skip_plan(${unflatten_plan})
+local function linker(decode_proc, encode_proc, r)
+    decode_proc = decode_proc or rt.msgpack_decode
+    encode_proc = encode_proc or rt.msgpack_encode
+    r = r or rt_regs
+    local function flatten(r, data${extra_params})
+        r.track_bo = ${track_bo}
+        local msgpack_data = decode_proc(r, data, flatten_plan, true)
+        r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool
+        local v0 = run(r, ${flatten_entry}, 0, 0)
+${store_service_fields}
+        return (encode_proc(r, v0))
+    end
+    local function unflatten(r, data)
+        r.track_bo = ${track_bo}
+        local msgpack_data = decode_proc(r, data, unflatten_plan,
+                                          ${unflatten_compact})
+        r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool
+        local v0 = run(r, ${unflatten_entry}, 0, 0)
+        local _${fetch_locals}
+${fetch_service_fields}
+        return (encode_proc(r, v0))${fetch_locals}
+    end
+    local function xflatten(r, data)
+        r.track_bo = ${track_bo}
+        local msgpack_data = decode_proc(r, data, flatten_plan, true)
+        r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool
+        r.k = ${xflatten_k}
+        local v0 = run(r, ${xflatten_entry}, 0, 0)
+        rt_C.schema_rt_xflatten_done(r, v0)
+        return (encode_proc(r, v0))
+    end
+    local function validate(r, data)
+        r.track_bo = 0
+        local msgpack_data = decode_proc(r, data, flatten_plan, true)
+        r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool
+        run(r, ${validate_entry}, 0, 0)
+    end
+    local function check_flat(r, data)
+        r.track_bo = 0
+        local msgpack_data = decode_proc(r, data, unflatten_plan, true)
+        r.b2 = ffi_cast("const uint8_t *", cpool) + #cpool
+        run(r, ${check_flat_entry}, 0, 0)
+    end
+    local flatten_step, unflatten_step
+    if ${batch} then
+        flatten_step = function(r, v0, v1)
+            return run(r, ${flatten_entry}, v0, v1)
+        end
+        unflatten_step = function(r, v0, v1)
+            return run(r, ${unflatten_entry}, v0, v1)
+        end
+    end
+    return {
+        flatten  = function(data${extra_params})
+            return pcall(flatten, r, data${extra_params})
+        end,
+        unflatten  = function(data)
+            return pcall(unflatten, r, data)
+        end,
+        xflatten  = function(data)
+            return pcall(xflatten, r, data)
+        end,
+        validate  = function(data)
+            return pcall(validate, r, data)
+        end,
+        check_flat = function(data)
+            return pcall(check_flat, r, data)
+        end,
+        flatten_batch = flatten_step and function(data)
+            r.track_bo = ${track_bo}
+            return rt_batch_convert(r, flatten_step, flatten, cpool, data)
+        end,
+        unflatten_batch = unflatten_step and function(data)
+            r.track_bo = ${track_bo}
+            return rt_batch_convert(r, unflatten_step, unflatten, cpool, data)
+        end
+    }
+end
+return linker
+]=])
+    local n = #service_fields
+    program_src.flatten_plan = '{}, ' .. list_literal(flatten_plan)
+    program_src.unflatten_plan = list_literal(unflatten_plan) .. ', {}'
+    program_src.extra_params = param_list(n)
+    program_src.flatten_entry = entries[1]
+    program_src.unflatten_entry = entries[2]
+    program_src.xflatten_entry = entries[3]
+    program_src.validate_entry = entries[4]
+    program_src.check_flat_entry = entries[5]
+    program_src.xflatten_k = n + 1
+    program_src.store_service_fields = gen_store_service_fields(service_fields)
+    program_src.fetch_locals = param_list(n, 'x')
+    program_src.fetch_service_fields = gen_fetch_service_fields(service_fields)
+    program_src.batch = tostring(n == 0)
+    -- fetch_service_fields reads t/v
+    program_src.unflatten_compact = tostring(n == 0)
+    program_src.track_bo = track_bo(il_code)
+    return expand_program_template(program_src)
+end
+
+-- conversions run the bytecode interpreter
+local function gen_interp_code(_, il, il_code, service_fields,
+                               flatten_plan, unflatten_plan)
+    local program = bytecode.gen_program(il, il_code)
+    return gen_program_code({
+        backend = 'interp',
+        program = format([=[
+local rt_interp  = rt.interp
+local cpool      = digest.base64_decode([[
+%s
+]])
+local code       = rt.interp_code(digest.base64_decode([[
+%s
+]]))
+local consts     = %s
+local function run(r, entry, v0, v1)
+    return rt_interp(r, code, consts, entry, v0, v1)
+end]=], base64_encode(program.cpool), base64_encode(program.code),
+        list_literal(program.consts))
+    }, program.entries, il_code, service_fields, flatten_plan,
+       unflatten_plan)
+end
+
+-- conversions run native code, built with the system C compiler
+local function gen_native_code(args, il, il_code, service_fields,
+                               flatten_plan, unflatten_plan)
+    local unit = native.gen_unit(il, il_code, args)
+    local path = native.build(unit.source, args.cache_dir)
+    return gen_program_code({
+        backend = 'native',
+        program = format([=[
+local rt_native  = rt.native
+local lib, cpool = rt.native_load(%q)
+local consts     = %s
+local function run(r, entry, v0, v1)
+    return rt_native(r, lib, consts, entry, v0, v1)
+end]=], path, list_literal(unit.consts))
+    }, unit.entries, il_code, service_fields, flatten_plan,
+       unflatten_plan)
+end
+
 local function validate_service_fields(sfs)
     -- service fields, a subset of AVRO types
     local valid_service_field = {
@@ -393,6 +670,144 @@ local function validate_service_fields(sfs)
     end
 end
 
+-----------------------------------------------------------------------
+-- on-disk cache of the generated code (compile option cache_dir)
+
+-- Text of a value with keys sorted, hence stable across runs.
+local stable_encode
+stable_encode = function(value, res)
+    local t = type(value)
+    if t == 'table' then
+        local keys = {}
+        for k in pairs(value) do insert(keys, k) end
+        sort(keys, function(a, b)
+            if type(a) ~= type(b) then return type(a) < type(b) end
+            return a < b
+        end)
+        insert(res, '{')
+        for _, k in ipairs(keys) do
+            stable_encode(k, res)
+            insert(res, '=')
+            stable_encode(value[k], res)
+            insert(res, ',')
+        end
+        insert(res, '}')
+    elseif t == 'string' then
+        insert(res, format('%q', value))
+    elseif t == 'number' then
+        insert(res, format('%.17g', value))
+    elseif value == nil then -- including NULL cdata
+        insert(res, 'nil')
+    else
+        insert(res, tostring(value))
+    end
+    return res
+end
+
+-- Digest of the code generator and the runtime (sources of the modules
+-- and the C runtime object), the version is only bumped on releases.
+-- Computed on the first use.
+local code_digest
+local CODE_MODULES = {
+    'avro_schema', 'avro_schema.frontend', 'avro_schema.compiler',
+    'avro_schema.il', 'avro_schema.backend', 'avro_schema.bytecode',
+    'avro_schema.native', 'avro_schema.runtime'
+}
+
+local function get_code_digest()
+    if code_digest then return code_digest end
+    local paths = {}
+    for _, name in ipairs(CODE_MODULES) do
+        insert(paths, package.search and package.search(name) or
+                      package.searchpath(name, package.path) or name)
+    end
+    insert(paths, rt.C_path)
+    local data = {}
+    for _, path in ipairs(paths) do
+        local file = io.open(path, 'rb')
+        insert(data, path)
+        if file then
+            insert(data, file:read('*a'))
+            file:close()
+        end
+    end
+    code_digest = digest.sha1_hex(concat(data))
+    return code_digest
+end
+
+-- Path of the entry for compile() args (n schemas). The name starts
+-- with the fingerprint of the target schema, followed by a digest of
+-- everything the generated code depends on: library and LuaJIT version,
+-- code generator, schemas and compile options. Schemas are included in
+-- full since fingerprints omit defaults and other attributes affecting
+-- the code.
+local function cache_entry_path(args, n)
+    local key = { version, jit.version, get_code_digest() }
+    for i = 1, n do
+        local schema = schema_by_handle[args[i]]
+        stable_encode(front.export_helper(schema.schema), key)
+        stable_encode(schema.options, key)
+    end
+    local options = {}
+    for k, v in pairs(args) do
+        if type(k) ~= 'number' and k ~= 'cache_dir' then
+            options[k] = v
+        end
+    end
+    stable_encode(options, key)
+    local fp = fingerprint.get_fingerprint(get_schema(args[n]), 'sha256', 8,
+                                           schema_by_handle[args[n]].options)
+    return format('%s/avro_schema_%s_%s.luac', args.cache_dir,
+                  gsub(fp, '.', function(c) return format('%02x', byte(c)) end),
+                  digest.sha1_hex(concat(key)))
+end
+
+-- Yields the linker (see gen_lua_code()) stored in the entry, or nil.
+-- The entry is run in the process, same as native objects both the
+-- entry and cache_dir are to be owned by the current user and not
+-- writable by the group or others.
+local function cache_load(path)
+    local dir = fio.dirname(path)
+    if not fio.stat(dir) then return end -- created by cache_store()
+    local unsafe = rt.unsafe_path(dir)
+    if not unsafe and fio.stat(path) then
+        unsafe = rt.unsafe_path(path)
+    end
+    if unsafe then
+        error(format('cache_dir: Unsafe path: %s', unsafe), 0)
+    end
+    local file = io.open(path, 'rb')
+    if not file then return end
+    local data = file:read('*a')
+    file:close()
+    local module = loadstring(data, '@<schema-jit>')
+    if not module then return end
+    -- ex: the native backend object is gone
+    local ok, linker = pcall(module)
+    if ok then return linker end
+end
+
+-- Stores the compiled module (as LuaJIT bytecode), errors are ignored,
+-- the cache is an optimization. A missing cache_dir is created 0700,
+-- entries are 0600.
+local function cache_store(path, module)
+    local dir = fio.dirname(path)
+    if not fio.stat(dir) and not fio.mkdir(dir, tonumber('700', 8)) then
+        return
+    end
+    local name = os.tmpname()
+    os.remove(name)
+    local tmp = format('%s.%s', path, gsub(name, '.*/', ''))
+    local file = io.open(tmp, 'wb')
+    if not file then return end
+    local ok = file:write(string.dump(module))
+    file:close()
+    if not ok or not fio.chmod(tmp, tonumber('600', 8)) or
+       not os.rename(tmp, path) then
+        os.remove(tmp)
+    end
+end
+
 local get_names, get_types
 -- compile(schema)
 -- compile(schema1, schema2)
@@ -417,6 +832,21 @@ local function compile(...)
         error('service_fields: Expecting a table', 0)
     end
     validate_service_fields(service_fields)
+    local gen_code = gen_lua_code
+    if args.backend == 'interp' then
+        gen_code = gen_interp_code
+    elseif args.backend == 'native' then
+        gen_code = gen_native_code
+    elseif args.backend ~= nil and args.backend ~= 'lua' then
+        error(format('backend: Invalid backend: %s', args.backend), 0)
+    end
+    local profile = args.profile
+    if profile ~= nil and profile ~= true and type(profile) ~= 'table' then
+        error('profile: Expecting true or a table', 0)
+    elseif profile ~= nil and gen_code ~= gen_lua_code then
+        error(format('profile: Not supported by the %s backend',
+                     args.backend), 0)
+    end
     local list = {}
     local handler_schema_to
     for i = 1, n do
@@ -425,16 +855,24 @@ local function compile(...)
     end
     if #list == 0 then
         error('Expecting a schema', 0)
-    elseif #list == 1 then
-        ok, ir = get_ir(list[1], list[1])
-    elseif #list == 2 then
-        ok, ir = get_ir(list[1], list[2], args.downgrade)
-    else
+    elseif #list > 2 then
         assert(false, 'NYI: chain')
     end
-    if not ok then
-        return false, ir
-    else
+    -- dumps need the code generated, hence bypass the cache
+    local cache_path, linker
+    if args.cache_dir and not args.dump_il and not args.dump_src then
+        cache_path = cache_entry_path(args, n)
+        linker = cache_load(cache_path)
+    end
+    if not linker then
+        if #list == 1 then
+            ok, ir = get_ir(list[1], list[1])
+        else
+            ok, ir = get_ir(list[1], list[2], args.downgrade)
+        end
+        if not ok then
+            return false, ir
+        end
         local il = il_create()
         local debug = args.debug
         local ok, il_code = pcall(c_emit_code, il, ir, service_fields,
@@ -449,7 +887,11 @@ local function compile(...)
             file:write(il.vis(il_code))
             file:close()
         end
-        local lua_code, lua_args = gen_lua_code(args, il, il_code, service_fields)
+        local flatten_plan, unflatten_plan = c_emit_skip_plan(ir,
+                                                              service_fields)
+        local lua_code, lua_args = gen_code(args, il, il_code,
+                                            service_fields, flatten_plan,
+                                            unflatten_plan)
         local dump_src = args.dump_src
         if dump_src then
             local file = io.open(dump_src, 'w+')
@@ -458,24 +900,56 @@ local function compile(...)
         end
         local module, err     = loadstring(lua_code, '@<schema-jit>')
         if not module then error(err, 0) end
-        local linker          = module(lua_args)
-        local process_msgpack = linker(rt_universal_decode, rt_msgpack_encode)
-        local process_lua     = linker(rt_universal_decode, rt_lua_encode)
-        return true, {
+        if cache_path then cache_store(cache_path, module) end
+        linker                = module(lua_args)
+    end
+    -- r is the runtime state, nil: the shared rt.regs
+    local function link(r)
+        local process_msgpack = linker(rt_universal_decode,
+                                       rt_msgpack_encode, r)
+        local process_lua     = linker(rt_universal_decode,
+                                       rt_lua_encode, r)
+        local process_to      = linker(rt_universal_decode,
+                                       rt_msgpack_encode_to, r)
+        local process_tuple   = linker(rt_universal_decode,
+                                       rt_tuple_encode, r)
+        return {
             flatten           = process_lua.flatten,
             unflatten         = process_lua.unflatten,
             xflatten          = process_lua.xflatten,
             flatten_msgpack   = process_msgpack.flatten,
             unflatten_msgpack = process_msgpack.unflatten,
             xflatten_msgpack  = process_msgpack.xflatten,
+            validate          = process_lua.validate,
+            check_flat        = process_lua.check_flat,
+            flatten_tuple     = process_tuple.flatten,
+            flatten_msgpack_batch   = process_msgpack.flatten_batch,
+            unflatten_msgpack_batch = process_msgpack.unflatten_batch,
+            flatten_msgpack_to   = function(buf, ...)
+                return rt_convert_to(process_to.flatten, buf, ...)
+            end,
+            unflatten_msgpack_to = function(buf, ...)
+                return rt_convert_to(process_to.unflatten, buf, ...)
+            end,
+            xflatten_msgpack_to  = function(buf, ...)
+                return rt_convert_to(process_to.xflatten, buf, ...)
+            end,
+            profile           = process_lua.profile,
             get_names         = function ()
                 return get_names(handler_schema_to, service_fields)
             end,
             get_types         = function ()
                 return get_types(handler_schema_to, service_fields)
+            end,
+            bind              = function (state)
+                if not rt_is_state(state) then
+                    error('bind: Expecting a state', 0)
+                end
+                return link(state)
             end
         }
     end
+    return true, link()
 end
 
 -----------------------------------------------------------------------
@@ -531,5 +1005,10 @@ return {
     validate       = validate,
     export         = export,
     fingerprint    = get_fingerprint,
-    _VERSION       = require('avro_schema.version'),
+    stream         = rt.stream,
+    state_acquire  = rt.state_acquire,
+    state_release  = rt.state_release,
+    runtime_cfg    = rt.buf_cfg,
+    runtime_stats  = rt.buf_stats,
+    _VERSION       = version,
 }
@@ -0,0 +1,728 @@
+local ffi            = require('ffi')
+local bit            = require('bit')
+local digest         = require('digest')
+local fio            = require('fio')
+local ffi_new        = ffi.new
+local format, byte   = string.format, string.byte
+local gsub, upper    = string.gsub, string.upper
+local insert, sort   = table.insert, table.sort
+local concat         = table.concat
+
+local opcode = ffi_new('struct schema_il_Opcode')
+
+-- Native backend: IL translated into a C translation unit, built
+-- with the system C compiler into a shared object (see build() below).
+--
+-- Every IL function becomes a static C function; variables are locals,
+-- nested blocks are C statements. Errors are reported the same way
+-- schema_rt_interp() does (enum InterpError in pipeline.c), hence
+-- rt.interp error handling applies.
+
+local IERR_TYPE, IERR_LENGTH, IERR_MISSING, IERR_DUPLICATE,
+      IERR_VALUE, IERR_ERROR, IERR_NOMEM = 1, 2, 3, 4, 5, 6, 7
+
+local NILREG = 0xffffffff
+
+local preamble = [[
+/* generated by avro_schema/native.lua, do not edit */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* must match runtime/pipeline.c */
+struct Value {
+    union {
+        void          *p;
+        int64_t        ival;
+        uint64_t       uval;
+        double         dval;
+        struct {
+            uint32_t   xlen;
+            uint32_t   xoff;
+        };
+    };
+};
+
+struct State {
+    size_t             t_capacity;
+    size_t             ot_capacity;
+    size_t             res_capacity;
+    size_t             res_size;
+    uint8_t           *res;
+    const uint8_t     *b1;
+    const uint8_t     *b2;
+    uint8_t           *t;
+    struct Value      *v;
+    uint8_t           *ot;
+    struct Value      *ov;
+    int32_t            k;
+    uint8_t           *sbuf;
+    size_t             sbuf_size;
+    size_t             sbuf_capacity;
+    size_t             spos;
+    size_t             sitems;
+    uint32_t           stodo;
+    uint32_t           spatch;
+    uint32_t           sdepth;
+    uint32_t          *bo;
+    size_t             bo_capacity;
+    uint32_t           track_bo;
+    uint32_t           compact;
+    uint32_t          *cv;
+    /* the rest is not accessed */
+};
+
+#define COMPACT_IVAL(cv, v, i) \
+    ((cv)[i] & 1 ? (v)[i].ival : (int64_t)((int32_t)(cv)[i] >> 1))
+#define COMPACT_XLEN(cv, i) ((cv)[i] & 0xffff)
+#define COMPACT_XOFF(cv, i) ((cv)[i] >> 16)
+
+#define FAIL(kind, pos, arg) \
+    do { err[0] = (kind); err[1] = (pos); err[2] = (arg); return -1; } while (0)
+/* cpool offsets are relative to the END (as with state->b2) */
+#define CPOOL(offset) (cpool + CPOOL_SIZE - (offset))
+
+static int (*buf_grow)(struct State *state, size_t min_capacity);
+]]
+
+-- output type of PUT*C
+local putc_type = {
+    [opcode.PUTNULC   ] =  1,
+    [opcode.PUTBOOLC  ] =  2,
+    [opcode.PUTINTC   ] =  4,
+    [opcode.PUTLONGC  ] =  4,
+    [opcode.PUTFLOATC ] =  6,
+    [opcode.PUTDOUBLEC] =  7,
+    [opcode.PUTARRAYC ] = 11,
+    [opcode.PUTMAPC   ] = 12,
+    [opcode.PUTDUMMYC ] = 17,
+    [opcode.PUTSTRC   ] = 18,
+    [opcode.PUTBINC   ] = 19,
+    [opcode.PUTXC     ] = 20
+}
+
+------------------------- T, tofield, fromfield
+local put_tab = {
+    [opcode.PUTINT     ] = {  4, 'ival', 'ival' },
+    [opcode.PUTLONG    ] = {  4, 'ival', 'ival' },
+    [opcode.PUTFLOAT   ] = {  6, 'dval', 'dval' },
+    [opcode.PUTDOUBLE  ] = {  7, 'dval', 'dval' },
+    [opcode.PUTSTR     ] = {  8, 'uval', 'uval' },
+    [opcode.PUTBIN     ] = {  9, 'uval', 'uval' },
+    [opcode.PUTARRAY   ] = { 11, 'xlen', 'xlen' },
+    [opcode.PUTMAP     ] = { 12, 'xlen', 'xlen' },
+    [opcode.PUTINT2LONG] = {  4, 'ival', 'ival' },
+    [opcode.PUTINT2FLT ] = {  6, 'dval', 'ival' },
+    [opcode.PUTINT2DBL ] = {  7, 'dval', 'ival' },
+    [opcode.PUTLONG2FLT] = {  6, 'dval', 'ival' },
+    [opcode.PUTLONG2DBL] = {  7, 'dval', 'ival' },
+    [opcode.PUTFLT2DBL ] = {  7, 'dval', 'dval' },
+    [opcode.PUTSTR2BIN ] = {  9, 'uval', 'uval' },
+    [opcode.PUTBIN2STR ] = {  8, 'uval', 'uval' }
+}
+
+-- type check, a C condition given the item position
+local is_tab = {
+    [opcode.ISBOOL    ] = 't[%s] == 2 || t[%s] == 3',
+    [opcode.ISINT     ] = 't[%s] == 4 && (uint64_t)IVAL(%s) + 0x80000000 <= 0xffffffff',
+    [opcode.ISLONG    ] = 't[%s] == 4',
+    [opcode.ISSTR     ] = 't[%s] == 8',
+    [opcode.ISBIN     ] = 't[%s] == 9',
+    [opcode.ISARRAY   ] = 't[%s] == 11',
+    [opcode.ISMAP     ] = 't[%s] == 12',
+    [opcode.ISNUL     ] = 't[%s] == 1',
+    [opcode.ISNULORMAP] = 't[%s] == 1 || t[%s] == 12'
+}
+
+local raw64 = ffi_new('union { uint64_t u; double d; }')
+
+-- 64 bit int literal
+local function int64_literal(i)
+    local s = tostring(i):gsub('[LU]+$', '')
+    if s == '-9223372036854775808' then
+        return '(-9223372036854775807LL - 1)'
+    end
+    return s .. 'LL'
+end
+
+-- strings sorted by length first (the order doesn't matter for
+-- correctness, grouping by length enables the switch on length)
+local function str_less(a, b)
+    if #a ~= #b then return #a < #b end
+    return a < b
+end
+
+local emit_block
+
+local function emit_instruction(ctx, o, res)
+    local var, pos, cpool_add = ctx.var, ctx.pos, ctx.cpool_add
+    local op = o.op
+    if     op == opcode.CALLFUNC then
+        insert(res, '{')
+        insert(res, '    uint32_t io_[2];')
+        insert(res, format('    io_[0] = v0; io_[1] = %s;', pos(o.ipv, o.ipo)))
+        if o.k ~= 0 then
+            insert(res, format('    state->k += %d;', o.k))
+        end
+        insert(res, format('    if (F(%d)(state, io_, err) != 0) return -1;',
+                           ctx.il.get_extra(o)))
+        if o.k ~= 0 then
+            insert(res, format('    state->k -= %d;', o.k))
+        end
+        insert(res, '    v0 = io_[0];')
+        if o.ripv ~= NILREG then
+            insert(res, format('    %s = io_[1];', var(o.ripv)))
+        end
+        insert(res, '    ot = state->ot; ov = state->ov;')
+        insert(res, '}')
+    elseif op == opcode.MOVE then
+        insert(res, format('%s = %s;', var(o.ripv), pos(o.ipv, o.ipo)))
+    elseif op == opcode.SKIP then
+        local p = pos(o.ipv, o.ipo)
+        insert(res, format('%s = %s + XOFF(%s);', var(o.ripv), p, p))
+    elseif op == opcode.PSKIP then
+        local p = pos(o.ipv, o.ipo)
+        insert(res, format(
+            '%s = %s + 1 + (t[%s] == 11 || t[%s] == 12 ? XOFF(%s) - 1 : 0);',
+            var(o.ripv), p, p, p, p))
+    -----------------------------------------------------------
+    elseif putc_type[op] then
+        local out = pos(0, o.offset)
+        local t = putc_type[op]
+        if op == opcode.PUTBOOLC then
+            t = o.ci == 0 and 2 or 3
+        end
+        insert(res, format('ot[%s] = %d;', out, t))
+        if op == opcode.PUTINTC then
+            insert(res, format('ov[%s].ival = %d;', out, o.ci))
+        elseif op == opcode.PUTARRAYC or op == opcode.PUTMAPC then
+            insert(res, format('ov[%s].xlen = %d;', out, o.ci))
+        elseif op == opcode.PUTLONGC then
+            insert(res, format('ov[%s].ival = %s;', out, int64_literal(o.cl)))
+        elseif op == opcode.PUTFLOATC or op == opcode.PUTDOUBLEC then
+            -- raw bits, exact
+            raw64.d = o.cd
+            insert(res, format('ov[%s].uval = 0x%sULL; /* %.17g */', out,
+                               bit.tohex(raw64.u), o.cd))
+        elseif op == opcode.PUTSTRC or op == opcode.PUTBINC or
+               op == opcode.PUTXC then
+            local str = ctx.il.get_extra(o)
+            insert(res, format('ov[%s].xlen = %d; ov[%s].xoff = %d;',
+                               out, #str, out, cpool_add(str)))
+        end
+    elseif op == opcode.PUTINTKC then
+        local out = pos(0, o.offset)
+        insert(res, format('ot[%s] = 4; ov[%s].ival = state->k + %d;',
+                           out, out, o.ci))
+    elseif op == opcode.PUTBOOL then
+        insert(res, format('ot[%s] = t[%s];',
+                           pos(0, o.offset), pos(o.ipv, o.ipo)))
+    elseif put_tab[op] then
+        local out, opt = pos(0, o.offset), put_tab[op]
+        local p = pos(o.ipv, o.ipo)
+        if opt[3] == 'uval' then
+            -- xlen and xoff, see the compact layout
+            insert(res, format('ot[%s] = %d; ov[%s].xlen = XLEN(%s); ' ..
+                               'ov[%s].xoff = XOFF(%s);',
+                               out, opt[1], out, p, out, p))
+        else
+            local from = opt[3] == 'dval' and format('v[%s].dval', p) or
+                         format('%s(%s)', upper(opt[3]), p)
+            if opt[2] == 'dval' and opt[3] == 'ival' then
+                from = '(double)' .. from
+            end
+            insert(res, format('ot[%s] = %d; ov[%s].%s = %s;',
+                               out, opt[1], out, opt[2], from))
+        end
+    elseif op == opcode.PUTSPAN then
+        local out, from = pos(0, o.offset), pos(o.ipv, o.ipo)
+        insert(res, format(
+            'ot[%s] = 21; ov[%s].xoff = state->bo[%s]; ' ..
+            'ov[%s].xlen = state->bo[%s] - state->bo[%s + XOFF(%s)];',
+            out, out, from, out, from, from, from))
+    -----------------------------------------------------------
+    elseif op == opcode.PUTENUMI2S then
+        local p, out = pos(o.ipv, o.ipo), pos(0, o.offset)
+        local tab = ctx.il.get_extra(o)
+        insert(res, format('switch ((uint64_t)IVAL(%s)) {', p))
+        for i, str in ipairs(tab) do
+            if str == '' then
+                insert(res, format('case %d: FAIL(%d, %s, 1);',
+                                   i - 1, IERR_VALUE, p))
+            else
+                insert(res, format(
+                    'case %d: ov[%s].xlen = %d; ov[%s].xoff = %d; break;',
+                    i - 1, out, #str, out, cpool_add(str)))
+            end
+        end
+        insert(res, format('default: FAIL(%d, %s, 0);', IERR_VALUE, p))
+        insert(res, '}')
+        insert(res, format('ot[%s] = 18;', out))
+    elseif op == opcode.PUTENUMS2I then
+        local p, out = pos(o.ipv, o.ipo), pos(0, o.offset)
+        local tab = ctx.il.get_extra(o)
+        ctx.emit_strswitch(p, tab, function(str)
+            if tab[str] < 0 then
+                return { format('FAIL(%d, %s, 1);', IERR_VALUE, p) }
+            end
+            return { format('ot[%s] = 4; ov[%s].ival = %d;',
+                            out, out, tab[str]) }
+        end, res)
+    -----------------------------------------------------------
+    elseif op == opcode.ISFLOAT or op == opcode.ISDOUBLE then
+        local p = pos(o.ipv, o.ipo)
+        -- promoted in place, as rt.err_type() does
+        insert(res, format('if (t[%s] == 4) {', p))
+        insert(res, format('    t[%s] = %d; v[%s].dval = (double)IVAL(%s);',
+                           p, 7 + bit.band(op, 1), p, p))
+        insert(res, format('} else if (t[%s] != 6 && t[%s] != 7) {', p, p))
+        insert(res, format('    FAIL(%d, %s, 0x%x);', IERR_TYPE, p, op))
+        insert(res, '}')
+    elseif is_tab[op] then
+        local p = pos(o.ipv, o.ipo)
+        insert(res, format('if (!(%s)) FAIL(%d, %s, 0x%x);',
+                           format(is_tab[op], p, p), IERR_TYPE, p, op))
+    elseif op == opcode.LENIS then
+        local p = pos(o.ipv, o.ipo)
+        insert(res, format('if (XLEN(%s) != %d) FAIL(%d, %s, %d);',
+                           p, o.len, IERR_LENGTH, p, o.len))
+    elseif op == opcode.ISSET then
+        insert(res, format('if (%s == 0) FAIL(%d, %s, %d);',
+                           var(o.ripv), IERR_MISSING, pos(o.ipv, o.ipo),
+                           ctx.const_add(ctx.il.get_extra(o))))
+    elseif op == opcode.ISNOTSET then
+        local p = pos(o.ipv, o.ipo)
+        insert(res, format('if (%s != 0) FAIL(%d, %s, 0);',
+                           p, IERR_DUPLICATE, p))
+    elseif op == opcode.BEGINVAR then
+        insert(res, format('%s = 0;', var(o.ipv)))
+    -----------------------------------------------------------
+    elseif op == opcode.CHECKOBUF then
+        local need = pos(0, o.offset)
+        if o.ipv ~= NILREG then
+            need = format('%s + (size_t)XLEN(%s) * %d',
+                          need, pos(o.ipv, o.ipo), o.scale)
+        end
+        insert(res, format('if (%s > state->ot_capacity) {', need))
+        insert(res, format('    if (buf_grow(state, %s) != 0) FAIL(%d, 0, 0);',
+                           need, IERR_NOMEM))
+        insert(res, '    ot = state->ot; ov = state->ov;')
+        insert(res, '}')
+    -----------------------------------------------------------
+    elseif op == opcode.ERRVALUEV then
+        insert(res, format('FAIL(%d, %s, 1);', IERR_VALUE, pos(o.ipv, o.ipo)))
+    elseif op == opcode.ERROR then
+        insert(res, format('FAIL(%d, 0, %d);', IERR_ERROR,
+                           ctx.const_add(ctx.il.get_extra(o))))
+    elseif op ~= opcode.ENDVAR then
+        assert(false)
+    end
+end
+
+local function emit_nested_block(ctx, block, res)
+    local nested = {}
+    emit_block(ctx, block, nested)
+    for _, line in ipairs(nested) do
+        insert(res, '    ' .. line)
+    end
+end
+
+local function emit_if_block(ctx, block, res)
+    local head, branch1, branch2 = block[1], block[2], block[3]
+    assert(branch1[1].op == opcode.IBRANCH)
+    if head.op == opcode.IFNUL then
+        insert(res, format('if (t[%s] %s 1) {', ctx.pos(head.ipv, head.ipo),
+                           branch1[1].ci == 0 and '!=' or '=='))
+    else
+        insert(res, format('if (%s %s 0) {', ctx.pos(head.ipv, head.ipo),
+                           branch1[1].ci == 0 and '==' or '!='))
+    end
+    emit_nested_block(ctx, branch1, res)
+    if branch2 then
+        assert(branch2[1].op == opcode.IBRANCH)
+        assert(branch2[1].ci ~= branch1[1].ci)
+        insert(res, '} else {')
+        emit_nested_block(ctx, branch2, res)
+    end
+    insert(res, '}')
+end
+
+local function emit_intswitch_block(ctx, block, res)
+    local p = ctx.pos(block[1].ipv, block[1].ipo)
+    insert(res, format('switch (IVAL(%s)) {', p))
+    for i = 2, #block do
+        local branch = block[i]
+        assert(branch[1].op == opcode.IBRANCH)
+        insert(res, format('case %s: {', int64_literal(branch[1].ci)))
+        emit_nested_block(ctx, branch, res)
+        insert(res, '    break;')
+        insert(res, '}')
+    end
+    insert(res, format('default: FAIL(%d, %s, 0);', IERR_VALUE, p))
+    insert(res, '}')
+end
+
+-- pred (optional) names a variable holding the number of the branch
+-- expected next; it is checked with a single compare first, the
+-- generic dispatch follows. Branch bodies update the prediction.
+local function emit_strswitch_block(ctx, block, res, pred)
+    local p = ctx.pos(block[1].ipv, block[1].ipo)
+    local branches, index = {}, {}
+    for i = 2, #block do
+        local branch = block[i]
+        assert(branch[1].op == opcode.SBRANCH)
+        local str = ctx.il.get_extra(branch[1])
+        branches[str], index[str] = branch, i - 1
+    end
+    if pred then
+        insert(res, format('switch (%s) {', pred))
+        for i = 2, #block do
+            local str = ctx.il.get_extra(block[i][1])
+            insert(res, format('case %d:', i - 1))
+            insert(res, format(
+                '    if (XLEN(%s) == %d && memcmp(state->b1 - XOFF(%s), CPOOL(%d), %d) == 0) goto %s_%d;',
+                p, #str, p, ctx.cpool_add(str), #str, pred, i - 1))
+            insert(res, '    break;')
+        end
+        insert(res, '}')
+    end
+    ctx.emit_strswitch(p, branches, function(str)
+        local body = {}
+        if pred then insert(body, format('%s_%d: ;', pred, index[str])) end
+        emit_block(ctx, branches[str], body)
+        if pred then insert(body, format('%s = %d;', pred, index[str] + 1)) end
+        return body
+    end, res)
+end
+
+-- A record parsing loop: OBJFOREACH with a STRSWITCH on the key.
+-- Producers typically emit record fields in the schema order, hence
+-- the field following the previous one is predicted.
+local function is_record_loop(block)
+    local head, o = block[1], block[2]
+    return #block == 2 and type(o) == 'table' and
+           o[1].op == opcode.STRSWITCH and
+           o[1].ipv == head.ripv and o[1].ipo == 0
+end
+
+local function emit_objforeach_block(ctx, block, res)
+    local head = block[1]
+    assert(head.ripv ~= NILREG)
+    local itervar, p = ctx.var(head.ripv), ctx.pos(head.ipv, head.ipo)
+    local pred = ctx.enable_field_prediction and is_record_loop(block) and
+                 ctx.label('pred')
+    if pred then
+        insert(res, '{')
+        insert(res, format('unsigned %s = 1;', pred))
+    end
+    -- step == 0: the body advances the variable
+    insert(res, format('for (%s = %s + 1; %s < %s + XOFF(%s); %s += %d) {',
+                       itervar, p, itervar, p, p, itervar, head.step))
+    if pred then
+        local nested = {}
+        emit_strswitch_block(ctx, block[2], nested, pred)
+        for _, line in ipairs(nested) do
+            insert(res, '    ' .. line)
+        end
+    else
+        emit_nested_block(ctx, block, res)
+    end
+    insert(res, '}')
+    if pred then insert(res, '}') end
+end
+
+emit_block = function(ctx, block, res)
+    for i = 2, #block do
+        local o = block[i]
+        if type(o) == 'cdata' then
+            emit_instruction(ctx, o, res)
+        else
+            local head = o[1]
+            if     head.op == opcode.IFSET or head.op == opcode.IFNUL then
+                emit_if_block(ctx, o, res)
+            elseif head.op == opcode.INTSWITCH then
+                emit_intswitch_block(ctx, o, res)
+            elseif head.op == opcode.STRSWITCH then
+                emit_strswitch_block(ctx, o, res)
+            elseif head.op == opcode.OBJFOREACH then
+                emit_objforeach_block(ctx, o, res)
+            else
+                assert(false)
+            end
+        end
+    end
+end
+
+-- C array initializer
+local function bytes_literal(str)
+    local res, line = {}, {}
+    for i = 1, #str do
+        insert(line, format('0x%02x,', byte(str, i)))
+        if #line == 12 then
+            insert(res, '    ' .. concat(line, ' '))
+            line = {}
+        end
+    end
+    if #line ~= 0 then insert(res, '    ' .. concat(line, ' ')) end
+    return concat(res, '\n')
+end
+
+-- Translates IL functions into a C translation unit. Returns a table:
+--  .source  - C source
+--  .consts  - strings referenced by error reports
+--  .entries - entry of each function, in the il_code order
+--             (schema_native_run() argument)
+-- opts.enable_field_prediction = false disables the record field
+-- prediction.
+local function gen_unit(il, il_code, opts)
+    -- cpool, offsets are relative to the END
+    local cpool, cpos, cpool_cache = {}, 0, {}
+    local function cpool_add(str)
+        local res = cpool_cache[str]
+        if res then return res end
+        insert(cpool, str)
+        cpos = cpos + #str
+        cpool_cache[str] = cpos
+        return cpos
+    end
+
+    local consts, consts_cache = {}, {}
+    local function const_add(str)
+        local res = consts_cache[str]
+        if res then return res end
+        insert(consts, str)
+        consts_cache[str] = #consts - 1
+        return #consts - 1
+    end
+
+    local ctx = { il = il, cpool_add = cpool_add, const_add = const_add }
+    ctx.enable_field_prediction = not opts or
+                                  opts.enable_field_prediction ~= false
+    local nlabels = 0
+    function ctx.label(prefix)
+        nlabels = nlabels + 1
+        return format('%s%d', prefix, nlabels)
+    end
+
+    -- Dispatches on a string at p, branches are keyed by strings,
+    -- gen_body(str) yields the code of a branch. Strings are grouped
+    -- by length, then compared with the constants in cpool.
+    function ctx.emit_strswitch(p, branches, gen_body, res)
+        local keys = {}
+        for k in pairs(branches) do insert(keys, k) end
+        sort(keys, str_less)
+        local done = ctx.label('done')
+        insert(res, format('switch (XLEN(%s)) {', p))
+        local len
+        for _, k in ipairs(keys) do
+            if #k ~= len then
+                if len then insert(res, '    break;') end
+                len = #k
+                insert(res, format('case %d:', len))
+            end
+            insert(res, format(
+                '    if (memcmp(state->b1 - XOFF(%s), CPOOL(%d), %d) == 0) {',
+                p, cpool_add(k), len))
+            for _, line in ipairs(gen_body(k)) do
+                insert(res, '        ' .. line)
+            end
+            insert(res, format('        goto %s;', done))
+            insert(res, '    }')
+        end
+        if len then insert(res, '    break;') end
+        insert(res, '}')
+        insert(res, format('FAIL(%d, %s, 0);', IERR_VALUE, p))
+        insert(res, format('%s: ;', done))
+    end
+
+    -- functions are emitted first, the cpool is complete afterwards;
+    -- F(n) and input value accessors are defined per layout, see below
+    local res = {}
+    for _, func in ipairs(il_code) do
+        insert(res, format(
+            'static int F(%d)(struct State *state, uint32_t *io, uint32_t *err);',
+            func[1].name))
+    end
+    local entries = {}
+    for i, func in ipairs(il_code) do
+        local head = func[1]
+        local vars, body = {}, {}
+        ctx.var = function(ipv)
+            if ipv ~= 0 and ipv ~= head.ipv then vars[ipv] = true end
+            return format('v%d', ipv)
+        end
+        ctx.pos = function(ipv, ipo)
+            local var = ctx.var(ipv)
+            if ipo == 0 then return var end
+            return format('(%s%+d)', var, ipo)
+        end
+        emit_block(ctx, func, body)
+        local decls = {}
+        for ipv in pairs(vars) do insert(decls, ipv) end
+        sort(decls)
+        insert(res, '')
+        insert(res, format(
+            'static int F(%d)(struct State *state, uint32_t *io, uint32_t *err)',
+            head.name))
+        insert(res, '{')
+        insert(res, '    uint8_t *t = state->t, *ot = state->ot;')
+        insert(res, '    struct Value *v = state->v, *ov = state->ov;')
+        insert(res, '    const uint32_t *cv = state->cv;')
+        insert(res, format('    uint32_t v0 = io[0], v%d = io[1];', head.ipv))
+        for _, ipv in ipairs(decls) do
+            insert(res, format('    uint32_t v%d = 0;', ipv))
+        end
+        insert(res, '    (void)t; (void)v; (void)cv; (void)ot; (void)ov;')
+        for _, line in ipairs(body) do
+            insert(res, '    ' .. line)
+        end
+        insert(res, '    io[0] = v0;')
+        insert(res, format('    io[1] = v%d;', head.ipv))
+        insert(res, '    return 0;')
+        insert(res, '}')
+        entries[i] = i - 1
+    end
+
+    local cpool_data = {}
+    for i = #cpool, 1, -1 do
+        insert(cpool_data, cpool[i])
+    end
+    cpool_data = concat(cpool_data)
+    -- functions twice: the general and the compact layout (see
+    -- parse_msgpack_compact() in pipeline.c)
+    local funcs = concat(res, '\n')
+    res = { format([[
+#define F(n) f##n
+#define IVAL(p) v[p].ival
+#define XLEN(p) v[p].xlen
+#define XOFF(p) v[p].xoff
+%s
+
+#undef F
+#undef IVAL
+#undef XLEN
+#undef XOFF
+#define F(n) c##n
+#define IVAL(p) COMPACT_IVAL(cv, v, p)
+#define XLEN(p) COMPACT_XLEN(cv, p)
+#define XOFF(p) COMPACT_XOFF(cv, p)
+%s]], funcs, funcs) }
+    insert(res, 1, preamble)
+    insert(res, 2, format([[
+#define CPOOL_SIZE %d
+static const uint8_t cpool[%d] = {
+%s
+};
+]], #cpool_data, #cpool_data + 1, bytes_literal(cpool_data)))
+    insert(res, [[
+
+void schema_native_init(int (*grow)(struct State *state, size_t min_capacity))
+{
+    buf_grow = grow;
+}
+
+size_t schema_native_cpool(const uint8_t **data)
+{
+    *data = cpool;
+    return CPOOL_SIZE;
+}
+
+int64_t schema_native_run(struct State *state, uint32_t entry,
+                          uint32_t v0, uint32_t v1, uint32_t *err)
+{
+    uint32_t io[2];
+    int rc = -1;
+    io[0] = v0;
+    io[1] = v1;
+    if (state->compact) {
+        switch (entry) {]])
+    for i, func in ipairs(il_code) do
+        insert(res, format('        case %d: rc = c%d(state, io, err); break;',
+                           entries[i], func[1].name))
+    end
+    insert(res, [[
+        }
+    } else {
+        switch (entry) {]])
+    for i, func in ipairs(il_code) do
+        insert(res, format('        case %d: rc = f%d(state, io, err); break;',
+                           entries[i], func[1].name))
+    end
+    insert(res, [[
+        }
+    }
+    return rc == 0 ? (int64_t)io[0] : -1;
+}
+]])
+    return {
+        source = concat(res, '\n'),
+        consts = consts,
+        entries = entries
+    }
+end
+
+local function file_exists(path)
+    local file = io.open(path, 'r')
+    if file then file:close() end
+    return file ~= nil
+end
+
+-- POSIX shell single quotes
+local function shell_quote(str)
+    return "'" .. gsub(str, "'", "'\\''") .. "'"
+end
+
+-- Objects built without cache_dir go to a private directory (mkdtemp),
+-- created on the first use. In a shared one (ex: /tmp) anyone could
+-- plant an object under the predictable name.
+local private_dir
+
+-- Builds C source into a shared object in cache_dir, unless already
+-- there. Objects are named after the source digest, the source embeds
+-- everything the code depends on (schemas, compile options) hence
+-- a stale object is never picked. Returns the object path.
+local function build(source, cache_dir)
+    if not cache_dir then
+        private_dir = private_dir or fio.tempdir()
+        if not private_dir then
+            error('native: Can\'t create a temporary directory', 0)
+        end
+        cache_dir = private_dir
+    end
+    local path = format('%s/avro_schema_%s.so', cache_dir,
+                        digest.sha1_hex(source))
+    if file_exists(path) then
+        return path
+    end
+    -- a unique name in cache_dir, renamed once complete
+    local name = os.tmpname()
+    os.remove(name)
+    local tmp = path .. gsub(name, '.*/', '.')
+    local file = io.open(tmp .. '.c', 'w')
+    if not file then
+        error(format('cache_dir: Can\'t write to %s', cache_dir), 0)
+    end
+    file:write(source)
+    file:close()
+    local cmd = format('%s -O2 -fPIC -shared -o %s %s 2>%s',
+                       os.getenv('CC') or 'cc', shell_quote(tmp),
+                       shell_quote(tmp .. '.c'), shell_quote(tmp .. '.log'))
+    local rc = os.execute(cmd)
+    local log = io.open(tmp .. '.log', 'r')
+    local msg = log and log:read('*a') or ''
+    if log then log:close() end
+    os.remove(tmp .. '.c')
+    os.remove(tmp .. '.log')
+    -- see rt.native_load(), the umask may grant group write
+    if (rc ~= 0 and rc ~= true) or not fio.chmod(tmp, tonumber('755', 8)) or
+       not os.rename(tmp, path) then
+        os.remove(tmp)
+        error(format('native: C compiler failed: %s', msg), 0)
+    end
+    return path
+end
+
+return {
+    gen_unit = gen_unit,
+    build    = build
+}
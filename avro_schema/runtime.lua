@@ -1,5 +1,6 @@
 local ffi        = require('ffi')
 local bit        = require('bit')
+local fio        = require('fio')
 local msgpacklib = require('msgpack')
 
 local format = string.format
@@ -9,6 +10,9 @@ local band = bit.band
 
 local ffi_string = ffi.string
 local ffi_new = ffi.new
+local ffi_cast = ffi.cast
+local ffi_copy = ffi.copy
+local ffi_istype = ffi.istype
 local msgpacklib_encode = msgpacklib and msgpacklib.encode
 local msgpacklib_decode = msgpacklib and msgpacklib.decode
 
@@ -46,6 +50,20 @@ if not loaded then
         uint8_t                  *ot;
         struct schema_rt_Value   *ov;
         int32_t                   k;
+        uint8_t                  *sbuf;
+        size_t                    sbuf_size;
+        size_t                    sbuf_capacity;
+        size_t                    spos;
+        size_t                    sitems;
+        uint32_t                  stodo;
+        uint32_t                  spatch;
+        uint32_t                  sdepth;
+        uint32_t                 *bo;
+        size_t                    bo_capacity;
+        uint32_t                  track_bo;
+        uint32_t                  compact;
+        uint32_t                 *cv;
+        size_t                    cv_capacity;
     };
 
     int
@@ -53,20 +71,94 @@ if not loaded then
                   const uint8_t          *msgpack_in,
                   size_t                  msgpack_size);
 
+    int
+    parse_msgpack_compact(struct schema_rt_State *state,
+                          const uint8_t          *msgpack_in,
+                          size_t                  msgpack_size);
+
+    int
+    parse_msgpack_batch(struct schema_rt_State *state,
+                        const uint8_t          *msgpack_in,
+                        size_t                  msgpack_size,
+                        uint32_t               *offsets,
+                        size_t                  n);
+
+    struct schema_rt_SkipPlan {
+        const uint8_t            *items;
+        size_t                    nitems;
+        const uint8_t            *keys;
+        size_t                    keys_size;
+    };
+
+    int
+    parse_msgpack_skip(struct schema_rt_State          *state,
+                       const uint8_t                   *msgpack_in,
+                       size_t                           msgpack_size,
+                       const struct schema_rt_SkipPlan *plan);
+
+    int
+    parse_msgpack_chunk(struct schema_rt_State *state,
+                        const uint8_t          *chunk,
+                        size_t                  size);
+
+    int
+    parse_msgpack_chunk_copy(struct schema_rt_State       *dst,
+                             const struct schema_rt_State *src);
+
     int
     unparse_msgpack(struct schema_rt_State *state,
                     size_t                  nitems);
 
+    int
+    unparse_msgpack_to(struct schema_rt_State *state,
+                       size_t                  nitems,
+                       uint8_t                *buf,
+                       size_t                  capacity);
+
+    void
+    schema_rt_state_destroy(struct schema_rt_State *state);
+
     int
     schema_rt_buf_grow(struct schema_rt_State *state,
                        size_t                  min_capacity);
 
+    int
+    schema_rt_buf_grow_input(struct schema_rt_State *state,
+                             size_t                  min_capacity);
+
+    void
+    schema_rt_buf_trim(struct schema_rt_State *state,
+                       size_t                  t_capacity,
+                       size_t                  ot_capacity,
+                       size_t                  res_capacity);
+
+    void
+    schema_rt_compact_expand(struct schema_rt_State *state);
+
     int schema_rt_extract_location(struct schema_rt_State *state,
                                    intptr_t                pos);
 
     void schema_rt_xflatten_done(struct schema_rt_State *state,
                                  size_t len);
 
+    int64_t schema_rt_interp(struct schema_rt_State *state,
+                             const uint32_t          *code,
+                             uint32_t                 entry,
+                             uint32_t                 v0,
+                             uint32_t                 v1,
+                             uint32_t                *err);
+
+    /* native.lua generated code */
+    void schema_native_init(int (*grow)(struct schema_rt_State *, size_t));
+
+    size_t schema_native_cpool(const uint8_t **data);
+
+    int64_t schema_native_run(struct schema_rt_State *state,
+                              uint32_t                 entry,
+                              uint32_t                 v0,
+                              uint32_t                 v1,
+                              uint32_t                *err);
+
 ]]
 
     -- hash ---------------------------------------------------------------
@@ -136,6 +228,29 @@ if not loaded then
 
     int32_t
     phf_hash_uint32_band_raw32(const void *g, int32_t k, int32_t seed, size_t r, size_t m);
+
+    struct schema_rt_phf_string {
+        const void               *p;
+        size_t                    n;
+    };
+
+    int
+    phf_init_string(struct schema_rt_phf *phf,
+                    const struct schema_rt_phf_string *k,
+                    size_t n,
+                    size_t lambda,
+                    size_t alpha,
+                    int32_t seed,
+                    bool nodiv);
+
+    int32_t
+    phf_hash_string_band_raw8(const void *g, const void *p, size_t n, int32_t seed, size_t r, size_t m);
+
+    int32_t
+    phf_hash_string_band_raw16(const void *g, const void *p, size_t n, int32_t seed, size_t r, size_t m);
+
+    int32_t
+    phf_hash_string_band_raw32(const void *g, const void *p, size_t n, int32_t seed, size_t r, size_t m);
     ]]
 
     regs = ffi_new('struct schema_rt_State')
@@ -155,35 +270,794 @@ end
 -- Buf has space for at least 128 items.
 buf_grow(regs, 128)
 
+--
+-- stream
+--
+
+-- Parses a MsgPack value arriving in chunks, has a state of its own
+-- (other values may be parsed and converted in between).
+local stream_methods = {}
+local stream_mt = { __index = stream_methods }
+
+local function stream()
+    local state = ffi.gc(ffi_new('struct schema_rt_State'),
+                         rt_C.schema_rt_state_destroy)
+    -- conversions may pass subtrees through verbatim
+    state.track_bo = 1
+    return setmetatable({ state = state, complete = false }, stream_mt)
+end
+
+-- Returns true, false if more data is needed, true, true, pending once
+-- the value is complete or false, error. Pending bytes (past the value
+-- end) are kept, the next call starts a new value with them; feed('')
+-- parses a value which is already there.
+function stream_methods.feed(self, chunk)
+    if type(chunk) ~= 'string' then
+        return false, 'Expecting a string'
+    end
+    local state = self.state
+    local rc = rt_C.parse_msgpack_chunk(state, chunk, #chunk)
+    self.complete = rc == 0
+    if rc < 0 then
+        return false, ffi_string(state.res, state.res_size)
+    elseif rc > 0 then
+        return true, false
+    end
+    return true, true, tonumber(state.sbuf_size - state.spos)
+end
+
+-- Makes the complete value the input of a conversion
+local function stream_decode(r, s)
+    if not s.complete then
+        error('Incomplete data', 0)
+    end
+    if rt_C.parse_msgpack_chunk_copy(r, s.state) ~= 0 then
+        error(ffi.string(r.res, r.res_size), 0)
+    end
+    return s
+end
+
 local function msgpack_decode(r, s)
+    if getmetatable(s) == stream_mt then
+        return stream_decode(r, s)
+    end
     if rt_C.parse_msgpack(r, s, #s) ~= 0 then
         error(ffi.string(r.res, r.res_size), 0)
     end
     return s
 end
 
+--
+-- buf_cfg, buf_stats
+--
+
+-- Buffers only grow during a conversion. Once their total size exceeds
+-- trim_retain bytes, they are shrunk to the high-water mark of the last
+-- trim_after conversions, provided each needed no more than trim_retain.
+local trim_retain      -- nil: never shrink
+local trim_after = 16
+local trim_count, hwm_t, hwm_ot, hwm_res = 0, 0, 0, 0
+
+local ITEM_SIZE = 1 + ffi.sizeof('struct schema_rt_Value')
+local OFFSET_SIZE = ffi.sizeof('uint32_t') -- bo and cv entries
+
+-- Bytes held by the buffers of r
+local function buf_bytes(r)
+    return tonumber(r.t_capacity + r.ot_capacity) * ITEM_SIZE +
+           tonumber(r.bo_capacity + r.cv_capacity) * OFFSET_SIZE +
+           tonumber(r.res_capacity + r.sbuf_capacity)
+end
+
+-- Bytes a conversion needed, bo and cv grow along with t/v
+local function buf_bytes_used(r, t_used, ot_used, res_used)
+    local item_size = ITEM_SIZE
+    if r.bo_capacity ~= 0 then item_size = item_size + OFFSET_SIZE end
+    if r.cv_capacity ~= 0 then item_size = item_size + OFFSET_SIZE end
+    return t_used * item_size + ot_used * ITEM_SIZE + res_used
+end
+
+local function buf_track(r, t_used, ot_used)
+    if r ~= regs then return end -- pooled states are trimmed on release
+    local res_used = tonumber(r.res_size)
+    if buf_bytes(r) <= trim_retain then
+        trim_count = 0
+        return
+    end
+    if buf_bytes_used(r, t_used, ot_used, res_used) > trim_retain then
+        trim_count, hwm_t, hwm_ot, hwm_res = 0, 0, 0, 0
+        return
+    end
+    trim_count = trim_count + 1
+    hwm_t = math.max(hwm_t, t_used)
+    hwm_ot = math.max(hwm_ot, ot_used)
+    hwm_res = math.max(hwm_res, res_used)
+    if trim_count >= trim_after then
+        rt_C.schema_rt_buf_trim(r, hwm_t, hwm_ot, hwm_res)
+        trim_count, hwm_t, hwm_ot, hwm_res = 0, 0, 0, 0
+    end
+end
+
+-- Scratch buffers of the Lua side (table_decode() bank, tuple data),
+-- a pair per state; regs' ones are shrunk the same way, other states'
+-- ones on state_release(). The data in use stays alive while the
+-- caller holds it.
+local function scratch_new(ctype, min_capacity)
+    return {
+        data = ffi_new(ctype, min_capacity), capacity = min_capacity,
+        ctype = ctype, min_capacity = min_capacity, count = 0, hwm = 0
+    }
+end
+
+local function scratch_trim(b, used)
+    local capacity = b.min_capacity
+    while capacity < used do capacity = capacity * 2 end
+    b.data, b.capacity = ffi_new(b.ctype, capacity), capacity
+    b.count, b.hwm = 0, 0
+end
+
+local function scratch_track(b, used)
+    if not trim_retain or
+       b.capacity <= math.max(trim_retain, b.min_capacity) then
+        b.count = 0
+        return
+    end
+    if used > trim_retain then
+        b.count, b.hwm = 0, 0
+        return
+    end
+    b.count = b.count + 1
+    b.hwm = math.max(b.hwm, used)
+    if b.count >= trim_after then
+        scratch_trim(b, b.hwm)
+    end
+end
+
+-- {table_decode() bank, tuple data} by state. Tuple data is copied
+-- rather than re-encoded with msgpacklib, the module API has no way to
+-- borrow it.
+local scratch_by_state = setmetatable({}, { __mode = 'k' })
+
+local function scratch_get(r)
+    local b = scratch_by_state[r]
+    if not b then
+        b = { scratch_new('uint8_t[?]', 4096), scratch_new('char[?]', 128) }
+        scratch_by_state[r] = b
+    end
+    return b[1], b[2]
+end
+
+-- retain - bytes kept unconditionally (nil: never shrink),
+-- trim_after - shrink after that many conversions fitting in retain
+local function buf_cfg(cfg)
+    if type(cfg) ~= 'table' then
+        error('buf_cfg: Expecting a table', 0)
+    end
+    if cfg.retain ~= nil and type(cfg.retain) ~= 'number' then
+        error('buf_cfg: retain: Expecting a number', 0)
+    end
+    if cfg.trim_after ~= nil and (type(cfg.trim_after) ~= 'number' or
+                                  cfg.trim_after < 1) then
+        error('buf_cfg: trim_after: Expecting a positive number', 0)
+    end
+    trim_retain = cfg.retain
+    trim_after = cfg.trim_after or trim_after
+    trim_count, hwm_t, hwm_ot, hwm_res = 0, 0, 0, 0
+    local tbank_b, tuple_b = scratch_get(regs)
+    tbank_b.count, tbank_b.hwm = 0, 0
+    tuple_b.count, tuple_b.hwm = 0, 0
+end
+
+local function buf_stats(r)
+    local tbank_b, tuple_b = scratch_get(r)
+    return {
+        t_capacity     = tonumber(r.t_capacity),
+        ot_capacity    = tonumber(r.ot_capacity),
+        res_capacity   = tonumber(r.res_capacity),
+        bo_capacity    = tonumber(r.bo_capacity),
+        cv_capacity    = tonumber(r.cv_capacity),
+        sbuf_capacity  = tonumber(r.sbuf_capacity),
+        bytes          = buf_bytes(r),
+        tbank_capacity = tbank_b.capacity,
+        tuple_data_capacity = tuple_b.capacity,
+        retain         = trim_retain,
+        trim_after     = trim_after
+    }
+end
+
+--
+-- state_acquire, state_release
+--
+
+-- Extra states for conversions which shouldn't share regs, ex. to keep
+-- a result in r.res alive or to isolate buffers grown by a huge value.
+-- Up to state_pool_max released states are kept for reuse.
+local state_pool = {}
+local state_pool_max = 16
+
+local function is_state(r)
+    return type(r) == 'cdata' and ffi.istype('struct schema_rt_State', r)
+end
+
+local function state_acquire()
+    local r = remove(state_pool)
+    if r then return r end
+    r = ffi.gc(ffi_new('struct schema_rt_State'), rt_C.schema_rt_state_destroy)
+    buf_grow(r, 128)
+    return r
+end
+
+local function state_release(r)
+    if not is_state(r) or r == regs then
+        error('state_release: Expecting a state', 0)
+    end
+    if #state_pool >= state_pool_max then
+        return
+    end
+    for _, p in ipairs(state_pool) do
+        if p == r then return end -- released twice
+    end
+    if trim_retain then
+        if buf_bytes(r) > trim_retain then
+            rt_C.schema_rt_buf_trim(r, 0, 0, 0)
+        end
+        for _, b in ipairs({ scratch_get(r) }) do
+            if b.capacity > math.max(trim_retain, b.min_capacity) then
+                scratch_trim(b, 0)
+            end
+        end
+    end
+    insert(state_pool, r)
+end
+
 local function msgpack_encode(r, n)
+    local t_used = trim_retain and tonumber(r.res_size)
     if rt_C.unparse_msgpack(r, n) ~= 0 then
         error(ffi.string(r.res, r.res_size), 0)
     end
-    return ffi_string(r.res, r.res_size)
+    local res = ffi_string(r.res, r.res_size)
+    if t_used then buf_track(r, t_used, n) end
+    return res
+end
+
+--
+-- table_decode
+--
+
+-- Lua values are stored to t/v directly rather than encoded with
+-- msgpacklib and parsed. Strings are copied to tbank (offsets are
+-- relative to the end, as with parse_msgpack()). With track_bo, arrays
+-- and maps of scalars are stored to tbank encoded the way
+-- msgpack.encode() would do it, spans copy them.
+local tbank, tbank_capacity -- of the state, while decoding
+local tpos = 0
+local tstate, tt, tv, tbo, tcap
+
+local function tbank_reserve(size)
+    if tpos + size <= tbank_capacity then return end
+    local capacity = tbank_capacity
+    repeat capacity = capacity * 2 until tpos + size <= capacity
+    local bank = ffi_new('uint8_t[?]', capacity)
+    ffi_copy(bank, tbank, tpos)
+    tbank, tbank_capacity = bank, capacity
+end
+
+local function tv_grow(min_capacity)
+    if rt_C.schema_rt_buf_grow_input(tstate, min_capacity) ~= 0 then
+        error('Out of memory', 0)
+    end
+    tt, tv, tcap = tstate.t, tstate.v, tonumber(tstate.t_capacity)
+    if tbo ~= nil then tbo = tstate.bo end
+end
+
+-- writes c followed by x as a big endian n-byte unsigned
+local function tbank_put(c, x, n)
+    tbank_reserve(n + 1)
+    local p = tpos + n
+    tbank[tpos] = c
+    for k = p, tpos + 1, -1 do
+        tbank[k] = band(x, 0xff)
+        x = bit.rshift(x, 8)
+    end
+    tpos = p + 1
+end
+
+-- MsgPack header of a string, array or map, fix - the fix* tag
+local function tbank_header(fix, fixmax, c8, c16, c32, n)
+    if n <= fixmax then
+        tbank_reserve(1)
+        tbank[tpos] = fix + n
+        tpos = tpos + 1
+    elseif c8 and n <= 0xff then
+        tbank_put(c8, n, 1)
+    elseif n <= 0xffff then
+        tbank_put(c16, n, 2)
+    else
+        tbank_put(c32, n, 4)
+    end
+end
+
+local function tbank_uint(x)
+    if x <= 0x7f then
+        tbank_put(tonumber(x), 0, 0)
+    elseif x <= 0xff then
+        tbank_put(0xcc, tonumber(x), 1)
+    elseif x <= 0xffff then
+        tbank_put(0xcd, tonumber(x), 2)
+    elseif x <= 0xffffffff then
+        tbank_put(0xce, tonumber(x), 4)
+    else
+        tbank_put(0xcf, ffi_cast('uint64_t', x), 8)
+    end
 end
 
-local function universal_decode(r, s)
+local function tbank_int(x)
+    if x >= -0x20 then
+        tbank_put(tonumber(x) + 0x100, 0, 0)
+    elseif x >= -0x80 then
+        tbank_put(0xd0, tonumber(x) + 0x100, 1)
+    elseif x >= -0x8000 then
+        tbank_put(0xd1, tonumber(x) + 0x10000, 2)
+    elseif x >= -0x80000000 then
+        tbank_put(0xd2, tonumber(x) + 0x100000000, 4)
+    else
+        tbank_put(0xd3, ffi_cast('uint64_t', x), 8)
+    end
+end
+
+local double_bits = ffi_new('union { double d; uint64_t u; }')
+
+local int64_t, uint64_t = ffi.typeof('int64_t'), ffi.typeof('uint64_t')
+
+-- Stores x starting at item i, encodes it to tbank if enc is set.
+-- Returns the index of the next item or nil if x can't be stored the
+-- way parse_msgpack(msgpack.encode(x)) would do it.
+local table_put
+table_put = function(x, i, enc)
+    if i >= tcap then tv_grow(i + 1) end
+    if tbo ~= nil then tbo[i] = tpos end
+    local tx = type(x)
+    if tx == 'string' then
+        local len = #x
+        if enc then tbank_header(0xa0, 31, 0xd9, 0xda, 0xdb, len) end
+        tbank_reserve(len)
+        ffi_copy(tbank + tpos, x, len)
+        tt[i] = 8
+        tv[i].xlen = len
+        tv[i].xoff = tpos
+        tpos = tpos + len
+        return i + 1
+    elseif tx == 'number' then
+        if x % 1 == 0 and x >= -2^63 and x < 2^64 then
+            if x >= 2^63 then
+                tt[i] = 5
+                tv[i].uval = x
+                if enc then tbank_uint(tv[i].uval) end
+                return i + 1
+            end
+            tt[i] = 4
+            tv[i].ival = x
+            if enc then
+                if x >= 0 then tbank_uint(tv[i].ival)
+                else tbank_int(tv[i].ival) end
+            end
+            return i + 1
+        end
+        tt[i] = 7
+        tv[i].dval = x
+        if enc then
+            double_bits.d = x
+            tbank_put(0xcb, double_bits.u, 8)
+        end
+        return i + 1
+    elseif tx == 'boolean' then
+        tt[i] = x and 3 or 2
+        if enc then tbank_put(x and 0xc3 or 0xc2, 0, 0) end
+        return i + 1
+    elseif tx == 'table' then
+        if getmetatable(x) ~= nil then return nil end -- __serialize
+        local n, count, nints, scalars = #x, 0, 0, true
+        for k, y in pairs(x) do
+            count = count + 1
+            if type(k) == 'number' and k >= 1 and k % 1 == 0 then
+                nints = nints + 1
+            end
+            if type(y) == 'table' then scalars = false end
+        end
+        local span = tbo ~= nil and scalars
+        local j = i + 1
+        if nints == count then
+            -- sparse arrays, msgpack.encode() may fill the gaps
+            if count ~= n then return nil end
+            tt[i] = 11
+            tv[i].xlen = n
+            if span then tbank_header(0x90, 15, nil, 0xdc, 0xdd, n) end
+            for k = 1, n do
+                j = table_put(x[k], j, span)
+                if not j then return nil end
+            end
+        else
+            tt[i] = 12
+            tv[i].xlen = count
+            if span then tbank_header(0x80, 15, nil, 0xde, 0xdf, count) end
+            for k, y in pairs(x) do
+                j = table_put(k, j, span)
+                if not j then return nil end
+                j = table_put(y, j, span)
+                if not j then return nil end
+            end
+        end
+        tv[i].xoff = j - i
+        return j
+    elseif tx == 'cdata' then
+        if x == nil then
+            tt[i] = 1
+            if enc then tbank_put(0xc0, 0, 0) end
+            return i + 1
+        elseif ffi_istype(int64_t, x) then
+            tt[i] = 4
+            tv[i].ival = x
+            if enc then
+                if x >= 0 then tbank_uint(x) else tbank_int(x) end
+            end
+            return i + 1
+        elseif ffi_istype(uint64_t, x) then
+            tt[i] = x > 0x7fffffffffffffffULL and 5 or 4
+            tv[i].uval = x
+            if enc then tbank_uint(x) end
+            return i + 1
+        end
+    end
+    return nil
+end
+
+-- Fills t/v from a Lua table. Returns the bank (keep it alive while
+-- the items are in use) or nil, the caller encodes the table then.
+local function table_decode(r, s)
+    local b = scratch_get(r)
+    tstate, tpos = r, 0
+    tbank, tbank_capacity = b.data, b.capacity
+    tt, tv, tcap = r.t, r.v, tonumber(r.t_capacity)
+    tbo = nil
+    if r.track_bo ~= 0 then
+        tv_grow(1) -- reserves bo
+        tbo = r.bo
+    end
+    local n = table_put(s, 0, false)
+    local bank, total = tbank, tpos
+    tstate, tbank = nil, nil
+    b.data, b.capacity = bank, tbank_capacity
+    if r == regs then scratch_track(b, total) end
+    if not n then return nil end
+    -- offsets relative to the end
+    local t, v = tt, tv
+    for i = 0, n - 1 do
+        if t[i] == 8 then v[i].xoff = total - v[i].xoff end
+    end
+    if tbo ~= nil then
+        local bo = tbo
+        bo[n] = total
+        for i = 0, n do bo[i] = total - bo[i] end
+    end
+    r.res_size = n
+    r.b1 = bank + total
+    r.compact = 0
+    return bank
+end
+
+--
+-- Tarantool tuple API
+--
+
+-- Tarantool tuple C API, resolved on the first use (false outside
+-- Tarantool)
+local tuple_api
+
+local function tuple_api_load()
+    for _, decl in ipairs({
+        'typedef struct tuple_format box_tuple_format_t;',
+        'typedef struct tuple box_tuple_t;',
+        'box_tuple_format_t *box_tuple_format_default(void);',
+        [[box_tuple_t *box_tuple_new(box_tuple_format_t *format,
+                                     const char *data, const char *end);]],
+        'int box_tuple_ref(box_tuple_t *tuple);',
+        'void box_tuple_unref(box_tuple_t *tuple);',
+        'size_t box_tuple_bsize(const box_tuple_t *tuple);',
+        [[ssize_t box_tuple_to_buf(const box_tuple_t *tuple,
+                                   char *buf, size_t size);]]
+    }) do
+        pcall(ffi.cdef, decl) -- Tarantool may have it declared already
+    end
+    local C = ffi.C
+    local ok = pcall(function()
+        return C.box_tuple_new, C.box_tuple_format_default,
+               C.box_tuple_ref, C.box_tuple_unref,
+               C.box_tuple_bsize, C.box_tuple_to_buf
+    end)
+    tuple_api = ok and {
+        C = C, tuple_ref_t = ffi.typeof('const struct tuple &')
+    }
+    return tuple_api
+end
+
+-- Returns the tuple data and its size or nil if s isn't a tuple.
+local function tuple_data_get(r, s)
+    local api = tuple_api
+    if api == nil then api = tuple_api_load() end
+    if not api or not ffi_istype(api.tuple_ref_t, s) then
+        return nil
+    end
+    local C = api.C
+    local size = tonumber(C.box_tuple_bsize(s))
+    local _, b = scratch_get(r)
+    if size > b.capacity then
+        b.capacity = math.max(size, 2 * b.capacity)
+        b.data = ffi_new(b.ctype, b.capacity)
+    end
+    local data = b.data
+    C.box_tuple_to_buf(s, data, size)
+    if r == regs then scratch_track(b, size) end
+    return data, size
+end
+
+-- Plan is optional, see skip_plan(). Compact lets the parser use the
+-- compact layout (parse_msgpack_compact()), only the interp and native
+-- code cope with it.
+local function universal_decode(r, s, plan, compact)
+    local size
     if type(s) ~= 'string' then
-        s = msgpacklib_encode(s)
+        if getmetatable(s) == stream_mt then
+            return stream_decode(r, s)
+        end
+        local data
+        if type(s) == 'table' then
+            data = table_decode(r, s)
+            if data then return data end
+        elseif type(s) == 'cdata' then
+            data, size = tuple_data_get(r, s)
+        end
+        s = data or msgpacklib_encode(s)
     end
-    if rt_C.parse_msgpack(r, s, #s) ~= 0 then
+    size = size or #s
+    local rc
+    if plan then
+        rc = rt_C.parse_msgpack_skip(r, s, size, plan)
+    elseif compact then
+        rc = rt_C.parse_msgpack_compact(r, s, size)
+    else
+        rc = rt_C.parse_msgpack(r, s, size)
+    end
+    if rc ~= 0 then
         error(ffi.string(r.res, r.res_size), 0)
     end
     return s
 end
 
+--
+-- skip_plan
+--
+
+local skip_plan_data = setmetatable({}, { __mode = 'k' })
+
+-- Items - root array positions (0-based), keys - root map keys;
+-- contents of arrays and maps found there aren't stored by the parser.
+local function skip_plan(items, keys)
+    if not next(items) and not next(keys) then
+        return nil
+    end
+    local plan = ffi_new('struct schema_rt_SkipPlan')
+    local nitems = 0
+    for _, pos in ipairs(items) do
+        nitems = math.max(nitems, pos + 1)
+    end
+    local mask = ffi_new('uint8_t[?]', nitems)
+    for _, pos in ipairs(items) do
+        mask[pos] = 1
+    end
+    local blob = {}
+    for _, key in ipairs(keys) do
+        if #key < 256 then
+            insert(blob, string.char(#key) .. key)
+        end
+    end
+    blob = concat(blob)
+    plan.items, plan.nitems = mask, nitems
+    plan.keys, plan.keys_size = blob, #blob
+    skip_plan_data[plan] = { mask, blob }
+    return plan
+end
+
+--
+-- lua_encode
+--
+
+-- Lua C module building the result from ot/ov (runtime/lua_build.c),
+-- optional; unparse_msgpack() + msgpack.decode() without it.
+local lua_build
+do
+    local ok, rt_lua = pcall(require, 'avro_schema_rt_lua')
+    if ok and msgpacklib then
+        lua_build = rt_lua.builder(msgpacklib.NULL, msgpacklib.array_mt,
+                                   msgpacklib.map_mt)
+    end
+end
+
 local function lua_encode(r, n)
+    local t_used = trim_retain and tonumber(r.res_size)
+    local res
+    if lua_build then
+        local cfg = msgpacklib.cfg
+        res = lua_build(r, n, cfg and cfg.decode_save_metatables)
+    end
+    if res ~= nil then
+        r.res_size = 0 -- res unused
+    else -- ext values, say
+        if rt_C.unparse_msgpack(r, n) ~= 0 then
+            error(ffi.string(r.res, r.res_size), 0)
+        end
+        res = msgpacklib_decode(ffi_string(r.res, r.res_size))
+    end
+    if t_used then buf_track(r, t_used, n) end
+    return res
+end
+
+--
+-- msgpack_encode_to
+--
+
+-- Tarantool ibuf (buffer module), if available
+local ibuf_t, ibuf_ptr_t
+if pcall(require, 'buffer') then
+    local ok, t = pcall(ffi.typeof, 'struct ibuf')
+    if ok then
+        ibuf_t, ibuf_ptr_t = t, ffi.typeof('struct ibuf *')
+    end
+end
+
+-- Output of msgpack_encode_to(), set by convert_to()
+local to_ibuf, to_ptr, to_capacity
+
+-- Writes the output into the caller's buffer, saving the Lua string.
+-- Returns the output size; if it exceeds the capacity of a pointer
+-- target, the contents there are undefined (never past the capacity).
+local function msgpack_encode_to(r, n)
+    local t_used = trim_retain and tonumber(r.res_size)
+    local ibuf, buf, capacity = to_ibuf, to_ptr, to_capacity
+    if ibuf then
+        -- room for the headers (the encoder keeps 10 bytes of slack) or
+        -- the free space if more, strings exceeding that are copied
+        -- from res; a reused ibuf keeps the space once grown
+        buf = ffi_cast('uint8_t *', ibuf:reserve(n * 9 + 10))
+        capacity = ffi_cast('uint8_t *', ibuf.epos) - buf
+    end
+    local rc = rt_C.unparse_msgpack_to(r, n, buf, capacity)
+    if rc < 0 then
+        error(ffi_string(r.res, r.res_size), 0)
+    end
+    local size = tonumber(r.res_size)
+    if ibuf then
+        if rc == 1 then
+            buf = ibuf:reserve(size)
+            ffi_copy(buf, r.res, size)
+        end
+        ibuf.wpos = ibuf.wpos + size
+    elseif rc == 1 and size <= capacity then
+        -- fits, but not with the slack the encoder needs
+        ffi_copy(buf, r.res, size)
+    end
+    if t_used then buf_track(r, t_used, n) end
+    return size
+end
+
+--
+-- tuple_encode
+--
+
+-- Builds a box.tuple from the output, skipping the Lua string and
+-- the parse box.tuple.new() would do.
+local function tuple_encode(r, n)
+    local api = tuple_api
+    if api == nil then api = tuple_api_load() end
+    if not api then
+        error('Tuples are not available outside Tarantool', 0)
+    end
+    local C = api.C
+    local t_used = trim_retain and tonumber(r.res_size)
     if rt_C.unparse_msgpack(r, n) ~= 0 then
-        error(ffi.string(r.res, r.res_size), 0)
+        error(ffi_string(r.res, r.res_size), 0)
+    end
+    local data = ffi_cast('const char *', r.res)
+    local tuple = C.box_tuple_new(C.box_tuple_format_default(), data,
+                                  data + r.res_size)
+    if tuple == nil then
+        error('Failed to allocate a tuple', 0)
+    end
+    if t_used then buf_track(r, t_used, n) end
+    -- same as box.tuple.new() results
+    C.box_tuple_ref(tuple)
+    return ffi.gc(ffi_cast(api.tuple_ref_t, tuple), C.box_tuple_unref)
+end
+
+local function convert_to_done(...)
+    to_ibuf, to_ptr = nil, nil
+    return ...
+end
+
+-- Runs convert(...) (a routine linked with msgpack_encode_to) with the
+-- output going to buf: an ibuf (the output is appended) or a pointer
+-- followed by the capacity (nothing is written if the output size
+-- returned exceeds the capacity).
+local function convert_to(convert, buf, ...)
+    if ibuf_t and (ffi_istype(ibuf_t, buf) or ffi_istype(ibuf_ptr_t, buf)) then
+        to_ibuf = buf
+        return convert_to_done(convert(...))
+    end
+    local capacity = ...
+    if type(buf) ~= 'cdata' or type(capacity) ~= 'number' then
+        return false, 'Expecting an ibuf or a pointer and a capacity'
+    end
+    to_ibuf, to_ptr, to_capacity = nil, ffi_cast('uint8_t *', buf), capacity
+    return convert_to_done(convert(select(2, ...)))
+end
+
+--
+-- batch_convert
+--
+
+-- Values parsed per parse_msgpack_batch() call.
+local batch_capacity = 256
+local batch_offsets = ffi_new('uint32_t[?]', 2 * batch_capacity + 2)
+local batch_pos = 0
+
+local function batch_loop(step, r, v0, n)
+    local offsets = batch_offsets
+    for i = 0, n - 1 do
+        batch_pos = i
+        v0 = step(r, v0, offsets[2 * i])
+    end
+    return v0
+end
+
+-- Converts concatenated MsgPack values, step is the generated
+-- conversion of a single value (items start at v1, output is appended
+-- at v0). Returns true, concatenated results, count or false, error,
+-- index of the offending value. Error locations are relative to
+-- the value start, hence the offending value is converted once more
+-- with single to obtain the error message.
+-- Note: parse_msgpack_batch() reuses ov for the stack, hence the output
+-- is encoded after every call.
+local function batch_convert(r, step, single, cpool, data)
+    if type(data) ~= 'string' then
+        return false, 'Expecting a string', 1
+    end
+    local offsets = batch_offsets
+    local b2 = ffi_cast('const uint8_t *', cpool) + #cpool
+    local p = ffi_cast('const uint8_t *', data)
+    local size, pos, count = #data, 0, 0
+    local output = {}
+    while pos ~= size do
+        local n = rt_C.parse_msgpack_batch(r, p + pos, size - pos,
+                                           offsets, batch_capacity)
+        if n < 0 then
+            return false, ffi_string(r.res, r.res_size),
+                   count + offsets[2 * batch_capacity] + 1
+        end
+        r.b2 = b2
+        local ok, v0 = pcall(batch_loop, step, r, 0, n)
+        if not ok then
+            local i = batch_pos
+            local _, err = pcall(single, r,
+                                 data:sub(pos + offsets[2 * i + 1] + 1,
+                                          pos + offsets[2 * i + 3]))
+            return false, err, count + i + 1
+        end
+        if rt_C.unparse_msgpack(r, v0) ~= 0 then
+            return false, ffi_string(r.res, r.res_size)
+        end
+        insert(output, ffi_string(r.res, r.res_size))
+        if trim_retain then buf_track(r, offsets[2 * n], v0) end
+        count, pos = count + n, pos + offsets[2 * n + 1]
     end
-    return msgpacklib_decode(ffi_string(r.res, r.res_size))
+    return true, concat(output), count
 end
 
 --
@@ -335,6 +1209,115 @@ local function err_value(r, pos, ver_error)
     error(format('%sBad value: %s%s', location, val, tag), 0)
 end
 
+--
+-- interp
+--
+
+local interp_err = ffi_new('uint32_t[3]')
+
+-- Bytecode (a string) to the form schema_rt_interp() expects
+local function interp_code(bytecode)
+    local code = ffi_new('uint32_t[?]', #bytecode / 4)
+    ffi.copy(code, bytecode, #bytecode)
+    return code
+end
+
+-- Raises the error reported by schema_rt_interp() or
+-- schema_native_run() (enum InterpError in pipeline.c).
+local function interp_error(r, consts)
+    local kind, pos, arg = interp_err[0], interp_err[1], interp_err[2]
+    if r.compact ~= 0 then
+        rt_C.schema_rt_compact_expand(r)
+    end
+    if kind == 1 then
+        err_type(r, pos, arg)
+    elseif kind == 2 then
+        err_length(r, pos, arg)
+    elseif kind == 3 then
+        err_missing(r, pos, consts[arg + 1])
+    elseif kind == 4 then
+        err_duplicate(r, pos)
+    elseif kind == 5 then
+        err_value(r, pos, arg == 1)
+    elseif kind == 6 then
+        error(consts[arg + 1], 0)
+    end
+    error('Out of memory', 0)
+end
+
+-- Runs a function of a bytecode program (see bytecode.lua) starting
+-- at entry, consts are strings referenced by error reports.
+-- Returns $0 once the function completes.
+local function interp(r, code, consts, entry, v0, v1)
+    local res = rt_C.schema_rt_interp(r, code, entry, v0, v1, interp_err)
+    if res >= 0 then
+        return tonumber(res)
+    end
+    interp_error(r, consts)
+end
+
+--
+-- native
+--
+
+local native_cpool_data = ffi_new('const uint8_t *[1]')
+
+pcall(ffi.cdef, 'unsigned int getuid(void);') -- may be declared already
+
+-- Yields the first of the paths missing, not owned by the current
+-- user or writable by the group or others, nil if all are private.
+local function unsafe_path(...)
+    local uid = ffi.C.getuid()
+    for i = 1, select('#', ...) do
+        local p = select(i, ...)
+        local st = fio.stat(p)
+        if not st or st.uid ~= uid or band(st.mode, 18) ~= 0 then -- 022
+            return p
+        end
+    end
+end
+
+-- The object is loaded into the process, refuse one others could have
+-- planted or modified: the object and it's directory are to be owned
+-- by the current user and not writable by the group or others.
+local function native_check(path)
+    local p = unsafe_path(fio.dirname(path), path)
+    if p then
+        error(format('native: Unsafe object path: %s', p), 0)
+    end
+end
+
+-- Loads a shared object built by native.lua, returns the library
+-- and it's cpool (a string).
+local function native_load(path)
+    native_check(path)
+    local lib = ffi.load(path)
+    lib.schema_native_init(rt_C.schema_rt_buf_grow)
+    local size = lib.schema_native_cpool(native_cpool_data)
+    return lib, ffi_string(native_cpool_data[0], size)
+end
+
+-- Same as interp(), runs a function of a native library.
+local function native(r, lib, consts, entry, v0, v1)
+    local res = lib.schema_native_run(r, entry, v0, v1, interp_err)
+    if res >= 0 then
+        return tonumber(res)
+    end
+    interp_error(r, consts)
+end
+
+-- Hit counts of a profiling build (see backend.lua), counters[i-1]
+-- belongs to keys[i] = {conditional number, branch key}.
+local function profile_report(counters, keys)
+    local res = {}
+    for i, key in ipairs(keys) do
+        local branches = res[key[1]] or {}
+        res[key[1]] = branches
+        branches[key[2]] = tonumber(counters[i - 1])
+    end
+    return res
+end
+
 return {
     -- don't expose C library (unsafe),
     -- but let module user to load it herself (if she can)
@@ -343,10 +1326,27 @@ return {
     vis_msgpack      = vis_msgpack,
     regs             = regs,
     buf_grow         = buf_grow,
+    buf_cfg          = buf_cfg,
+    buf_stats        = function() return buf_stats(regs) end,
     msgpack_encode   = msgpack_encode,
     msgpack_decode   = msgpack_decode,
     lua_encode       = lua_encode,
+    msgpack_encode_to = msgpack_encode_to,
+    tuple_encode     = tuple_encode,
+    convert_to       = convert_to,
     universal_decode = universal_decode,
+    skip_plan        = skip_plan,
+    stream           = stream,
+    batch_convert    = batch_convert,
+    profile_report   = profile_report,
+    interp           = interp,
+    interp_code      = interp_code,
+    native           = native,
+    native_load      = native_load,
+    unsafe_path      = unsafe_path,
+    is_state         = is_state,
+    state_acquire    = state_acquire,
+    state_release    = state_release,
     err_type         = err_type,
     err_length       = err_length,
     err_missing      = err_missing,
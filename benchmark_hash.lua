@@ -0,0 +1,85 @@
+-- Build time and quality of the string hash functions created for
+-- enums and record fields (create_hash_func() in runtime/hash.c)
+local ffi   = require('ffi')
+local clock = require('clock')
+local rt    = require('avro_schema.runtime')
+local rt_C  = ffi.load(rt.C_path)
+
+local random_bytes = ffi.string(ffi.new('uint32_t[16]', {
+    0x811c9dc5, 0x4f1bbcdd, 0x6b8b4567, 0x327b23c6, 0x643c9869, 0x66334873,
+    0x74b0dc51, 0x19495cff, 0x2ae8944a, 0x625558ec, 0x238e1f29, 0x46e87ccd,
+    0x3d1b58ba, 0x507ed7ab, 0x2eb141f2, 0x41b71efb }), 64)
+
+math.randomseed(42)
+
+local function random_word(min, max)
+    local res = {}
+    for i = 1, math.random(min, max) do
+        res[i] = string.char(math.random(97, 122))
+    end
+    return table.concat(res)
+end
+
+local function gen_set(n, gen)
+    local res, seen = {}, {}
+    while #res < n do
+        local s = gen(#res + 1)
+        if not seen[s] then
+            seen[s] = true
+            table.insert(res, s)
+        end
+    end
+    return res
+end
+
+local sets = {}
+for _, n in ipairs({ 100, 1000, 10000, 50000 }) do
+    table.insert(sets, { 'symbols_' .. n, gen_set(n, function(i)
+        return '_' .. i end) })
+    table.insert(sets, { 'words_' .. n, gen_set(n, function()
+        return random_word(4, 12) end) })
+    table.insert(sets, { 'prefixed_' .. n, gen_set(n, function()
+        return 'field_' .. random_word(4, 6) end) })
+end
+
+-- Quality: the function must be perfect (distinct hashes); items
+-- sharing a bucket of a power of 2 table show how well the hashes
+-- spread when used as a hash table key.
+local function quality(func, set)
+    local n, distinct, seen = #set, 0, {}
+    local buckets, used, shared = 1, {}, 0
+    while buckets <= n do buckets = buckets * 2 end
+    for _, s in ipairs(set) do
+        local h = rt_C.eval_hash_func(func, s, #s)
+        if not seen[h] then
+            seen[h] = true
+            distinct = distinct + 1
+        end
+        local b = bit.band(h, buckets - 1)
+        if used[b] then shared = shared + 1 end
+        used[b] = true
+    end
+    return distinct, shared
+end
+
+print('set                  kind       build, ms   distinct  shared')
+for _, set in ipairs(sets) do
+    local name, strings = set[1], set[2]
+    local n = #strings
+    local c_strings = ffi.new('const char *[?]', n)
+    for i = 1, n do c_strings[i - 1] = strings[i] end
+    local func
+    local iterations = math.max(1, math.floor(100000 / n))
+    local t = clock.bench(function()
+        for _ = 1, iterations do
+            func = rt_C.create_hash_func(n, c_strings, random_bytes,
+                                         #random_bytes)
+        end
+    end)[1]
+    local kind = func == 0 and 'none' or
+                 bit.band(func, 0xf0000000) ~= 0 and 'fnv1a' or
+                 string.format('0x%02x', bit.rshift(func, 24))
+    local distinct, shared = quality(func, strings)
+    print(string.format('%-20s %-10s %9.3f %10d %7d', name, kind,
+                        t * 1000 / iterations, distinct, shared))
+end
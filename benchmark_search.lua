@@ -0,0 +1,60 @@
+-- Enum decoding: the linear search (schema_rt_search* in runtime/misc.c)
+-- vs the string phf, to find the crossover point for phf_threshold
+local ffi     = require('ffi')
+local clock   = require('clock')
+local msgpack = require('msgpack')
+local schema  = require('avro_schema')
+local rt      = require('avro_schema.runtime')
+local rt_C    = ffi.load(rt.C_path)
+
+local sizes = { 4, 8, 16, 24, 32, 48, 64, 96, 128 }
+
+-- The kernels alone, the key found last (the worst case)
+print('n      search8, ns  search16, ns  search32, ns')
+for _, n in ipairs(sizes) do
+    local res = { string.format('%-6d', n) }
+    for _, bits in ipairs({ 8, 16, 32 }) do
+        local tab = ffi.new(string.format('uint%d_t[?]', bits), n)
+        for i = 0, n - 1 do tab[i] = i * 3 + 1 end
+        local search = rt_C['schema_rt_search' .. bits]
+        local k, iterations = tab[n - 1], 10000000
+        local t = clock.bench(function()
+            for _ = 1, iterations do search(tab, k, n) end
+        end)[1]
+        table.insert(res, string.format('%12.2f', t * 1e9 / iterations))
+    end
+    print(table.concat(res, '  '))
+end
+
+-- Whole records, every symbol decoded in turn
+local function bench_enum(n, phf_threshold)
+    local symbols = {}
+    for i = 1, n do symbols[i] = 'symbol_' .. i end
+    local _, s = schema.create({
+        name = 'rec', type = 'record', fields = {
+            { name = 'e', type = { name = 'e', type = 'enum',
+                                   symbols = symbols }}}})
+    local _, m = schema.compile({ s, phf_threshold = phf_threshold })
+    local data, count = {}, 0
+    while count < 10000 do
+        for i = 1, n do
+            count = count + 1
+            data[count] = msgpack.encode({ e = symbols[i] })
+        end
+    end
+    data = table.concat(data)
+    local iterations = 100
+    local t = clock.bench(function()
+        for _ = 1, iterations do
+            assert(m.flatten_msgpack_batch(data))
+        end
+    end)[1]
+    return t * 1e9 / (iterations * count)
+end
+
+print()
+print('n      search, ns/record  phf, ns/record')
+for _, n in ipairs(sizes) do
+    print(string.format('%-6d %17.2f %14.2f', n, bench_enum(n, n),
+                        bench_enum(n, 0)))
+end
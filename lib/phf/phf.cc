@@ -27,7 +27,7 @@
 #include <inttypes.h> /* PRIu32 PRIu64 PRIx64 */
 #include <stdint.h>   /* UINT32_C UINT64_C uint32_t uint64_t */
 #include <stdlib.h>   /* abort(3) calloc(3) free(3) qsort(3) */
-#include <string.h>   /* memset(3) */
+#include <string.h>   /* memcpy(3) memset(3) */
 #include <errno.h>    /* errno */
 #include <assert.h>   /* assert(3) */
 #if !PHF_NO_LIBCXX
@@ -428,6 +428,63 @@ static inline uint32_t phf_f(uint32_t d, uint64_t k, uint32_t seed) {
 } /* phf_f() */
 
 
+/*
+ * String keys. The key is hashed once, 8 bytes at a time (MurmurHash64A
+ * rounds); g() takes the low half of the result and f() mixes the
+ * displacement into the high half, so evaluating the perfect hash
+ * reads the string a single time.
+ */
+static inline uint64_t phf_hash64(const unsigned char *p, size_t n, uint32_t seed) {
+	const uint64_t m = UINT64_C(0xc6a4a7935bd1e995);
+	uint64_t h = seed ^ (n * m);
+	uint64_t k;
+
+	while (n >= 8) {
+		memcpy(&k, p, 8);
+
+		k *= m;
+		k ^= k >> 47;
+		k *= m;
+
+		h ^= k;
+		h *= m;
+
+		p += 8;
+		n -= 8;
+	}
+
+	if (n) {
+		k = 0;
+		memcpy(&k, p, n);
+
+		h ^= k;
+		h *= m;
+	}
+
+	h ^= h >> 47;
+	h *= m;
+	h ^= h >> 47;
+
+	return h;
+} /* phf_hash64() */
+
+static inline uint32_t phf_g64(uint64_t h) {
+	return static_cast<uint32_t>(h);
+} /* phf_g64() */
+
+static inline uint32_t phf_f64(uint32_t d, uint64_t h) {
+	return phf_mix32(phf_round32(d, static_cast<uint32_t>(h >> 32)));
+} /* phf_f64() */
+
+static inline uint32_t phf_g(phf_string_t k, uint32_t seed) {
+	return phf_g64(phf_hash64(reinterpret_cast<const unsigned char *>(k.p), k.n, seed));
+} /* phf_g() */
+
+static inline uint32_t phf_f(uint32_t d, phf_string_t k, uint32_t seed) {
+	return phf_f64(d, phf_hash64(reinterpret_cast<const unsigned char *>(k.p), k.n, seed));
+} /* phf_f() */
+
+
 /* g() and f() which parameterize modular reduction */
 template<bool nodiv, typename T>
 static inline uint32_t phf_g_mod_r(T k, uint32_t seed, size_t r) {
@@ -804,6 +861,15 @@ PHF_PUBLIC void phf_destroy(struct phf *phf) {
 	PHF::destroy(phf);
 } /* phf_destroy() */
 
+/* string keys hashed once, see phf_hash64() */
+template<typename map_t>
+static inline phf_hash_t phf_hash_string_band_raw(map_t *g, const unsigned char *p, size_t n, uint32_t seed, size_t r, size_t m) {
+    uint64_t h = phf_hash64(p, n, seed);
+    uint32_t d = g[phf_g64(h) & (r - 1)];
+
+    return phf_f64(d, h) & (m - 1);
+} /* phf_hash_string_band_raw */
+
 extern "C" {
 
 PHF_PUBLIC phf_hash_t phf_hash_uint32_band_raw8(uint8_t *map, uint32_t k, uint32_t seed, size_t r, size_t m) {
@@ -830,6 +896,18 @@ PHF_PUBLIC phf_hash_t phf_hash_uint32_mod_raw32(uint32_t *map, uint32_t k, uint3
     return phf_hash_<false>(map, k, seed, r, m);
 } /* phf_hash_uint32_mod_raw32 */
 
+PHF_PUBLIC phf_hash_t phf_hash_string_band_raw8(uint8_t *map, const unsigned char *p, size_t n, uint32_t seed, size_t r, size_t m) {
+    return phf_hash_string_band_raw(map, p, n, seed, r, m);
+} /* phf_hash_string_band_raw8 */
+
+PHF_PUBLIC phf_hash_t phf_hash_string_band_raw16(uint16_t *map, const unsigned char *p, size_t n, uint32_t seed, size_t r, size_t m) {
+    return phf_hash_string_band_raw(map, p, n, seed, r, m);
+} /* phf_hash_string_band_raw16 */
+
+PHF_PUBLIC phf_hash_t phf_hash_string_band_raw32(uint32_t *map, const unsigned char *p, size_t n, uint32_t seed, size_t r, size_t m) {
+    return phf_hash_string_band_raw(map, p, n, seed, r, m);
+} /* phf_hash_string_band_raw32 */
+
 } /* extern "C" */
 
 
@@ -39,6 +39,7 @@ make %{mflags} check
 
 %files
 %{_libdir}/tarantool/avro_schema_rt_c.so
+%{_libdir}/tarantool/avro_schema_rt_lua.so
 %{_datarootdir}/tarantool/avro_schema/*.lua
 
 %changelog
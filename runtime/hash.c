@@ -66,66 +66,78 @@ uint32_t create_hash_func(int n, const char *strings[],
     };
 
     void *mem;
+    uint8_t *columns;
     int use_len = 0, sample_count = 0, sample_pos[4] = {256, 256, 256, 256};
     uint32_t gen;
     int best_pos, collisions_min;
-    int n_active, i, pos, o, max_len = 256;
+    int n_active, i, pos, o, max_len = 0;
 
     if (n == 0) return 0;
 
     /*
-     * mem: int32_t probes[128] | int32_t slots[n*2] (sel. sampling pos-s)
+     * mem: int32_t probes[256] | int32_t slots[n*2] (sel. sampling pos-s)
      * mem:  int32_t slots[n*2] | bitmap             (collisions_found?)
      */
 #define BITMAP_SIZE(n) \
     (sizeof(uint64_t) * ((n) + 63) / 64)
 
     size_t bitmap_size = BITMAP_SIZE(n * 2);
-    size_t probes_size = 128 * sizeof(int32_t);
+    size_t probes_size = 256 * sizeof(int32_t);
     mem = malloc((n * 2) * sizeof(int32_t) +
                  (bitmap_size > probes_size ? bitmap_size : probes_size));
     if (mem == NULL)
         return 0;
     uint32_t * const probes  = mem;
-    uint32_t * const slots   = probes + 128;
+    uint32_t * const slots   = probes + 256;
     uint32_t *       indices = slots;
 
-    /* semi-arbitrary limit, hard max is MAX_INT32 / 257
-     * (larger size causes generation counter to wrap)
-     * Note: it's highly unlikely we'll ever get a huge string set;
-     *       if we do, it makes sense to have character *COLUMNS*
-     *       in continuous memory (aka transpose) for improved memory
-     *       access pattern, not implemented.
-     * */
-    if (n > 1000)
+    /* hard max, a larger set causes generation counter to wrap */
+    if (n > IDX_MASK / 257)
         return create_fnv_func(n, strings, random, size_random, mem);
 
+    /*
+     * Strings are transposed into character *COLUMNS*: column 0 holds
+     * lengths, column pos + 1 the characters at pos, 0 past the end of
+     * a string. Considering a position scans a single column, n bytes
+     * in continuous memory, rather than touching every string.
+     */
+    for (i = 0; i < n; i++) {
+        size_t len = strlen(strings[i]);
+        if ((int)len >= max_len)
+            max_len = len < 256 ? (int)len + 1 : 256;
+    }
+    columns = malloc((size_t)(max_len + 1) * n);
+    if (columns == NULL)
+        return create_fnv_func(n, strings, random, size_random, mem);
+    for (i = 0; i < n; i++) {
+        const char *str = strings[i];
+        int len = (int)strlen(str);
+        columns[i] = 0x7f & len;
+        for (pos = 0; pos < max_len; pos++)
+            columns[(size_t)(pos + 1) * n + i] = pos < len ? str[pos] : 0;
+    }
+
     for (i = 0; i < n; i++)
         indices[i] = i;
     indices[n-1] = DOMAIN_END_BIT | (n - 1);
 
-    memset(probes, 0, 128 * sizeof probes[0]);
+    memset(probes, 0, 256 * sizeof probes[0]);
     n_active = n;
 pick_next_sample:
     gen = 1;
     collisions_min = n_active + 1; best_pos = 0;
     /* don't consider len again if already using it */
     for (pos = use_len - 1; pos < max_len; pos++) {
+        const uint8_t *column = columns + (size_t)(pos + 1) * n;
         int collisions = 0;
         for (i = 0; i < n_active; i++) {
-            uint32_t  idx = indices[i];
-            const char *str = strings[idx & IDX_MASK];
-            unsigned probe;
+            uint32_t idx = indices[i];
+            unsigned probe = column[idx & IDX_MASK];
 
-            if (pos == -1) {
-                probe = 0x7f & strlen(str);
-            } else {
-                probe = str[pos];
-                if (str[pos] == 0) {
-                    /* we may drop the string when splitting domains */
-                    max_len = pos;
-                    goto save_best_pos;
-                }
+            if (probe == 0 && pos != -1) {
+                /* we may drop the string when splitting domains */
+                max_len = pos;
+                goto save_best_pos;
             }
 
             if (probes[probe] == gen)
@@ -179,24 +191,27 @@ sort_sample_pos:
         if (collisions_found(func, n, strings, mem))
             func |= 0x08000000;
 
+        free(columns);
         free(mem);
         return func;
     }
 
     if (sample_count == 4) {
         /* too many samples, yet no solution */
+        free(columns);
         return create_fnv_func(n, strings, random, size_random, mem);
     }
 
     /* rebuild collision domains...
      * it starts here and spans till the function's end */
     uint32_t *next_indices = (indices == slots ? slots + n_active : slots);
+    const uint8_t *column = columns + (size_t)(best_pos + 1) * n;
 
     /* reuse probes for collision counters */
-    memset(probes, 0, 128 * sizeof probes[0]);
+    memset(probes, 0, 256 * sizeof probes[0]);
     o = 0;
     for (i = 0; i < n_active; ) {
-        int j, end;
+        int j, k, end;
         uint64_t map, map_copy;
         /* estimate new collision domains' sizes;
          * (bit)map helps to avoid considering the entire probes[]
@@ -204,10 +219,8 @@ sort_sample_pos:
         map = 0;
         for (j = i; ; j++) {
             const uint32_t idx = indices[j];
-            const char * const str = strings[idx & IDX_MASK];
-            unsigned probe = (best_pos == -1 ?
-                              (0x7f & strlen(str)) : (unsigned)str[best_pos]);
-            map |= (uint64_t)1 << (probe / 2);
+            unsigned probe = column[idx & IDX_MASK];
+            map |= (uint64_t)1 << (probe / 4);
             probes[probe]++;
             if (idx & DOMAIN_END_BIT) {
                 /* the end of the original collision domain */
@@ -225,26 +238,21 @@ sort_sample_pos:
          * drop 1-element collision domains */
         map_copy = map;
         while (map_copy) {
-            int pos = 2 * (unsigned)__builtin_ctzll(map_copy);
-            probes[pos+0] =
-                (probes[pos+0] > 1 ? (o += probes[pos+0]) : n_active);
-            probes[pos+1] =
-                (probes[pos+1] > 1 ? (o += probes[pos+1]) : n_active);
+            int pos = 4 * (unsigned)__builtin_ctzll(map_copy);
+            for (k = pos; k != pos + 4; k++)
+                probes[k] = (probes[k] > 1 ? (o += probes[k]) : n_active);
             map_copy &= map_copy - 1;
         }
         /* copy */
         for (j = i; j != end; j++) {
             const uint32_t idx = indices[j];
-            const char * const str = strings[idx & IDX_MASK];
-            unsigned probe = (best_pos == -1 ?
-                              (0x7f & strlen(str)) : (unsigned)str[best_pos]);
-            next_indices[--probes[probe]] = idx;
+            next_indices[--probes[column[idx & IDX_MASK]]] = idx;
         }
         i = end;
         /* zero out entries we touched */
         while (map) {
-            int pos = 2 * (unsigned)__builtin_ctzll(map);
-            probes[pos] = probes[pos+1] = 0;
+            int pos = 4 * (unsigned)__builtin_ctzll(map);
+            memset(probes + pos, 0, 4 * sizeof probes[0]);
             map &= map - 1;
         }
     }
@@ -266,7 +274,7 @@ static uint32_t create_fnv_func(int n, const char *strings[],
 
         uint32_t v;
         memcpy(&v, random, sizeof(v));
-        if (v > 0xf000000 && !collisions_found(v, n, strings, mem)) {
+        if (v > 0xfffffff && !collisions_found(v, n, strings, mem)) {
             func = v;
             goto done;
         }
@@ -0,0 +1,473 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <module.h>
+
+/*
+ * Lua value of the unparse_msgpack() output, built right from ot/ov
+ * rather than encoded and decoded with msgpack.decode(). Follows the
+ * msgpack.decode() conventions:
+ *  - integers beyond 2^53 become int64/uint64 cdata, positive ones are
+ *    unsigned (unparse_msgpack() encodes them so);
+ *  - floats are rounded to single precision;
+ *  - nulls become msgpack.NULL;
+ *  - array/map metatables are set if decode_save_metatables is on.
+ * Verbatim copies (defaults, spans) are decoded here as well.
+ *
+ * Unlike avro_schema_rt_c (loaded with ffi.load(), doesn't link against
+ * Lua), this is a Lua C module, and an optional one: runtime.lua falls
+ * back to unparse_msgpack() + msgpack.decode() without it, and for the
+ * output it doesn't handle (ext values).
+ */
+
+/* Mirrors pipeline.c, keep in sync (runtime.lua and native.lua, too) */
+struct Value {
+    union {
+        void          *p;
+        int64_t        ival;
+        uint64_t       uval;
+        double         dval;
+        struct {
+            uint32_t   xlen;
+            uint32_t   xoff;
+        };
+    };
+};
+
+struct State {
+    size_t             t_capacity;
+    size_t             ot_capacity;
+    size_t             res_capacity;
+    size_t             res_size;
+    uint8_t           *res;
+    const uint8_t     *b1;
+    const uint8_t     *b2;
+    uint8_t           *t;
+    struct Value      *v;
+    uint8_t           *ot;
+    struct Value      *ov;
+    int32_t            k;
+    uint8_t           *sbuf;
+    size_t             sbuf_size;
+    size_t             sbuf_capacity;
+    size_t             spos;
+    size_t             sitems;
+    uint32_t           stodo;
+    uint32_t           spatch;
+    uint32_t           sdepth;
+    uint32_t          *bo;
+    size_t             bo_capacity;
+    uint32_t           track_bo;
+    uint32_t           compact;
+    uint32_t          *cv;
+    size_t             cv_capacity;
+};
+
+/* Builder upvalues, see lua_builder() */
+#define BUILD_NULL     lua_upvalueindex(1)
+#define BUILD_ARRAY_MT lua_upvalueindex(2)
+#define BUILD_MAP_MT   lua_upvalueindex(3)
+#define BUILD_CTYPEID  lua_upvalueindex(4)
+
+struct Build {
+    lua_State          *L;
+    const uint8_t      *ot;
+    const struct Value *ov;
+    size_t              nitems;
+    const uint8_t      *b1;
+    const uint8_t      *b2;
+    int                 save_mt;
+};
+
+static inline uint16_t
+load16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t
+load32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint64_t
+load64(const uint8_t *p)
+{
+    return (uint64_t)load32(p) << 32 | load32(p + 4);
+}
+
+static int
+build_array(struct Build *b, const uint8_t **p, const uint8_t *end,
+            uint32_t n);
+
+static int
+build_map(struct Build *b, const uint8_t **p, const uint8_t *end,
+          uint32_t n);
+
+/*
+ * Pushes the MsgPack value at *p (a verbatim copy), advances *p past
+ * it. Returns -1 on ext values and malformed data, msgpack.decode()
+ * takes over then.
+ */
+static int
+build_msgpack(struct Build *b, const uint8_t **p, const uint8_t *end)
+{
+    lua_State     *L = b->L;
+    const uint8_t *data = *p;
+    uint32_t       len;
+    union {
+        uint32_t   u32;
+        float      f32;
+        uint64_t   u64;
+        double     f64;
+    } x;
+
+    if (data >= end)
+        return -1;
+    *p = data + 1;
+    if (*data <= 0x7f) {
+        lua_pushnumber(L, *data);
+        return 0;
+    }
+    if (*data >= 0xe0) {
+        lua_pushnumber(L, (int8_t)*data);
+        return 0;
+    }
+    if (*data <= 0x8f)
+        return build_map(b, p, end, *data & 0xf);
+    if (*data <= 0x9f)
+        return build_array(b, p, end, *data & 0xf);
+    if (*data <= 0xbf) {
+        len = *data & 0x1f;
+        goto push_string;
+    }
+
+    switch (*data) {
+    case 0xc0:
+        lua_pushvalue(L, BUILD_NULL);
+        return 0;
+    case 0xc2:
+    case 0xc3:
+        lua_pushboolean(L, *data == 0xc3);
+        return 0;
+    case 0xc4: case 0xd9: /* bin 8, str 8 */
+        if (end - *p < 1)
+            return -1;
+        len = data[1];
+        *p += 1;
+        goto push_string;
+    case 0xc5: case 0xda: /* bin 16, str 16 */
+        if (end - *p < 2)
+            return -1;
+        len = load16(data + 1);
+        *p += 2;
+        goto push_string;
+    case 0xc6: case 0xdb: /* bin 32, str 32 */
+        if (end - *p < 4)
+            return -1;
+        len = load32(data + 1);
+        *p += 4;
+        goto push_string;
+    case 0xca:
+        if (end - *p < 4)
+            return -1;
+        x.u32 = load32(data + 1);
+        lua_pushnumber(L, x.f32);
+        *p += 4;
+        return 0;
+    case 0xcb:
+        if (end - *p < 8)
+            return -1;
+        x.u64 = load64(data + 1);
+        lua_pushnumber(L, x.f64);
+        *p += 8;
+        return 0;
+    case 0xcc:
+        if (end - *p < 1)
+            return -1;
+        lua_pushnumber(L, data[1]);
+        *p += 1;
+        return 0;
+    case 0xcd:
+        if (end - *p < 2)
+            return -1;
+        lua_pushnumber(L, load16(data + 1));
+        *p += 2;
+        return 0;
+    case 0xce:
+        if (end - *p < 4)
+            return -1;
+        lua_pushnumber(L, load32(data + 1));
+        *p += 4;
+        return 0;
+    case 0xcf:
+        if (end - *p < 8)
+            return -1;
+        luaL_pushuint64(L, load64(data + 1));
+        *p += 8;
+        return 0;
+    case 0xd0:
+        if (end - *p < 1)
+            return -1;
+        lua_pushnumber(L, (int8_t)data[1]);
+        *p += 1;
+        return 0;
+    case 0xd1:
+        if (end - *p < 2)
+            return -1;
+        lua_pushnumber(L, (int16_t)load16(data + 1));
+        *p += 2;
+        return 0;
+    case 0xd2:
+        if (end - *p < 4)
+            return -1;
+        lua_pushnumber(L, (int32_t)load32(data + 1));
+        *p += 4;
+        return 0;
+    case 0xd3:
+        if (end - *p < 8)
+            return -1;
+        luaL_pushint64(L, (int64_t)load64(data + 1));
+        *p += 8;
+        return 0;
+    case 0xdc:
+        if (end - *p < 2)
+            return -1;
+        *p += 2;
+        return build_array(b, p, end, load16(data + 1));
+    case 0xdd:
+        if (end - *p < 4)
+            return -1;
+        *p += 4;
+        return build_array(b, p, end, load32(data + 1));
+    case 0xde:
+        if (end - *p < 2)
+            return -1;
+        *p += 2;
+        return build_map(b, p, end, load16(data + 1));
+    case 0xdf:
+        if (end - *p < 4)
+            return -1;
+        *p += 4;
+        return build_map(b, p, end, load32(data + 1));
+    }
+    /* ext, msgpack.decode() knows the ext types, we don't */
+    return -1;
+
+push_string:
+    if ((size_t)(end - *p) < len)
+        return -1;
+    lua_pushlstring(L, (const char *)*p, len);
+    *p += len;
+    return 0;
+}
+
+static int
+build_array(struct Build *b, const uint8_t **p, const uint8_t *end,
+            uint32_t n)
+{
+    lua_State *L = b->L;
+    uint32_t   k;
+
+    if (!lua_checkstack(L, 2))
+        return -1;
+    lua_createtable(L, (int)n, 0);
+    for (k = 1; k <= n; k++) {
+        if (build_msgpack(b, p, end) != 0)
+            return -1;
+        lua_rawseti(L, -2, (int)k);
+    }
+    if (b->save_mt) {
+        lua_pushvalue(L, BUILD_ARRAY_MT);
+        lua_setmetatable(L, -2);
+    }
+    return 0;
+}
+
+static int
+build_map(struct Build *b, const uint8_t **p, const uint8_t *end,
+          uint32_t n)
+{
+    lua_State *L = b->L;
+    uint32_t   k;
+
+    if (!lua_checkstack(L, 3))
+        return -1;
+    lua_createtable(L, 0, (int)n);
+    for (k = 0; k < n; k++) {
+        if (build_msgpack(b, p, end) != 0 || build_msgpack(b, p, end) != 0)
+            return -1;
+        lua_rawset(L, -3);
+    }
+    if (b->save_mt) {
+        lua_pushvalue(L, BUILD_MAP_MT);
+        lua_setmetatable(L, -2);
+    }
+    return 0;
+}
+
+/*
+ * Pushes the value starting at item *i, advances *i past it.
+ * Returns -1 (the stack is garbage then) if the items can't be
+ * converted.
+ */
+static int
+build_value(struct Build *b, size_t *i)
+{
+    lua_State          *L = b->L;
+    const struct Value *value;
+    const uint8_t      *data, *end;
+    uint8_t             typeid;
+    uint32_t            n, k;
+
+    while (*i < b->nitems && b->ot[*i] == 17) /* CDummyValue */
+        ++*i;
+    if (*i >= b->nitems)
+        return -1;
+    typeid = b->ot[*i];
+    value = b->ov + *i;
+    ++*i;
+
+    switch (typeid) {
+    case 1: /* NilValue */
+        lua_pushvalue(L, BUILD_NULL);
+        return 0;
+    case 2: /* FalseValue */
+    case 3: /* TrueValue */
+        lua_pushboolean(L, typeid == 3);
+        return 0;
+    case 4: /* LongValue */
+        if (value->ival >= 0)
+            luaL_pushuint64(L, value->uval);
+        else
+            luaL_pushint64(L, value->ival);
+        return 0;
+    case 5: /* UlongValue */
+        luaL_pushuint64(L, value->uval);
+        return 0;
+    case 6: /* FloatValue */
+        lua_pushnumber(L, (float)value->dval);
+        return 0;
+    case 7: /* DoubleValue */
+        lua_pushnumber(L, value->dval);
+        return 0;
+    case 8:  /* StringValue */
+    case 9:  /* BinValue */
+    case 18: /* CStringValue */
+    case 19: /* CBinValue */
+    case 20: /* CopyCommand */
+    case 21: /* CopyInputCommand */
+        if (value->xoff == UINT32_MAX) {
+            /* the next item holds an explicit pointer (service fields) */
+            if (*i >= b->nitems)
+                return -1;
+            data = value[1].p;
+            ++*i;
+        } else if (typeid == 18 || typeid == 19 || typeid == 20) {
+            data = b->b2 - value->xoff;
+        } else {
+            data = b->b1 - value->xoff;
+        }
+        if (typeid < 20) {
+            lua_pushlstring(L, (const char *)data, value->xlen);
+            return 0;
+        }
+        end = data + value->xlen;
+        /* a copy holds a single value */
+        if (build_msgpack(b, &data, end) != 0 || data != end)
+            return -1;
+        return 0;
+    case 11: /* ArrayValue */
+        if (!lua_checkstack(L, 2))
+            return -1;
+        n = value->xlen;
+        lua_createtable(L, (int)n, 0);
+        for (k = 1; k <= n; k++) {
+            if (build_value(b, i) != 0)
+                return -1;
+            lua_rawseti(L, -2, (int)k);
+        }
+        if (b->save_mt) {
+            lua_pushvalue(L, BUILD_ARRAY_MT);
+            lua_setmetatable(L, -2);
+        }
+        return 0;
+    case 12: /* MapValue */
+        if (!lua_checkstack(L, 3))
+            return -1;
+        n = value->xlen;
+        lua_createtable(L, 0, (int)n);
+        for (k = 0; k < n; k++) {
+            if (build_value(b, i) != 0 || build_value(b, i) != 0)
+                return -1;
+            lua_rawset(L, -3);
+        }
+        if (b->save_mt) {
+            lua_pushvalue(L, BUILD_MAP_MT);
+            lua_setmetatable(L, -2);
+        }
+        return 0;
+    }
+    /* ExtValue: msgpack.decode() knows the ext types, we don't */
+    return -1;
+}
+
+/*
+ * build(state, nitems, save_mt) - the value or nothing if the output
+ * can't be built directly.
+ */
+static int
+lua_build(lua_State *L)
+{
+    struct Build b;
+    struct State *state;
+    uint32_t ctypeid;
+    size_t i = 0;
+    int top;
+
+    state = luaL_checkcdata(L, 1, &ctypeid);
+    if (ctypeid != (uint32_t)lua_tonumber(L, BUILD_CTYPEID))
+        return luaL_error(L, "build: Expecting a state");
+    b.L = L;
+    b.ot = state->ot;
+    b.ov = state->ov;
+    b.nitems = (size_t)luaL_checknumber(L, 2);
+    b.b1 = state->b1;
+    b.b2 = state->b2;
+    b.save_mt = lua_toboolean(L, 3);
+    top = lua_gettop(L);
+    if (build_value(&b, &i) != 0) {
+        lua_settop(L, top);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * builder(msgpack.NULL, msgpack.array_mt, msgpack.map_mt) - build()
+ * using these.
+ */
+static int
+lua_builder(lua_State *L)
+{
+    lua_settop(L, 3);
+    lua_pushnumber(L, luaL_ctypeid(L, "struct schema_rt_State"));
+    lua_pushcclosure(L, lua_build, 4);
+    return 1;
+}
+
+LUA_API int
+luaopen_avro_schema_rt_lua(lua_State *L)
+{
+    static const struct luaL_Reg lib[] = {
+        { "builder", lua_builder },
+        { NULL, NULL }
+    };
+    lua_newtable(L);
+    luaL_register(L, NULL, lib);
+    return 1;
+}
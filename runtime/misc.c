@@ -7,19 +7,169 @@ schema_rt_key_eq(const char *key, const char *str, size_t klen, size_t len)
     return klen == 0 || klen != len ? -1 : memcmp(key, str, klen);
 }
 
-uint32_t
-schema_rt_search8(const uint8_t *tab, uint32_t k, size_t n)
-#define SCHEMA_RT_SEARCH_BODY \
-    uint32_t i = 0; \
+/*
+ * Linear search in a table of n hashes (PUTENUMS2I), yields the index
+ * of the first match or n - 1 if none (the caller verifies the key).
+ * Kernels compare a vector worth of entries at once, the last vector
+ * is aligned with the end of the table, so they never read past
+ * tab[n - 1]; tables shorter than a vector are searched by the scalar
+ * loop.
+ */
+#define SCHEMA_RT_SEARCH_TAIL(tab, k, i, n) \
     while (i != n - 1 && tab[i] != k) i++; \
     return i;
-{ SCHEMA_RT_SEARCH_BODY }
+
+typedef uint32_t (*search_func)(const void *tab, uint32_t k, size_t n);
+
+static uint32_t search8_scalar(const void *p, uint32_t k, size_t n)
+{
+    const uint8_t *tab = p;
+    uint32_t i = 0;
+    SCHEMA_RT_SEARCH_TAIL(tab, k, i, n)
+}
+
+static uint32_t search16_scalar(const void *p, uint32_t k, size_t n)
+{
+    const uint16_t *tab = p;
+    uint32_t i = 0;
+    SCHEMA_RT_SEARCH_TAIL(tab, k, i, n)
+}
+
+static uint32_t search32_scalar(const void *p, uint32_t k, size_t n)
+{
+    const uint32_t *tab = p;
+    uint32_t i = 0;
+    SCHEMA_RT_SEARCH_TAIL(tab, k, i, n)
+}
+
+#if defined(__x86_64__)
+
+#include <emmintrin.h>
+#include <immintrin.h>
+
+int schema_rt_cpu_has_avx2(void);
+
+/*
+ * Vector compares of W bit entries, movemask yields W/8 bits per
+ * entry, hence the shift. A key wider than the entries never matches.
+ * AVX2 kernels fall back to a 128 bit step for short tables; it is
+ * VEX encoded there, calling SSE2 kernels instead stalls on the
+ * AVX/SSE transition.
+ */
+#define SCHEMA_RT_SEARCH_INIT(W) \
+    const uint##W##_t *tab = p; \
+    uint32_t i = 0; \
+    if (W != 32 && k > (uint##W##_t)-1) \
+        return n - 1;
+
+#define SCHEMA_RT_SEARCH_STEP(W, VW, load, set1, cmpeq, movemask) \
+    if (n >= VW / W) { \
+        for (;; i += VW / W) { \
+            uint32_t mask; \
+            if (i + VW / W > n) \
+                i = n - VW / W; /* overlaps entries known not to match */ \
+            mask = movemask(cmpeq(load((const void *)(tab + i)), \
+                                  set1((uint##W##_t)k))); \
+            if (mask != 0) { \
+                i += __builtin_ctz(mask) / (W / 8); \
+                return i < n - 1 ? i : n - 1; \
+            } \
+            if (i + VW / W == n) \
+                return n - 1; \
+        } \
+    }
+
+#define SSE2_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define AVX2_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+
+#define SCHEMA_RT_SEARCH_SSE2(W) \
+    SCHEMA_RT_SEARCH_STEP(W, 128, SSE2_LOAD, _mm_set1_epi##W, \
+                          _mm_cmpeq_epi##W, _mm_movemask_epi8)
+
+#define SCHEMA_RT_SEARCH_AVX2(W) \
+    SCHEMA_RT_SEARCH_STEP(W, 256, AVX2_LOAD, _mm256_set1_epi##W, \
+                          _mm256_cmpeq_epi##W, _mm256_movemask_epi8)
+
+/* SSE2 is a part of x86_64 baseline */
+static uint32_t search8_sse2(const void *p, uint32_t k, size_t n)
+{
+    SCHEMA_RT_SEARCH_INIT(8)
+    SCHEMA_RT_SEARCH_SSE2(8)
+    SCHEMA_RT_SEARCH_TAIL(tab, k, i, n)
+}
+
+static uint32_t search16_sse2(const void *p, uint32_t k, size_t n)
+{
+    SCHEMA_RT_SEARCH_INIT(16)
+    SCHEMA_RT_SEARCH_SSE2(16)
+    SCHEMA_RT_SEARCH_TAIL(tab, k, i, n)
+}
+
+static uint32_t search32_sse2(const void *p, uint32_t k, size_t n)
+{
+    SCHEMA_RT_SEARCH_INIT(32)
+    SCHEMA_RT_SEARCH_SSE2(32)
+    SCHEMA_RT_SEARCH_TAIL(tab, k, i, n)
+}
+
+__attribute__((target("avx2")))
+static uint32_t search8_avx2(const void *p, uint32_t k, size_t n)
+{
+    SCHEMA_RT_SEARCH_INIT(8)
+    SCHEMA_RT_SEARCH_AVX2(8)
+    SCHEMA_RT_SEARCH_SSE2(8)
+    SCHEMA_RT_SEARCH_TAIL(tab, k, i, n)
+}
+
+__attribute__((target("avx2")))
+static uint32_t search16_avx2(const void *p, uint32_t k, size_t n)
+{
+    SCHEMA_RT_SEARCH_INIT(16)
+    SCHEMA_RT_SEARCH_AVX2(16)
+    SCHEMA_RT_SEARCH_SSE2(16)
+    SCHEMA_RT_SEARCH_TAIL(tab, k, i, n)
+}
+
+__attribute__((target("avx2")))
+static uint32_t search32_avx2(const void *p, uint32_t k, size_t n)
+{
+    SCHEMA_RT_SEARCH_INIT(32)
+    SCHEMA_RT_SEARCH_AVX2(32)
+    SCHEMA_RT_SEARCH_SSE2(32)
+    SCHEMA_RT_SEARCH_TAIL(tab, k, i, n)
+}
+
+#endif
+
+static search_func search8  = search8_scalar;
+static search_func search16 = search16_scalar;
+static search_func search32 = search32_scalar;
+
+__attribute__((constructor))
+static void search_init(void)
+{
+#if defined(__x86_64__)
+    int avx2 = schema_rt_cpu_has_avx2();
+    search8  = avx2 ? search8_avx2  : search8_sse2;
+    search16 = avx2 ? search16_avx2 : search16_sse2;
+    search32 = avx2 ? search32_avx2 : search32_sse2;
+#endif
+}
+
+uint32_t
+schema_rt_search8(const uint8_t *tab, uint32_t k, size_t n)
+{
+    return search8(tab, k, n);
+}
 
 uint32_t
 schema_rt_search16(const uint16_t *tab, uint32_t k, size_t n)
-{ SCHEMA_RT_SEARCH_BODY }
+{
+    return search16(tab, k, n);
+}
 
 uint32_t
 schema_rt_search32(const uint32_t *tab, uint32_t k, size_t n)
-{ SCHEMA_RT_SEARCH_BODY }
-
+{
+    return search32(tab, k, n);
+}
@@ -23,10 +23,14 @@ enum TypeId {
     CDummyValue      = 17, /* skipped */
     CStringValue     = 18,
     CBinValue        = 19,
-    CopyCommand      = 20 /* Copy N bytes verbatim from data bank.
-                           * Provides complex default values. Also
-                           * strings during unflatten.
-                           */
+    CopyCommand      = 20, /* Copy N bytes verbatim from data bank.
+                            * Provides complex default values. Also
+                            * strings during unflatten.
+                            */
+    CopyInputCommand = 21  /* Copy N bytes verbatim from input data,
+                            * passes through unchanged subtrees
+                            * (see track_bo).
+                            */
 };
 
 struct Value {
@@ -57,7 +61,36 @@ struct Value {
  * ExtValue         - xlen, xoff
  * ArrayValue       - xlen, xoff
  * MapValue         - xlen, xoff
+ *
+ * The layout is shared with the generated code (struct schema_rt_Value
+ * in runtime.lua and native.lua), checked below (C99, no static_assert).
  */
+typedef char value_layout_check[sizeof(struct Value) == 8 ? 1 : -1];
+
+/*
+ * Compact layout (parse_msgpack_compact), t is the same, values are
+ * 32 bit words in cv, v[i] is the overflow slot of item i:
+ *
+ * LongValue        - ival << 1 if it fits 31 bits, 1 otherwise (v[i].ival)
+ * UlongValue       - (v[i].uval)
+ * FloatValue       - (v[i].dval)
+ * DoubleValue      - (v[i].dval)
+ * StringValue      - xlen | xoff << 16
+ * BinValue         - xlen | xoff << 16
+ * ExtValue         - xlen | xoff << 16
+ * ArrayValue       - xlen | xoff << 16
+ * MapValue         - xlen | xoff << 16
+ *
+ * Both xlen and xoff fit 16 bits as the message is shorter than
+ * COMPACT_MAX_SIZE. The generated code picks the layout by
+ * state->compact; schema_rt_compact_expand() converts to the general
+ * layout in place.
+ */
+#define COMPACT_MAX_SIZE 0x10000
+#define COMPACT_IVAL(cv, v, i) \
+    ((cv)[i] & 1 ? (v)[i].ival : (int64_t)((int32_t)(cv)[i] >> 1))
+#define COMPACT_XLEN(cv, i) ((cv)[i] & 0xffff)
+#define COMPACT_XOFF(cv, i) ((cv)[i] >> 16)
 
 struct State {
     size_t             t_capacity;   // capacity of t/v   bufs (items)
@@ -71,6 +104,21 @@ struct State {
     struct Value      *v;        // .......................
     uint8_t           *ot;       // consumed by unparse_msgpack
     struct Value      *ov;       // ...........................
+    int32_t            k;        // used by xflatten
+    uint8_t           *sbuf;     // parse_msgpack_chunk: input data
+    size_t             sbuf_size;
+    size_t             sbuf_capacity;
+    size_t             spos;     // ...................: saved regs
+    size_t             sitems;
+    uint32_t           stodo;    // (0 - no value in progress)
+    uint32_t           spatch;
+    uint32_t           sdepth;
+    uint32_t          *bo;       // parse_msgpack: item start offsets,
+    size_t             bo_capacity; // relative to b1 (if track_bo)
+    uint32_t           track_bo;
+    uint32_t           compact;  // items in the compact layout or 0
+    uint32_t          *cv;       // parse_msgpack_compact
+    size_t             cv_capacity;
 };
 
 #if !(C_HAVE_BSWAP16)
@@ -150,6 +198,289 @@ static int buf_grow_tv(uint8_t **t,
     return buf_grow(t, capacity, new_capacity);
 }
 
+/*
+ * Ensure bo has room for an offset per t/v item plus the offset of
+ * the value end.
+ */
+static int buf_reserve_bo(struct State *state)
+{
+    uint32_t *new_bo;
+
+    if (state->bo_capacity > state->t_capacity)
+        return 0;
+    new_bo = realloc(state->bo,
+                     (state->t_capacity + 1) * sizeof(new_bo[0]));
+    if (new_bo == NULL)
+        return -1;
+    state->bo = new_bo;
+    state->bo_capacity = state->t_capacity + 1;
+    return 0;
+}
+
+/* Ensure cv has room for a word per t/v item. */
+static int buf_reserve_cv(struct State *state)
+{
+    uint32_t *new_cv;
+
+    if (state->cv_capacity >= state->t_capacity)
+        return 0;
+    new_cv = realloc(state->cv, state->t_capacity * sizeof(new_cv[0]));
+    if (new_cv == NULL)
+        return -1;
+    state->cv = new_cv;
+    state->cv_capacity = state->t_capacity;
+    return 0;
+}
+
+/*
+ * Runs of single-byte scalars.
+ *
+ * Positive fixint, negative fixint and nil are encoded with a lone
+ * tag byte. Tuples are often dominated by such values; a run is
+ * classified 16 or 32 tag bytes at once and emitted in bulk, bypassing
+ * the big switch in parse_msgpack.
+ *
+ * Note: (int8_t) sign extension yields the correct value for both
+ * fixint flavours; nil gets a junk value (allocated but unused).
+ *
+ * A kernel emits up to *n* items and returns the number of items
+ * emitted. The first byte is known to be a single-byte scalar, hence
+ * the result is at least 1. The kernel is picked at load time,
+ * see parse_run_init(). Compact kernels store cv words instead.
+ */
+typedef size_t (*parse_run_func)(const uint8_t * restrict mi, size_t n,
+                                 uint8_t * restrict typeid,
+                                 struct Value * restrict value);
+typedef size_t (*parse_run_compact_func)(const uint8_t * restrict mi,
+                                         size_t n,
+                                         uint8_t * restrict typeid,
+                                         uint32_t * restrict cvalue);
+
+static inline int is_run_byte(uint8_t b)
+{
+    return (int8_t)b >= -0x20 || b == 0xc0;
+}
+
+static inline size_t parse_run_tail(const uint8_t * restrict mi, size_t n,
+                                    uint8_t * restrict typeid,
+                                    struct Value * restrict value)
+{
+    size_t i;
+    for (i = 0; i != n && is_run_byte(mi[i]); i++) {
+        typeid[i] = mi[i] == 0xc0 ? NilValue : LongValue;
+        value[i].ival = (int8_t)mi[i];
+    }
+    return i;
+}
+
+static size_t parse_run_scalar(const uint8_t * restrict mi, size_t n,
+                               uint8_t * restrict typeid,
+                               struct Value * restrict value)
+{
+    return parse_run_tail(mi, n, typeid, value);
+}
+
+static inline size_t parse_run_compact_tail(const uint8_t * restrict mi,
+                                            size_t n,
+                                            uint8_t * restrict typeid,
+                                            uint32_t * restrict cvalue)
+{
+    size_t i;
+    for (i = 0; i != n && is_run_byte(mi[i]); i++) {
+        typeid[i] = mi[i] == 0xc0 ? NilValue : LongValue;
+        cvalue[i] = (uint32_t)(int8_t)mi[i] << 1;
+    }
+    return i;
+}
+
+static size_t parse_run_compact_scalar(const uint8_t * restrict mi,
+                                       size_t n,
+                                       uint8_t * restrict typeid,
+                                       uint32_t * restrict cvalue)
+{
+    return parse_run_compact_tail(mi, n, typeid, cvalue);
+}
+
+#if defined(__x86_64__)
+
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+/* SSE2 is a part of x86_64 baseline */
+static size_t parse_run_sse2(const uint8_t * restrict mi, size_t n,
+                             uint8_t * restrict typeid,
+                             struct Value * restrict value)
+{
+    size_t i;
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i  x = _mm_loadu_si128((const __m128i *)(mi + i));
+        __m128i  nil = _mm_cmpeq_epi8(x, _mm_set1_epi8((char)0xc0));
+        __m128i  fixint = _mm_cmpgt_epi8(x, _mm_set1_epi8(-0x21));
+        uint32_t mask = _mm_movemask_epi8(_mm_or_si128(nil, fixint));
+        __m128i  s, w, d, q;
+        int      k;
+
+        if (mask != 0xffff)
+            return i + parse_run_tail(mi + i, __builtin_ctz(~mask),
+                                      typeid + i, value + i);
+
+        /* NilValue where nil, LongValue otherwise */
+        _mm_storeu_si128((__m128i *)(typeid + i), _mm_sub_epi8(
+            _mm_set1_epi8(LongValue),
+            _mm_and_si128(nil, _mm_set1_epi8(LongValue - NilValue))));
+
+        /* sign extend int8 -> int64, in 3 steps */
+        s = _mm_cmpgt_epi8(_mm_setzero_si128(), x);
+        for (k = 0; k != 2; k++) {
+            w = k ? _mm_unpackhi_epi8(x, s) : _mm_unpacklo_epi8(x, s);
+            d = _mm_unpacklo_epi16(w, _mm_srai_epi16(w, 15));
+            q = _mm_srai_epi32(d, 31);
+            _mm_storeu_si128((__m128i *)(value + i + 8*k),
+                             _mm_unpacklo_epi32(d, q));
+            _mm_storeu_si128((__m128i *)(value + i + 8*k + 2),
+                             _mm_unpackhi_epi32(d, q));
+            d = _mm_unpackhi_epi16(w, _mm_srai_epi16(w, 15));
+            q = _mm_srai_epi32(d, 31);
+            _mm_storeu_si128((__m128i *)(value + i + 8*k + 4),
+                             _mm_unpacklo_epi32(d, q));
+            _mm_storeu_si128((__m128i *)(value + i + 8*k + 6),
+                             _mm_unpackhi_epi32(d, q));
+        }
+    }
+    return i + parse_run_tail(mi + i, n - i, typeid + i, value + i);
+}
+
+__attribute__((target("avx2")))
+static size_t parse_run_avx2(const uint8_t * restrict mi, size_t n,
+                             uint8_t * restrict typeid,
+                             struct Value * restrict value)
+{
+    size_t i;
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i  x = _mm256_loadu_si256((const __m256i *)(mi + i));
+        __m256i  nil = _mm256_cmpeq_epi8(x, _mm256_set1_epi8((char)0xc0));
+        __m256i  fixint = _mm256_cmpgt_epi8(x, _mm256_set1_epi8(-0x21));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(nil, fixint));
+        int      k;
+
+        if (mask != 0xffffffff)
+            return i + parse_run_tail(mi + i, __builtin_ctz(~mask),
+                                      typeid + i, value + i);
+
+        /* NilValue where nil, LongValue otherwise */
+        _mm256_storeu_si256((__m256i *)(typeid + i), _mm256_sub_epi8(
+            _mm256_set1_epi8(LongValue),
+            _mm256_and_si256(nil, _mm256_set1_epi8(LongValue - NilValue))));
+
+        for (k = 0; k != 32; k += 4) {
+            int32_t b4;
+            memcpy(&b4, mi + i + k, sizeof b4);
+            _mm256_storeu_si256((__m256i *)(value + i + k),
+                                _mm256_cvtepi8_epi64(_mm_cvtsi32_si128(b4)));
+        }
+    }
+    return i + parse_run_tail(mi + i, n - i, typeid + i, value + i);
+}
+
+static size_t parse_run_compact_sse2(const uint8_t * restrict mi, size_t n,
+                                     uint8_t * restrict typeid,
+                                     uint32_t * restrict cvalue)
+{
+    size_t i;
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i  x = _mm_loadu_si128((const __m128i *)(mi + i));
+        __m128i  nil = _mm_cmpeq_epi8(x, _mm_set1_epi8((char)0xc0));
+        __m128i  fixint = _mm_cmpgt_epi8(x, _mm_set1_epi8(-0x21));
+        uint32_t mask = _mm_movemask_epi8(_mm_or_si128(nil, fixint));
+        __m128i  s, w, h;
+        int      k;
+
+        if (mask != 0xffff)
+            return i + parse_run_compact_tail(mi + i, __builtin_ctz(~mask),
+                                              typeid + i, cvalue + i);
+
+        _mm_storeu_si128((__m128i *)(typeid + i), _mm_sub_epi8(
+            _mm_set1_epi8(LongValue),
+            _mm_and_si128(nil, _mm_set1_epi8(LongValue - NilValue))));
+
+        /* sign extend int8 -> int32, shift in the tag bit */
+        s = _mm_cmpgt_epi8(_mm_setzero_si128(), x);
+        for (k = 0; k != 2; k++) {
+            w = k ? _mm_unpackhi_epi8(x, s) : _mm_unpacklo_epi8(x, s);
+            h = _mm_srai_epi16(w, 15);
+            _mm_storeu_si128((__m128i *)(cvalue + i + 8*k), _mm_slli_epi32(
+                _mm_unpacklo_epi16(w, h), 1));
+            _mm_storeu_si128((__m128i *)(cvalue + i + 8*k + 4), _mm_slli_epi32(
+                _mm_unpackhi_epi16(w, h), 1));
+        }
+    }
+    return i + parse_run_compact_tail(mi + i, n - i, typeid + i, cvalue + i);
+}
+
+__attribute__((target("avx2")))
+static size_t parse_run_compact_avx2(const uint8_t * restrict mi, size_t n,
+                                     uint8_t * restrict typeid,
+                                     uint32_t * restrict cvalue)
+{
+    size_t i;
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i  x = _mm256_loadu_si256((const __m256i *)(mi + i));
+        __m256i  nil = _mm256_cmpeq_epi8(x, _mm256_set1_epi8((char)0xc0));
+        __m256i  fixint = _mm256_cmpgt_epi8(x, _mm256_set1_epi8(-0x21));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(nil, fixint));
+        int      k;
+
+        if (mask != 0xffffffff)
+            return i + parse_run_compact_tail(mi + i, __builtin_ctz(~mask),
+                                              typeid + i, cvalue + i);
+
+        _mm256_storeu_si256((__m256i *)(typeid + i), _mm256_sub_epi8(
+            _mm256_set1_epi8(LongValue),
+            _mm256_and_si256(nil, _mm256_set1_epi8(LongValue - NilValue))));
+
+        for (k = 0; k != 32; k += 8) {
+            int64_t b8;
+            memcpy(&b8, mi + i + k, sizeof b8);
+            _mm256_storeu_si256((__m256i *)(cvalue + i + k), _mm256_slli_epi32(
+                _mm256_cvtepi8_epi32(_mm_cvtsi64_si128(b8)), 1));
+        }
+    }
+    return i + parse_run_compact_tail(mi + i, n - i, typeid + i, cvalue + i);
+}
+
+int schema_rt_cpu_has_avx2(void)
+{
+    unsigned eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 0;
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & bit_OSXSAVE))
+        return 0;
+    /* OS saves XMM and YMM state on context switch */
+    __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6)
+        return 0;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_AVX2) != 0;
+}
+
+#endif
+
+static parse_run_func parse_run = parse_run_scalar;
+static parse_run_compact_func parse_run_compact = parse_run_compact_scalar;
+
+__attribute__((constructor))
+static void parse_run_init(void)
+{
+#if defined(__x86_64__)
+    int avx2 = schema_rt_cpu_has_avx2();
+    parse_run = avx2 ? parse_run_avx2 : parse_run_sse2;
+    parse_run_compact = avx2 ? parse_run_compact_avx2 : parse_run_compact_sse2;
+#endif
+}
+
 static int set_error(struct State *state,
                      const char *msg)
 {
@@ -165,22 +496,98 @@ static int set_error(struct State *state,
     return -1; /* always returns -1, see invocation */
 }
 
-int parse_msgpack(struct State *state,
-                  const uint8_t * restrict mi,
-                  size_t        ms)
+/*
+ * Shortest run to engage a kernel. A run is only looked for when
+ * an array or a map opens: checking every scalar for a run ahead
+ * costs more than it saves on mixed data.
+ */
+#define PARSE_RUN_MIN 4
+
+static inline int is_run_start(const uint8_t *mi)
+{
+    return is_run_byte(mi[0]) & is_run_byte(mi[1]) &
+           is_run_byte(mi[2]) & is_run_byte(mi[3]);
+}
+
+/*
+ * Parser registers, saved between parse_msgpack_chunk() calls.
+ */
+struct ParseRegs {
+    size_t             items;    // next item index
+    uint32_t           todo;
+    uint32_t           patch;
+    uint32_t           depth;    // stack depth
+};
+
+#define PARSE_REGS_INIT(base) { (base), 1, -1, 0 }
+
+/*
+ * Value stores of parse_msgpack_value(), the general or the compact
+ * layout (compact is a constant there).
+ */
+#define PARSE_IVAL(x) do { \
+        int64_t ival_ = (x); \
+        if (!compact) { \
+            value->ival = ival_; \
+        } else if ((uint64_t)ival_ + 0x40000000 < 0x80000000) { \
+            *cvalue = (uint32_t)ival_ << 1; \
+        } else { \
+            *cvalue = 1; \
+            value->ival = ival_; \
+        } \
+    } while (0)
+#define PARSE_XLEN(x) do { \
+        if (compact) *cvalue = (x); else value->xlen = (x); \
+    } while (0)
+#define PARSE_XDATA(xlen_, xoff_) do { \
+        if (compact) { \
+            *cvalue = (xlen_) | (uint32_t)(xoff_) << 16; \
+        } else { \
+            value->xlen = (xlen_); \
+            value->xoff = (xoff_); \
+        } \
+    } while (0)
+
+/*
+ * Parse a single top-level value starting at *pmi, storing items
+ * from regs->items on. Updates *pmi to point past the value and sets
+ * res_size to the index following the last item stored. String
+ * offsets are relative to anchor.
+ *
+ * If resumable and the data ends prematurely, saves regs and sets
+ * *pmi to the start of the incomplete item, returns 1.
+ *
+ * If track_bo is set, the start of each item (relative to anchor)
+ * is stored in bo, the item following the value gets the end offset.
+ * An item spans bo[i] - bo[i + v[i].xoff] bytes then (containers
+ * included).
+ *
+ * If compact, items are stored in the compact layout, the caller
+ * ensures it fits (see struct State.cv).
+ */
+static inline __attribute__((always_inline))
+int parse_msgpack_value(struct State *state,
+                        const uint8_t **pmi,
+                        const uint8_t *me,
+                        const uint8_t *anchor,
+                        struct ParseRegs *regs,
+                        int           resumable,
+                        int           compact)
 {
-    const uint8_t *me = mi + ms;
+    const uint8_t * restrict mi = *pmi, *item = mi;
     uint8_t       * restrict typeid;
     struct Value  * restrict value, *value_max, *value_buf;
-    uint32_t       todo = 1, patch = -1;
+    uint32_t      * restrict cvalue = NULL, *cvalue_buf = NULL;
+    uint32_t       todo = regs->todo, patch = regs->patch;
     uint32_t      * restrict stack, *stack_max, *stack_buf;
+    uint32_t      * restrict bo = NULL;
     uint32_t       len;
 
 #if 0
     /* Debug  */
     fprintf(stderr, "parse_msgpack; s: ");
-    for (int i = 0; i < ms; ++i)
-        fprintf(stderr, "%02X ", mi[i]);
+    for (const uint8_t *p = mi; p != me; ++p)
+        fprintf(stderr, "%02X ", *p);
     fprintf(stderr, "\b\n");
 #endif
 
@@ -188,18 +595,31 @@ int parse_msgpack(struct State *state,
      * harm branch prediction accuracy. Not checking the buf capacity,
      * because that would hurt performance (there's enough capacity,
      * except for the very first call). */
-    typeid    = state->t;
-    value     = state->v;
+    typeid    = state->t + regs->items;
+    value     = state->v + regs->items;
     value_max = state->v + state->t_capacity;
     value_buf = state->v;
     /* reusing ov for the stack */
-    stack     = (void *)(state->ov);
+    stack     = (uint32_t *)(void *)(state->ov) + regs->depth;
     stack_max = (void *)(state->ov + state->ot_capacity);
     stack_buf = (void *)(state->ov);
+    if (state->track_bo) {
+        if (buf_reserve_bo(state) != 0)
+            goto error_alloc;
+        bo = state->bo;
+    }
+    state->compact = 0;
+    if (compact) {
+        if (buf_reserve_cv(state) != 0)
+            goto error_alloc;
+        cvalue     = state->cv + regs->items;
+        cvalue_buf = state->cv;
+    }
 
     if (0) {
 repeat:
         value++; typeid++;
+        if (compact) cvalue++;
     }
 
     while (todo -- == 0) {
@@ -209,11 +629,19 @@ repeat:
             goto done;
 
         todo = *--stack;
+        if (compact) {
+            /* the root keeps a truncated patch, it's never used */
+            uint32_t *cfixit = cvalue_buf + patch;
+            patch = *cfixit >> 16;
+            *cfixit = (*cfixit & 0xffff) | (uint32_t)(cvalue - cfixit) << 16;
+            continue;
+        }
         fixit = value_buf + patch;
         patch = fixit->xoff;
         fixit->xoff = value - fixit;
     }
 
+    item = mi;
     if (mi == me)
         goto error_underflow;
 
@@ -230,28 +658,45 @@ repeat:
         value     = state->v + old_capacity;
         value_max = state->v + state->t_capacity;
         value_buf = state->v;
+        if (bo != NULL) {
+            if (buf_reserve_bo(state) != 0)
+                goto error_alloc;
+            bo = state->bo;
+        }
+        if (compact) {
+            if (buf_reserve_cv(state) != 0)
+                goto error_alloc;
+            cvalue     = state->cv + old_capacity;
+            cvalue_buf = state->cv;
+        }
     }
 
+    if (bo != NULL)
+        bo[value - value_buf] = anchor - mi;
+
     switch (*mi) {
     case 0x00 ... 0x7f:
         /* positive fixint */
         *typeid = LongValue;
-        value->ival = *mi++;
+        PARSE_IVAL(*mi++);
         goto repeat;
     case 0x80 ... 0x8f:
         /* fixmap */
         len = *mi++ - 0x80;
         *typeid = MapValue;
-        value->xlen = len;
+        PARSE_XLEN(len);
         len *= 2;
         goto setup_nested;
     case 0x90 ... 0x9f:
         /* fixarray */
         len = *mi++ - 0x90;
         *typeid = ArrayValue;
-        value->xlen = len;
+        PARSE_XLEN(len);
 setup_nested:
-        value->xoff = patch;
+        if (compact)
+            *cvalue |= patch << 16;
+        else
+            value->xoff = patch;
         patch = value - value_buf;
         if (__builtin_expect(stack == stack_max, 0)) {
 
@@ -268,6 +713,31 @@ setup_nested:
         }
         *stack++ = todo;
         todo = len;
+        /* elements start with a run of single-byte scalars? */
+        if (len >= PARSE_RUN_MIN && me - mi >= PARSE_RUN_MIN &&
+            value_max - value > 1 && is_run_start(mi)) {
+
+            size_t n = len;
+            if (n > (size_t)(me - mi))
+                n = me - mi;
+            if (n > (size_t)(value_max - value - 1))
+                n = value_max - value - 1;
+            if (compact) {
+                n = parse_run_compact(mi, n, typeid + 1, cvalue + 1);
+                cvalue += n;
+            } else {
+                n = parse_run(mi, n, typeid + 1, value + 1);
+            }
+            if (bo != NULL) {
+                uint32_t i, *p = bo + (value - value_buf) + 1;
+                for (i = 0; i < n; i++)
+                    p[i] = anchor - (mi + i);
+            }
+            mi += n;
+            todo -= n;
+            value += n;
+            typeid += n;
+        }
         goto repeat;
     case 0xa0 ... 0xbf:
         /* fixstr */
@@ -277,9 +747,8 @@ setup_nested:
 do_xdata:
         if (mi + len + 1 > me)
             goto error_underflow;
-        value->xlen = len;
         /* offset relative to blob end! (saves a reg) */
-        value->xoff = (me - mi - 1);
+        PARSE_XDATA(len, anchor - mi - 1);
         mi += len + 1;
         goto repeat;
     case 0xc0:
@@ -374,7 +843,7 @@ do_xdata:
         if (mi + 2 > me)
             goto error_underflow;
         *typeid = LongValue;
-        value->ival = mi[1];
+        PARSE_IVAL(mi[1]);
         mi += 2;
         goto repeat;
     case 0xcd:
@@ -382,7 +851,7 @@ do_xdata:
         if (mi + 3 > me)
             goto error_underflow;
         *typeid = LongValue;
-        value->ival = net2host16(unaligned(mi + 1)->u16);
+        PARSE_IVAL(net2host16(unaligned(mi + 1)->u16));
         mi += 3;
         goto repeat;
     case 0xce:
@@ -390,7 +859,7 @@ do_xdata:
         if (mi + 5 > me)
             goto error_underflow;
         *typeid = LongValue;
-        value->ival = net2host32(unaligned(mi + 1)->u32);
+        PARSE_IVAL(net2host32(unaligned(mi + 1)->u32));
         mi += 5;
         goto repeat;
     case 0xcf: {
@@ -406,7 +875,7 @@ do_xdata:
             goto repeat;
         }
         *typeid = LongValue;
-        value->ival = v;
+        PARSE_IVAL(v);
         mi += 9;
         goto repeat;
     }
@@ -415,7 +884,7 @@ do_xdata:
         if (mi + 2 > me)
             goto error_underflow;
         *typeid = LongValue;
-        value->ival = (int8_t)mi[1];
+        PARSE_IVAL((int8_t)mi[1]);
         mi += 2;
         goto repeat;
     case 0xd1:
@@ -423,7 +892,7 @@ do_xdata:
         if (mi + 3 > me)
             goto error_underflow;
         *typeid = LongValue;
-        value->ival = (int16_t)net2host16(unaligned(mi + 1)->u16);
+        PARSE_IVAL((int16_t)net2host16(unaligned(mi + 1)->u16));
         mi += 3;
         goto repeat;
     case 0xd2:
@@ -431,7 +900,7 @@ do_xdata:
         if (mi + 5 > me)
             goto error_underflow;
         *typeid = LongValue;
-        value->ival = (int32_t)net2host32(unaligned(mi + 1)->u32);
+        PARSE_IVAL((int32_t)net2host32(unaligned(mi + 1)->u32));
         mi += 5;
         goto repeat;
     case 0xd3:
@@ -439,7 +908,7 @@ do_xdata:
         if (mi + 9 > me)
             goto error_underflow;
         *typeid = LongValue;
-        value->ival = (int64_t)net2host64(unaligned(mi + 1)->u64);
+        PARSE_IVAL((int64_t)net2host64(unaligned(mi + 1)->u64));
         mi += 9;
         goto repeat;
     case 0xd4:
@@ -494,7 +963,7 @@ do_xdata:
         *typeid = ArrayValue;
         len = net2host16(unaligned(mi + 1)->u16);
         mi += 3;
-        value->xlen = len;
+        PARSE_XLEN(len);
         goto setup_nested;
     case 0xdd:
         /* array 32 */
@@ -503,7 +972,7 @@ do_xdata:
         *typeid = ArrayValue;
         len = net2host32(unaligned(mi + 1)->u32);
         mi += 5;
-        value->xlen = len;
+        PARSE_XLEN(len);
         goto setup_nested;
     case 0xde: /* map 16 */
         if (mi + 3 > me)
@@ -511,7 +980,7 @@ do_xdata:
         *typeid = MapValue;
         len = net2host16(unaligned(mi + 1)->u16);
         mi += 3;
-        value->xlen = len;
+        PARSE_XLEN(len);
         len *= 2;
         goto setup_nested;
     case 0xdf: /* map 32 */
@@ -520,21 +989,33 @@ do_xdata:
         *typeid = MapValue;
         len = net2host32(unaligned(mi + 1)->u32);
         mi += 5;
-        value->xlen = len;
+        PARSE_XLEN(len);
         goto setup_nested;
     case 0xe0 ... 0xff:
         /* negative fixint */
         *typeid = LongValue;
-        value->ival = (int8_t)*mi++;
+        PARSE_IVAL((int8_t)*mi++);
         goto repeat;
     }
 
 done:
-    state->res_size = value - state->v;
-    state->b1 = me;
+    if (bo != NULL)
+        bo[value - value_buf] = anchor - mi;
+    state->res_size = regs->items = value - state->v;
+    if (compact)
+        state->compact = regs->items;
+    *pmi = mi;
     return 0;
 
 error_underflow:
+    if (resumable) {
+        regs->items = value - state->v;
+        regs->todo  = todo + 1; /* undo todo-- for the incomplete item */
+        regs->patch = patch;
+        regs->depth = stack - stack_buf;
+        *pmi = item;
+        return 1;
+    }
     return set_error(state, "Truncated data");
 error_c1:
     return set_error(state, "Invalid data");
@@ -542,8 +1023,492 @@ error_alloc:
     return set_error(state, "Out of memory");
 }
 
-int unparse_msgpack(struct State *state,
-                    size_t        nitems)
+int parse_msgpack(struct State *state,
+                  const uint8_t *mi,
+                  size_t        ms)
+{
+    const uint8_t    *me = mi + ms;
+    struct ParseRegs  regs = PARSE_REGS_INIT(0);
+
+    if (parse_msgpack_value(state, &mi, me, me, &regs, 0, 0) != 0)
+        return -1;
+    state->b1 = me;
+    return 0;
+}
+
+/*
+ * Same as parse_msgpack(), messages shorter than COMPACT_MAX_SIZE are
+ * stored in the compact layout (see struct State.cv).
+ */
+int parse_msgpack_compact(struct State *state,
+                          const uint8_t *mi,
+                          size_t        ms)
+{
+    const uint8_t    *me = mi + ms;
+    struct ParseRegs  regs = PARSE_REGS_INIT(0);
+
+    if (ms >= COMPACT_MAX_SIZE)
+        return parse_msgpack(state, mi, ms);
+    if (parse_msgpack_value(state, &mi, me, me, &regs, 0, 1) != 0)
+        return -1;
+    state->b1 = me;
+    return 0;
+}
+
+/*
+ * Parse up to n concatenated top-level values in a single call.
+ * Items of all values are stored back to back. Message k spans
+ * items [offsets[2*k], offsets[2*k+2]) and input bytes
+ * [offsets[2*k+1], offsets[2*k+3]); offsets must have room for
+ * 2*n+2 elements (the trailing pair marks the end of the last
+ * value parsed). Returns the number of values parsed, which is
+ * less than n only if the input is exhausted. On error returns -1,
+ * offsets[2*n] holds the index of the value that failed to parse.
+ */
+int parse_msgpack_batch(struct State *state,
+                        const uint8_t *mi,
+                        size_t        ms,
+                        uint32_t      *offsets,
+                        size_t        n)
+{
+    const uint8_t *mb = mi, *me = mi + ms;
+    size_t         i, items = 0;
+
+    for (i = 0; i < n && mi != me; i++) {
+        struct ParseRegs regs = PARSE_REGS_INIT(items);
+
+        offsets[2 * i] = items;
+        offsets[2 * i + 1] = mi - mb;
+        if (parse_msgpack_value(state, &mi, me, me, &regs, 0, 0) != 0) {
+            offsets[2 * n] = i;
+            return -1;
+        }
+        items = state->res_size;
+    }
+    offsets[2 * i] = items;
+    offsets[2 * i + 1] = mi - mb;
+    state->res_size = items;
+    state->b1 = me;
+    return i;
+}
+
+/*
+ * Skip plan for parse_msgpack_skip(), designates elements of the root
+ * array (items[k] != 0, k < nitems) or values in the root map (keys
+ * is a sequence of keys, each prefixed with the length byte).
+ */
+struct SkipPlan {
+    const uint8_t     *items;
+    size_t             nitems;
+    const uint8_t     *keys;
+    size_t             keys_size;
+};
+
+static int skip_plan_has_key(const struct SkipPlan *plan,
+                             const uint8_t *key, size_t len)
+{
+    const uint8_t *k = plan->keys, *ke = plan->keys + plan->keys_size;
+
+    for (; k != ke; k += 1 + k[0]) {
+        if (k[0] == len && memcmp(k + 1, key, len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Find the end of the value at mi without storing anything.
+ * Byte accounting matches parse_msgpack. Returns NULL on error.
+ */
+static const uint8_t *skip_msgpack(const uint8_t *mi,
+                                   const uint8_t *me,
+                                   const char    **error)
+{
+    uint64_t todo = 1;
+    uint32_t len;
+
+    for (; todo != 0; todo--) {
+        if (mi == me)
+            goto error_underflow;
+        switch (*mi) {
+        case 0x00 ... 0x7f: case 0xc0: case 0xc2: case 0xc3:
+        case 0xe0 ... 0xff:
+            mi += 1;
+            continue;
+        case 0x80 ... 0x8f:
+            todo += 2 * (*mi++ - 0x80);
+            continue;
+        case 0x90 ... 0x9f:
+            todo += *mi++ - 0x90;
+            continue;
+        case 0xa0 ... 0xbf:
+            len = *mi - 0xa0;
+            break;
+        case 0xc1:
+            *error = "Invalid data";
+            return NULL;
+        case 0xc4: case 0xd9:
+            if (mi + 2 > me)
+                goto error_underflow;
+            len = mi[1];
+            mi += 1;
+            break;
+        case 0xc5: case 0xda: case 0xc8:
+            if (mi + 3 > me)
+                goto error_underflow;
+            len = net2host16(unaligned(mi + 1)->u16);
+            mi += 2;
+            break;
+        case 0xc6: case 0xdb: case 0xc9:
+            if (mi + 5 > me)
+                goto error_underflow;
+            len = net2host32(unaligned(mi + 1)->u32);
+            mi += 4;
+            break;
+        case 0xc7:
+            if (mi + 2 > me)
+                goto error_underflow;
+            len = mi[1] + 1;
+            mi += 1;
+            break;
+        case 0xcc: case 0xd0:
+            len = 1;
+            break;
+        case 0xcd: case 0xd1:
+            len = 2;
+            break;
+        case 0xca: case 0xce: case 0xd2:
+            len = 4;
+            break;
+        case 0xcb: case 0xcf: case 0xd3:
+            len = 8;
+            break;
+        case 0xd4: case 0xd5:
+            len = *mi - 0xd3;
+            break;
+        case 0xd6:
+            len = 5;
+            break;
+        case 0xd7:
+            len = 9;
+            break;
+        case 0xd8:
+            len = 17;
+            break;
+        case 0xdc:
+            if (mi + 3 > me)
+                goto error_underflow;
+            todo += net2host16(unaligned(mi + 1)->u16);
+            mi += 3;
+            continue;
+        case 0xdd:
+            if (mi + 5 > me)
+                goto error_underflow;
+            todo += net2host32(unaligned(mi + 1)->u32);
+            mi += 5;
+            continue;
+        case 0xde:
+            if (mi + 3 > me)
+                goto error_underflow;
+            todo += 2 * (uint64_t)net2host16(unaligned(mi + 1)->u16);
+            mi += 3;
+            continue;
+        case 0xdf:
+            if (mi + 5 > me)
+                goto error_underflow;
+            todo += 2 * (uint64_t)net2host32(unaligned(mi + 1)->u32);
+            mi += 5;
+            continue;
+        }
+        /* mi points to the last header byte, len bytes follow */
+        if ((size_t)(me - mi) < (size_t)len + 1)
+            goto error_underflow;
+        mi += len + 1;
+    }
+    return mi;
+
+error_underflow:
+    *error = "Truncated data";
+    return NULL;
+}
+
+/*
+ * Schema-directed parse_msgpack(): if the root array elements / root
+ * map values designated by the plan are arrays or maps, they are
+ * recorded as a single item (xlen is the number of elements, no
+ * children) and their contents are skipped.
+ */
+int parse_msgpack_skip(struct State *state,
+                       const uint8_t *mi,
+                       size_t        ms,
+                       const struct SkipPlan *plan)
+{
+    const uint8_t *mb = mi, *me = mi + ms;
+    uint32_t       len, i;
+    int            ismap;
+    size_t         items, key = 0;
+
+    if (ms < 5)
+        goto fallback;
+    switch (*mi) {
+    case 0x80 ... 0x8f:
+        ismap = 1;
+        len = *mi - 0x80;
+        mi += 1;
+        break;
+    case 0x90 ... 0x9f:
+        ismap = 0;
+        len = *mi - 0x90;
+        mi += 1;
+        break;
+    case 0xdc:
+        ismap = 0;
+        len = net2host16(unaligned(mi + 1)->u16);
+        mi += 3;
+        break;
+    case 0xde:
+        ismap = 1;
+        len = net2host16(unaligned(mi + 1)->u16);
+        mi += 3;
+        break;
+    default:
+        goto fallback;
+    }
+    if (ismap ? plan->keys_size == 0 : plan->nitems == 0)
+        goto fallback;
+
+    if (state->t_capacity == 0 &&
+        buf_grow_tv(&state->t, &state->v, &state->t_capacity,
+                    next_capacity(1)) != 0)
+        return set_error(state, "Out of memory");
+    state->compact = 0;
+    state->t[0] = ismap ? MapValue : ArrayValue;
+    state->v[0].xlen = len;
+    items = 1;
+
+    for (i = 0; i < (ismap ? 2 * len : len); i++) {
+        int skip;
+
+        if (mi == me)
+            return set_error(state, "Truncated data");
+        if (ismap) {
+            if ((i & 1) == 0)
+                key = items;
+            skip = (i & 1) && state->t[key] == StringValue &&
+                   skip_plan_has_key(plan, me - state->v[key].xoff,
+                                     state->v[key].xlen);
+        } else {
+            skip = i < plan->nitems && plan->items[i];
+        }
+        if (skip && ((*mi >= 0x80 && *mi <= 0x9f) ||
+                     (*mi >= 0xdc && *mi <= 0xdf))) {
+            const uint8_t *end;
+            const char    *error;
+            uint32_t       n;
+
+            end = skip_msgpack(mi, me, &error);
+            if (end == NULL)
+                return set_error(state, error);
+            switch (*mi) {
+            case 0x80 ... 0x8f:
+                n = *mi - 0x80;
+                break;
+            case 0x90 ... 0x9f:
+                n = *mi - 0x90;
+                break;
+            case 0xdc: case 0xde:
+                n = net2host16(unaligned(mi + 1)->u16);
+                break;
+            default:
+                n = net2host32(unaligned(mi + 1)->u32);
+            }
+            if (items == state->t_capacity &&
+                buf_grow_tv(&state->t, &state->v, &state->t_capacity,
+                            next_capacity(items + 1)) != 0)
+                return set_error(state, "Out of memory");
+            state->t[items] = *mi <= 0x8f || *mi >= 0xde ?
+                              MapValue : ArrayValue;
+            state->v[items].xlen = n;
+            state->v[items].xoff = 1;
+            items++;
+            mi = end;
+        } else {
+            struct ParseRegs regs = PARSE_REGS_INIT(items);
+
+            if (parse_msgpack_value(state, &mi, me, me, &regs, 0, 0) != 0)
+                return -1;
+            items = regs.items;
+        }
+    }
+    state->v[0].xoff = items;
+    state->res_size = items;
+    state->b1 = me;
+    return 0;
+
+fallback:
+    return parse_msgpack(state, mb, ms);
+}
+
+/*
+ * String offsets are relative to the end of sbuf (sbuf + sbuf_capacity),
+ * since sbuf end moves as the data arrives. When sbuf is reallocated,
+ * offsets of the items parsed so far are rebased.
+ */
+#define PARSE_CHUNK_MAX UINT32_MAX
+
+static int parse_chunk_grow(struct State *state,
+                            size_t        items,
+                            size_t        min_capacity)
+{
+    size_t old_capacity = state->sbuf_capacity;
+    size_t capacity = next_capacity(min_capacity);
+    size_t delta, i;
+
+    if (capacity > PARSE_CHUNK_MAX)
+        capacity = PARSE_CHUNK_MAX;
+    if (buf_grow(&state->sbuf, &state->sbuf_capacity, capacity) != 0)
+        return -1;
+    delta = capacity - old_capacity;
+    for (i = 0; i < items; i++) {
+        if (state->t[i] == StringValue || state->t[i] == BinValue ||
+            state->t[i] == ExtValue)
+            state->v[i].xoff += delta;
+    }
+    if (state->track_bo && items != 0) {
+        for (i = 0; i < items; i++)
+            state->bo[i] += delta;
+    }
+    return 0;
+}
+
+/*
+ * Resumable parse, the data arrives in chunks. Chunks are
+ * accumulated in sbuf (string items reference the data); the value
+ * is parsed as far as the data allows. Returns 0 once the value is
+ * complete, 1 if more data is needed, -1 on error. The call following
+ * a complete value starts a new one with the bytes past the value end
+ * (kept in sbuf starting at spos), an error discards the data.
+ */
+int parse_msgpack_chunk(struct State *state,
+                        const uint8_t *chunk,
+                        size_t        size)
+{
+    struct ParseRegs regs = PARSE_REGS_INIT(0);
+    const uint8_t   *mi, *me;
+    int              rc;
+
+    if (state->stodo == 0) {
+        if (state->spos != 0) {
+            state->sbuf_size -= state->spos;
+            memmove(state->sbuf, state->sbuf + state->spos,
+                    state->sbuf_size);
+            state->spos = 0;
+        }
+    } else {
+        regs.items = state->sitems;
+        regs.todo  = state->stodo;
+        regs.patch = state->spatch;
+        regs.depth = state->sdepth;
+    }
+    if (size > PARSE_CHUNK_MAX - state->sbuf_size) {
+        set_error(state, "Data too large");
+        goto error;
+    }
+    if (state->sbuf_capacity < state->sbuf_size + size &&
+        parse_chunk_grow(state, regs.items,
+                         state->sbuf_size + size) != 0) {
+        set_error(state, "Out of memory");
+        goto error;
+    }
+    if (size != 0)
+        memcpy(state->sbuf + state->sbuf_size, chunk, size);
+    state->sbuf_size += size;
+
+    mi = state->sbuf + state->spos;
+    me = state->sbuf + state->sbuf_size;
+    rc = parse_msgpack_value(state, &mi, me,
+                             state->sbuf + state->sbuf_capacity, &regs,
+                             1, 0);
+    if (rc < 0)
+        goto error;
+    state->spos   = mi - state->sbuf;
+    state->sitems = regs.items;
+    if (rc == 1) {
+        state->stodo  = regs.todo;
+        state->spatch = regs.patch;
+        state->sdepth = regs.depth;
+        return 1;
+    }
+    state->stodo = 0;
+    state->b1 = state->sbuf + state->sbuf_capacity;
+    return 0;
+
+error:
+    state->stodo = 0;
+    state->sbuf_size = state->spos = 0;
+    return -1;
+}
+
+/*
+ * Make the value parsed with parse_msgpack_chunk() in src the input
+ * of dst, the data stays in src.
+ */
+int parse_msgpack_chunk_copy(struct State *dst,
+                             const struct State *src)
+{
+    size_t n = src->sitems;
+
+    if (dst->t_capacity < n &&
+        buf_grow_tv(&dst->t, &dst->v, &dst->t_capacity,
+                    next_capacity(n)) != 0)
+        return set_error(dst, "Out of memory");
+
+    memcpy(dst->t, src->t, n * sizeof(dst->t[0]));
+    memcpy(dst->v, src->v, n * sizeof(dst->v[0]));
+    if (dst->track_bo && src->track_bo) {
+        if (buf_reserve_bo(dst) != 0)
+            return set_error(dst, "Out of memory");
+        memcpy(dst->bo, src->bo, (n + 1) * sizeof(dst->bo[0]));
+    }
+    dst->res_size = n;
+    dst->b1 = src->b1;
+    dst->compact = 0;
+    return 0;
+}
+
+/*
+ * Make room for size more bytes at out. The data written so far
+ * (starting at buf) is moved to res if buf is a caller-provided buffer.
+ * Returns the new out or NULL.
+ */
+static uint8_t *unparse_grow(struct State *state,
+                             uint8_t      *buf,
+                             uint8_t      *out,
+                             size_t        size)
+{
+    size_t used = out - buf;
+    int    ext = buf != state->res;
+
+    if (state->res_capacity < used + size &&
+        buf_grow(&state->res, &state->res_capacity,
+                 next_capacity(used + size)) != 0)
+        return NULL;
+    if (ext)
+        memcpy(state->res, buf, used);
+    return state->res + used;
+}
+
+/*
+ * Encode nitems of ot/ov into buf (capacity bytes). Once buf is
+ * exhausted, the output continues in res. Sets res_size to the
+ * output size, returns 1 if the output ended up in res and buf
+ * isn't res, 0 otherwise, -1 on error.
+ */
+static inline __attribute__((always_inline))
+int unparse_msgpack_buf(struct State *state,
+                        size_t        nitems,
+                        uint8_t      *buf,
+                        size_t        capacity)
 {
     //nitems--;
     const uint8_t      * restrict typeid = state->ot - 1;
@@ -553,9 +1518,10 @@ int unparse_msgpack(struct State *state,
     const uint8_t      * typeid_max = state->ot + nitems;
     uint8_t            * restrict out, *out_max;
     const uint8_t      * restrict copy_from = bank1;
+    uint8_t            * out_buf = buf;
 
-    out = state->res;
-    out_max = state->res + state->res_capacity;
+    out = buf;
+    out_max = buf + capacity;
 
     const uint8_t * typeid2 = typeid;
     const struct Value * value2 = value;
@@ -821,6 +1787,8 @@ int unparse_msgpack(struct State *state,
         case CopyCommand:
             copy_from = bank2;
             goto copy_data;
+        case CopyInputCommand:
+            goto copy_data;
         }
 
 check_buf:
@@ -829,11 +1797,10 @@ check_buf:
          * Almost every switch branch ends up jumping here.
          */
         if (__builtin_expect(out + 10 > out_max, 0)) {
-            uint8_t *old_res = state->res;
-            if (buf_grow(&state->res, &state->res_capacity,
-                         next_capacity(state->res_capacity + 10)) != 0)
+            out = unparse_grow(state, out_buf, out, 10);
+            if (out == NULL)
                 goto error_alloc;
-            out = state->res + (out - old_res);
+            out_buf = state->res;
             out_max = state->res + state->res_capacity;
         }
         continue;
@@ -845,12 +1812,11 @@ copy_data:
          * Some switch branches end up jumping here.
          */
         if (__builtin_expect(out + value->xlen + 10 > out_max, 0)) {
-            uint8_t *old_res = state->res;
-            size_t old_capacity = state->res_capacity;
-            if (buf_grow(&state->res, &state->res_capacity,
-                         next_capacity(old_capacity + value->xlen + 10)) != 0)
+            out = unparse_grow(state, out_buf, out,
+                               (size_t)value->xlen + 10);
+            if (out == NULL)
                 goto error_alloc;
-            out = state->res + (out - old_res);
+            out_buf = state->res;
             out_max = state->res + state->res_capacity;
         }
         if (__builtin_expect(value->xoff == UINT32_MAX, 0)) {
@@ -867,8 +1833,8 @@ copy_data:
         continue;
     }
 
-    state->res_size = out - state->res;
-    return 0;
+    state->res_size = out - out_buf;
+    return out_buf != buf;
 
 error_alloc:
     return set_error(state, "Out of memory");
@@ -883,6 +1849,46 @@ error_badcode:
     return set_error(state, "Internal error: unknown code");
 }
 
+int unparse_msgpack(struct State *state,
+                    size_t        nitems)
+{
+    if (unparse_msgpack_buf(state, nitems,
+                            state->res, state->res_capacity) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * unparse_msgpack() writing to buf rather than res, saves a copy if
+ * the caller is about to store the data elsewhere anyway. Returns 0 if
+ * the output is in buf, 1 if it didn't fit and is in res instead,
+ * -1 on error. Res_size is the output size either way. Buf contents
+ * are undefined if the output didn't fit, nothing is written past
+ * capacity.
+ *
+ * Note: the encoder keeps 10 bytes of slack, output up to capacity-10
+ * bytes long is guaranteed to stay in buf.
+ */
+int unparse_msgpack_to(struct State *state,
+                       size_t        nitems,
+                       uint8_t      *buf,
+                       size_t        capacity)
+{
+    return unparse_msgpack_buf(state, nitems, buf, capacity);
+}
+
+void schema_rt_state_destroy(struct State *state)
+{
+    free(state->res);
+    free(state->t);
+    free(state->v);
+    free(state->ot);
+    free(state->ov);
+    free(state->sbuf);
+    free(state->bo);
+    free(state->cv);
+}
+
 int schema_rt_buf_grow(struct State *state,
                        size_t min_capacity)
 {
@@ -892,6 +1898,93 @@ int schema_rt_buf_grow(struct State *state,
                        next_capacity(min_capacity));
 }
 
+/*
+ * Ensure t/v have room for min_capacity items (and bo, if tracked),
+ * for filling them outside parse_msgpack.
+ */
+int schema_rt_buf_grow_input(struct State *state,
+                             size_t min_capacity)
+{
+    if (min_capacity > state->t_capacity &&
+        buf_grow_tv(&state->t, &state->v, &state->t_capacity,
+                    next_capacity(min_capacity)) != 0)
+        return -1;
+    if (state->track_bo && buf_reserve_bo(state) != 0)
+        return -1;
+    state->compact = 0;
+    return 0;
+}
+
+/* Failure is harmless, the bigger block stays. */
+static void buf_shrink(void **buf, size_t size)
+{
+    void *new_buf = realloc(*buf, size);
+    if (new_buf != NULL)
+        *buf = new_buf;
+}
+
+/*
+ * Shrink buffers exceeding the given capacities (items / bytes), the
+ * contents are discarded. Capacities below the initial one are rounded
+ * up.
+ */
+void schema_rt_buf_trim(struct State *state,
+                        size_t t_capacity,
+                        size_t ot_capacity,
+                        size_t res_capacity)
+{
+    t_capacity = next_capacity(t_capacity);
+    ot_capacity = next_capacity(ot_capacity);
+    res_capacity = next_capacity(res_capacity);
+    if (state->t_capacity > t_capacity) {
+        state->t_capacity = t_capacity;
+        buf_shrink((void **)&state->t, t_capacity * sizeof(state->t[0]));
+        buf_shrink((void **)&state->v, t_capacity * sizeof(state->v[0]));
+    }
+    if (state->cv_capacity > t_capacity) {
+        state->cv_capacity = t_capacity;
+        buf_shrink((void **)&state->cv, t_capacity * sizeof(state->cv[0]));
+    }
+    if (state->bo_capacity > t_capacity + 1) {
+        state->bo_capacity = t_capacity + 1;
+        buf_shrink((void **)&state->bo,
+                   state->bo_capacity * sizeof(state->bo[0]));
+    }
+    if (state->ot_capacity > ot_capacity) {
+        state->ot_capacity = ot_capacity;
+        buf_shrink((void **)&state->ot, ot_capacity * sizeof(state->ot[0]));
+        buf_shrink((void **)&state->ov, ot_capacity * sizeof(state->ov[0]));
+    }
+    if (state->res_capacity > res_capacity) {
+        state->res_capacity = res_capacity;
+        buf_shrink((void **)&state->res, res_capacity);
+    }
+}
+
+/*
+ * Convert the items parsed by parse_msgpack_compact() to the general
+ * layout, for the code accessing t/v directly (error reporting).
+ */
+void schema_rt_compact_expand(struct State *state)
+{
+    const uint32_t *cv = state->cv;
+    size_t i;
+
+    for (i = 0; i < state->compact; i++) {
+        switch (state->t[i]) {
+        case LongValue:
+            state->v[i].ival = COMPACT_IVAL(cv, state->v, i);
+            break;
+        case StringValue: case BinValue: case ExtValue:
+        case ArrayValue: case MapValue:
+            state->v[i].xlen = COMPACT_XLEN(cv, i);
+            state->v[i].xoff = COMPACT_XOFF(cv, i);
+            break;
+        }
+    }
+    state->compact = 0;
+}
+
 /*
  * Render location info in res buf.
  * *Pos* is the posiotion of offending element.
@@ -988,3 +2081,531 @@ void schema_rt_xflatten_done(struct State *state,
     state->ot[0] = ArrayValue;
     state->ov[0].xlen = array_len;
 }
+
+/*
+ * Bytecode interpreter, an alternative to running the Lua code
+ * generated from the IL (see avro_schema/bytecode.lua for the encoding).
+ *
+ * Code is an array of 32 bit words, an instruction is an opcode followed
+ * by operands. Operands reference registers (uint32_t item positions)
+ * of the current frame, register 0 is the output position ($0 in IL),
+ * register 1 is the function argument. A position operand is a register
+ * and a signed offset, jump targets are absolute word indices.
+ *
+ * Opcodes of instructions with an IL counterpart match
+ * struct schema_il_Opcode in il.lua.
+ */
+enum InterpOp {
+    IOP_FUNC        = 0x01, /* nslots; function entry */
+    IOP_RET         = 0x02,
+    IOP_JMP         = 0x03, /* target */
+    IOP_JZ          = 0x04, /* reg, target */
+    IOP_JNZ         = 0x05, /* reg, target */
+    IOP_JNUL        = 0x06, /* reg, ipo, target */
+    IOP_JNOTNUL     = 0x07, /* reg, ipo, target */
+    IOP_FOREACH     = 0x08, /* ireg, reg, ipo, step, target */
+    IOP_PUTC        = 0x09, /* offset, type, lo, hi */
+
+    IOP_CALLFUNC    = 0xc0, /* rreg, reg, ipo, k, target */
+    IOP_INTSWITCH   = 0xc6, /* reg, ipo, n, n * {value, target} */
+    IOP_STRSWITCH   = 0xc7, /* reg, ipo, n, n * {len, cpool, target} */
+    IOP_MOVE        = 0xc9, /* rreg, reg, ipo */
+    IOP_SKIP        = 0xca, /* rreg, reg, ipo */
+    IOP_PSKIP       = 0xcb, /* rreg, reg, ipo */
+    IOP_PUTINTKC    = 0xd6, /* offset, value */
+    IOP_PUTBOOL     = 0xd9, /* offset, reg, ipo (PUTBOOL .. PUTBIN2STR) */
+    IOP_PUTINT      = 0xda,
+    IOP_PUTLONG     = 0xdb,
+    IOP_PUTFLOAT    = 0xdc,
+    IOP_PUTDOUBLE   = 0xdd,
+    IOP_PUTSTR      = 0xde,
+    IOP_PUTBIN      = 0xdf,
+    IOP_PUTARRAY    = 0xe0,
+    IOP_PUTMAP      = 0xe1,
+    IOP_PUTINT2LONG = 0xe2,
+    IOP_PUTINT2FLT  = 0xe3,
+    IOP_PUTINT2DBL  = 0xe4,
+    IOP_PUTLONG2FLT = 0xe5,
+    IOP_PUTLONG2DBL = 0xe6,
+    IOP_PUTFLT2DBL  = 0xe7,
+    IOP_PUTSTR2BIN  = 0xe8,
+    IOP_PUTBIN2STR  = 0xe9,
+    IOP_PUTENUMI2S  = 0xea, /* offset, reg, ipo, n, sparse, n * {len, cpool} */
+    IOP_PUTENUMS2I  = 0xeb, /* offset, reg, ipo, n, n * {len, cpool, value} */
+    IOP_ISBOOL      = 0xec, /* reg, ipo (ISBOOL .. ISNULORMAP) */
+    IOP_ISINT       = 0xed,
+    IOP_ISFLOAT     = 0xee,
+    IOP_ISDOUBLE    = 0xef,
+    IOP_ISLONG      = 0xf0,
+    IOP_ISSTR       = 0xf1,
+    IOP_ISBIN       = 0xf2,
+    IOP_ISARRAY     = 0xf3,
+    IOP_ISMAP       = 0xf4,
+    IOP_ISNUL       = 0xf5,
+    IOP_ISNULORMAP  = 0xf6,
+    IOP_LENIS       = 0xf7, /* reg, ipo, len */
+    IOP_ISSET       = 0xf8, /* reg, reg, ipo, name */
+    IOP_ISNOTSET    = 0xf9, /* reg */
+    IOP_BEGINVAR    = 0xfa, /* reg */
+    IOP_CHECKOBUF   = 0xfc, /* offset, reg, ipo, scale */
+    IOP_ERRVALUEV   = 0xfd, /* reg, ipo */
+    IOP_ERROR       = 0xfe, /* message */
+    IOP_PUTSPAN     = 0xff  /* offset, reg, ipo */
+};
+
+/* err[0] of schema_rt_interp(), the caller raises a matching error */
+enum InterpError {
+    IERR_TYPE       = 1, /* err[2] - opcode */
+    IERR_LENGTH     = 2, /* err[2] - expected length */
+    IERR_MISSING    = 3, /* err[2] - name */
+    IERR_DUPLICATE  = 4,
+    IERR_VALUE      = 5, /* err[2] - 1 if schema versioning error */
+    IERR_ERROR      = 6, /* err[2] - message */
+    IERR_NOMEM      = 7
+};
+
+#define INTERP_NILREG 0xffffffff
+/* frame header: return address, rreg, k, caller frame */
+#define INTERP_FRAME_HEADER 4
+#define INTERP_LOCAL_STACK 256
+
+static int interp_stack_grow(uint32_t **stack, size_t *capacity,
+                             uint32_t *local_stack, size_t min_capacity)
+{
+    size_t new_capacity = *capacity * 2;
+    uint32_t *new_stack;
+    while (new_capacity < min_capacity)
+        new_capacity *= 2;
+    if (*stack == local_stack) {
+        new_stack = malloc(new_capacity * sizeof(new_stack[0]));
+        if (new_stack != NULL)
+            memcpy(new_stack, local_stack, *capacity * sizeof(new_stack[0]));
+    } else {
+        new_stack = realloc(*stack, new_capacity * sizeof(new_stack[0]));
+    }
+    if (new_stack == NULL)
+        return -1;
+    *stack = new_stack;
+    *capacity = new_capacity;
+    return 0;
+}
+
+static inline int interp_str_cmp(const uint8_t *a, uint32_t alen,
+                                 const uint8_t *b, uint32_t blen)
+{
+    if (alen != blen)
+        return alen < blen ? -1 : 1;
+    return memcmp(a, b, alen);
+}
+
+/*
+ * Runs the function at entry (IOP_FUNC) with the given $0 and argument.
+ *
+ * @returns $0 once the function completes or -1 on error, err
+ *          receives the error kind, position and argument
+ *          (enum InterpError).
+ */
+int64_t schema_rt_interp(struct State *state,
+                         const uint32_t *code,
+                         uint32_t entry,
+                         uint32_t v0,
+                         uint32_t v1,
+                         uint32_t *err)
+{
+    /* code is trusted (generated by bytecode.lua), no invalid opcodes */
+    static const void *dispatch[256] = {
+        [IOP_RET]         = &&l_ret,
+        [IOP_JMP]         = &&l_jmp,
+        [IOP_JZ]          = &&l_jz,
+        [IOP_JNZ]         = &&l_jnz,
+        [IOP_JNUL]        = &&l_jnul,
+        [IOP_JNOTNUL]     = &&l_jnotnul,
+        [IOP_FOREACH]     = &&l_foreach,
+        [IOP_PUTC]        = &&l_putc,
+        [IOP_CALLFUNC]    = &&l_callfunc,
+        [IOP_INTSWITCH]   = &&l_intswitch,
+        [IOP_STRSWITCH]   = &&l_strswitch,
+        [IOP_MOVE]        = &&l_move,
+        [IOP_SKIP]        = &&l_skip,
+        [IOP_PSKIP]       = &&l_pskip,
+        [IOP_PUTINTKC]    = &&l_putintkc,
+        [IOP_PUTBOOL]     = &&l_putbool,
+        [IOP_PUTINT]      = &&l_putlong,
+        [IOP_PUTLONG]     = &&l_putlong,
+        [IOP_PUTINT2LONG] = &&l_putlong,
+        [IOP_PUTFLOAT]    = &&l_putfloat,
+        [IOP_PUTDOUBLE]   = &&l_putdouble,
+        [IOP_PUTFLT2DBL]  = &&l_putdouble,
+        [IOP_PUTSTR]      = &&l_putstr,
+        [IOP_PUTBIN2STR]  = &&l_putstr,
+        [IOP_PUTBIN]      = &&l_putbin,
+        [IOP_PUTSTR2BIN]  = &&l_putbin,
+        [IOP_PUTARRAY]    = &&l_putarray,
+        [IOP_PUTMAP]      = &&l_putmap,
+        [IOP_PUTINT2FLT]  = &&l_putlong2flt,
+        [IOP_PUTLONG2FLT] = &&l_putlong2flt,
+        [IOP_PUTINT2DBL]  = &&l_putlong2dbl,
+        [IOP_PUTLONG2DBL] = &&l_putlong2dbl,
+        [IOP_PUTENUMI2S]  = &&l_putenumi2s,
+        [IOP_PUTENUMS2I]  = &&l_putenums2i,
+        [IOP_ISBOOL]      = &&l_isbool,
+        [IOP_ISINT]       = &&l_isint,
+        [IOP_ISFLOAT]     = &&l_isdouble,
+        [IOP_ISDOUBLE]    = &&l_isdouble,
+        [IOP_ISLONG]      = &&l_islong,
+        [IOP_ISSTR]       = &&l_isstr,
+        [IOP_ISBIN]       = &&l_isbin,
+        [IOP_ISARRAY]     = &&l_isarray,
+        [IOP_ISMAP]       = &&l_ismap,
+        [IOP_ISNUL]       = &&l_isnul,
+        [IOP_ISNULORMAP]  = &&l_isnulormap,
+        [IOP_LENIS]       = &&l_lenis,
+        [IOP_ISSET]       = &&l_isset,
+        [IOP_ISNOTSET]    = &&l_isnotset,
+        [IOP_BEGINVAR]    = &&l_beginvar,
+        [IOP_CHECKOBUF]   = &&l_checkobuf,
+        [IOP_ERRVALUEV]   = &&l_errvaluev,
+        [IOP_ERROR]       = &&l_error,
+        [IOP_PUTSPAN]     = &&l_putspan
+    };
+    uint32_t local_stack[INTERP_LOCAL_STACK];
+    uint32_t *stack = local_stack, *R;
+    size_t capacity = INTERP_LOCAL_STACK, base, top;
+    const uint32_t *pc, *tab;
+    const uint8_t *t = state->t;
+    const struct Value *v = state->v;
+    const uint32_t *cv = state->compact ? state->cv : NULL;
+    uint32_t pos, n, lo, hi, mid, arg = 0;
+    int64_t rc;
+    int kind;
+
+#define NEXT(len) do { pc += (len); goto *dispatch[*pc]; } while (0)
+#define JUMP(target) do { pc = code + (target); goto *dispatch[*pc]; } while (0)
+#define POS(reg, ipo) (R[(reg)] + (ipo))
+#define FAIL(k, p, a) do { kind = (k); pos = (p); arg = (a); goto fail; } while (0)
+#define OUT(offset) (R[0] + (offset))
+/* input values in either layout */
+#define IVAL(p) (cv ? COMPACT_IVAL(cv, v, p) : v[p].ival)
+#define XLEN(p) (cv ? COMPACT_XLEN(cv, p) : v[p].xlen)
+#define XOFF(p) (cv ? COMPACT_XOFF(cv, p) : v[p].xoff)
+
+    /* the bottom frame returns to nowhere */
+    n = code[entry + 1];
+    base = INTERP_FRAME_HEADER;
+    top = base + n;
+    if (top > capacity &&
+        interp_stack_grow(&stack, &capacity, local_stack, top) != 0) {
+        kind = IERR_NOMEM; pos = 0;
+        goto fail;
+    }
+    stack[0] = INTERP_NILREG;
+    stack[1] = INTERP_NILREG;
+    stack[2] = 0;
+    stack[3] = 0;
+    R = stack + base;
+    memset(R, 0, n * sizeof(R[0]));
+    R[0] = v0;
+    R[1] = v1;
+    pc = code + entry;
+    NEXT(2);
+
+l_callfunc: {
+    uint32_t target = pc[5], arg_pos = POS(pc[2], pc[3]);
+    size_t new_base = top + INTERP_FRAME_HEADER;
+    n = code[target + 1];
+    if (new_base + n > capacity) {
+        if (interp_stack_grow(&stack, &capacity, local_stack,
+                              new_base + n) != 0)
+            FAIL(IERR_NOMEM, 0, 0);
+        R = stack + base;
+    }
+    stack[top] = (uint32_t)(pc - code) + 6;
+    stack[top + 1] = pc[1];
+    stack[top + 2] = pc[4];
+    stack[top + 3] = (uint32_t)base;
+    state->k += (int32_t)pc[4];
+    v0 = R[0];
+    base = new_base;
+    top = base + n;
+    R = stack + base;
+    memset(R, 0, n * sizeof(R[0]));
+    R[0] = v0;
+    R[1] = arg_pos;
+    JUMP(target + 2);
+}
+
+l_ret: {
+    uint32_t *header = R - INTERP_FRAME_HEADER;
+    uint32_t rreg = header[1];
+    if (header[0] == INTERP_NILREG) {
+        rc = R[0];
+        goto done;
+    }
+    v0 = R[0];
+    v1 = R[1];
+    state->k -= (int32_t)header[2];
+    top = base - INTERP_FRAME_HEADER;
+    base = header[3];
+    R = stack + base;
+    R[0] = v0;
+    if (rreg != INTERP_NILREG)
+        R[rreg] = v1;
+    JUMP(header[0]);
+}
+
+l_jmp:
+    JUMP(pc[1]);
+
+l_jz:
+    if (R[pc[1]] == 0)
+        JUMP(pc[2]);
+    NEXT(3);
+
+l_jnz:
+    if (R[pc[1]] != 0)
+        JUMP(pc[2]);
+    NEXT(3);
+
+l_jnul:
+    if (t[POS(pc[1], pc[2])] == NilValue)
+        JUMP(pc[3]);
+    NEXT(4);
+
+l_jnotnul:
+    if (t[POS(pc[1], pc[2])] != NilValue)
+        JUMP(pc[3]);
+    NEXT(4);
+
+l_foreach:
+    pos = POS(pc[2], pc[3]);
+    R[pc[1]] += pc[4];
+    if (R[pc[1]] >= pos + XOFF(pos))
+        JUMP(pc[5]);
+    NEXT(6);
+
+l_putc:
+    pos = OUT(pc[1]);
+    state->ot[pos] = (uint8_t)pc[2];
+    state->ov[pos].uval = (uint64_t)pc[3] | (uint64_t)pc[4] << 32;
+    NEXT(5);
+
+l_intswitch:
+    pos = POS(pc[1], pc[2]);
+    n = pc[3];
+    tab = pc + 4;
+    lo = 0; hi = n;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (IVAL(pos) == (int32_t)tab[mid * 2])
+            JUMP(tab[mid * 2 + 1]);
+        if (IVAL(pos) < (int32_t)tab[mid * 2])
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    FAIL(IERR_VALUE, pos, 0);
+
+l_strswitch:
+    pos = POS(pc[1], pc[2]);
+    n = pc[3];
+    tab = pc + 4;
+    lo = 0; hi = n;
+    while (lo < hi) {
+        int cmp;
+        mid = (lo + hi) / 2;
+        cmp = interp_str_cmp(state->b1 - XOFF(pos), XLEN(pos),
+                             state->b2 - tab[mid * 3 + 1], tab[mid * 3]);
+        if (cmp == 0)
+            JUMP(tab[mid * 3 + 2]);
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    FAIL(IERR_VALUE, pos, 0);
+
+l_move:
+    R[pc[1]] = POS(pc[2], pc[3]);
+    NEXT(4);
+
+l_skip:
+    pos = POS(pc[2], pc[3]);
+    R[pc[1]] = pos + XOFF(pos);
+    NEXT(4);
+
+l_pskip:
+    pos = POS(pc[2], pc[3]);
+    R[pc[1]] = pos + 1 + (t[pos] == ArrayValue || t[pos] == MapValue ?
+                          XOFF(pos) - 1 : 0);
+    NEXT(4);
+
+l_putintkc:
+    pos = OUT(pc[1]);
+    state->ot[pos] = LongValue;
+    state->ov[pos].ival = state->k + (int32_t)pc[2];
+    NEXT(3);
+
+l_putbool:
+    state->ot[OUT(pc[1])] = t[POS(pc[2], pc[3])];
+    NEXT(4);
+
+#define PUT(type, field, expr) \
+    pos = OUT(pc[1]); \
+    state->ot[pos] = (type); \
+    state->ov[pos].field = (expr); \
+    NEXT(4);
+#define PUTX(type) \
+    pos = OUT(pc[1]); \
+    n = POS(pc[2], pc[3]); \
+    state->ot[pos] = (type); \
+    state->ov[pos].xlen = XLEN(n); \
+    state->ov[pos].xoff = XOFF(n); \
+    NEXT(4);
+#define IN POS(pc[2], pc[3])
+
+l_putlong:      PUT(LongValue,   ival, IVAL(IN))
+l_putfloat:     PUT(FloatValue,  dval, v[IN].dval)
+l_putdouble:    PUT(DoubleValue, dval, v[IN].dval)
+l_putstr:       PUTX(StringValue)
+l_putbin:       PUTX(BinValue)
+l_putarray:     PUT(ArrayValue,  xlen, XLEN(IN))
+l_putmap:       PUT(MapValue,    xlen, XLEN(IN))
+l_putlong2flt:  PUT(FloatValue,  dval, (double)IVAL(IN))
+l_putlong2dbl:  PUT(DoubleValue, dval, (double)IVAL(IN))
+
+#undef IN
+#undef PUTX
+#undef PUT
+
+l_putspan:
+    pos = POS(pc[2], pc[3]);
+    n = OUT(pc[1]);
+    state->ot[n] = CopyInputCommand;
+    state->ov[n].xoff = state->bo[pos];
+    state->ov[n].xlen = state->bo[pos] - state->bo[pos + XOFF(pos)];
+    NEXT(4);
+
+l_putenumi2s: {
+    uint64_t i;
+    pos = POS(pc[2], pc[3]);
+    n = pc[4];
+    tab = pc + 6;
+    i = (uint64_t)IVAL(pos);
+    if (i >= n)
+        FAIL(IERR_VALUE, pos, 0);
+    if (pc[5] && tab[i * 2] == 0)
+        FAIL(IERR_VALUE, pos, 1);
+    state->ot[OUT(pc[1])] = CStringValue;
+    state->ov[OUT(pc[1])].xlen = tab[i * 2];
+    state->ov[OUT(pc[1])].xoff = tab[i * 2 + 1];
+    NEXT(6 + 2 * n);
+}
+
+l_putenums2i:
+    pos = POS(pc[2], pc[3]);
+    n = pc[4];
+    tab = pc + 5;
+    lo = 0; hi = n;
+    while (lo < hi) {
+        int cmp;
+        mid = (lo + hi) / 2;
+        cmp = interp_str_cmp(state->b1 - XOFF(pos), XLEN(pos),
+                             state->b2 - tab[mid * 3 + 1], tab[mid * 3]);
+        if (cmp == 0) {
+            if ((int32_t)tab[mid * 3 + 2] < 0)
+                FAIL(IERR_VALUE, pos, 1);
+            state->ot[OUT(pc[1])] = LongValue;
+            state->ov[OUT(pc[1])].ival = (int32_t)tab[mid * 3 + 2];
+            NEXT(5 + 3 * n);
+        }
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    FAIL(IERR_VALUE, pos, 0);
+
+#define CHECK_TYPE(cond) \
+    pos = POS(pc[1], pc[2]); \
+    if (!(cond)) \
+        FAIL(IERR_TYPE, pos, pc[0]); \
+    NEXT(3);
+
+l_isbool:      CHECK_TYPE(t[pos] == FalseValue || t[pos] == TrueValue)
+l_isint:       CHECK_TYPE(t[pos] == LongValue &&
+                          (uint64_t)IVAL(pos) + 0x80000000 <= 0xffffffff)
+l_isdouble:
+    pos = POS(pc[1], pc[2]);
+    if (t[pos] == LongValue) {
+        /* promoted in place, as rt.err_type() does */
+        state->t[pos] = DoubleValue + (pc[0] & 1);
+        state->v[pos].dval = (double)IVAL(pos);
+    } else if (t[pos] != FloatValue && t[pos] != DoubleValue) {
+        FAIL(IERR_TYPE, pos, pc[0]);
+    }
+    NEXT(3);
+l_islong:      CHECK_TYPE(t[pos] == LongValue)
+l_isstr:       CHECK_TYPE(t[pos] == StringValue)
+l_isbin:       CHECK_TYPE(t[pos] == BinValue)
+l_isarray:     CHECK_TYPE(t[pos] == ArrayValue)
+l_ismap:       CHECK_TYPE(t[pos] == MapValue)
+l_isnul:       CHECK_TYPE(t[pos] == NilValue)
+l_isnulormap:  CHECK_TYPE(t[pos] == NilValue || t[pos] == MapValue)
+
+#undef CHECK_TYPE
+
+l_lenis:
+    pos = POS(pc[1], pc[2]);
+    if (XLEN(pos) != pc[3])
+        FAIL(IERR_LENGTH, pos, pc[3]);
+    NEXT(4);
+
+l_isset:
+    if (R[pc[1]] == 0)
+        FAIL(IERR_MISSING, POS(pc[2], pc[3]), pc[4]);
+    NEXT(5);
+
+l_isnotset:
+    if (R[pc[1]] != 0)
+        FAIL(IERR_DUPLICATE, R[pc[1]], 0);
+    NEXT(2);
+
+l_beginvar:
+    R[pc[1]] = 0;
+    NEXT(2);
+
+l_checkobuf: {
+    size_t need = OUT(pc[1]);
+    if (pc[2] != INTERP_NILREG)
+        need += (size_t)XLEN(POS(pc[2], pc[3])) * pc[4];
+    if (need > state->ot_capacity &&
+        schema_rt_buf_grow(state, need) != 0)
+        FAIL(IERR_NOMEM, 0, 0);
+    NEXT(5);
+}
+
+l_errvaluev:
+    FAIL(IERR_VALUE, POS(pc[1], pc[2]), 1);
+
+l_error:
+    FAIL(IERR_ERROR, 0, pc[1]);
+
+fail:
+    err[0] = kind;
+    err[1] = pos;
+    err[2] = arg;
+    rc = -1;
+done:
+    if (stack != local_stack)
+        free(stack);
+    return rc;
+
+#undef XOFF
+#undef XLEN
+#undef IVAL
+#undef OUT
+#undef FAIL
+#undef POS
+#undef JUMP
+#undef NEXT
+}
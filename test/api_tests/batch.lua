@@ -0,0 +1,103 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local msgpack = require('msgpack')
+
+local test = tap.test('batch-tests')
+
+test:plan(12)
+
+local _, foobar = schema.create({
+    name = 'FooBar',
+    type = 'record',
+    fields = {
+        { name = 'A', type = 'long' },
+        { name = 'B', type = {
+             name = 'nested',
+             type = 'record',
+             fields = {
+                { name = 'X', type = 'string' },
+                { name = 'Y', type = { type = 'array', items = 'int' }}
+             }
+        }},
+        { name = 'C', type = {'null', 'string'}}
+    }
+})
+local ok, methods = schema.compile(foobar)
+test:ok(ok, 'compile')
+
+local function gen_objects(n)
+    local res = {}
+    for i = 1, n do
+        local y = {}
+        for j = 1, i % 7 do y[j] = i * j end
+        res[i] = {
+            A = i,
+            B = { X = string.rep('x', i % 40), Y = y },
+            C = i % 3 == 0 and { string = tostring(i) } or msgpack.NULL
+        }
+    end
+    return res
+end
+
+-- concatenated results of the single-value routine
+local function convert_each(func, list)
+    local res = {}
+    for i, data in ipairs(list) do
+        local ok, r = func(data)
+        assert(ok, r)
+        res[i] = r
+    end
+    return table.concat(res)
+end
+
+local objects = {}
+for i, obj in ipairs(gen_objects(1000)) do
+    objects[i] = msgpack.encode(obj)
+end
+local tuples = {}
+for i, obj in ipairs(objects) do
+    _, tuples[i] = methods.flatten_msgpack(obj)
+end
+
+test:is_deeply({methods.flatten_msgpack_batch(table.concat(objects, '', 1, 3))},
+               {true, convert_each(methods.flatten_msgpack,
+                                   {unpack(objects, 1, 3)}), 3},
+               'flatten batch')
+test:is_deeply({methods.unflatten_msgpack_batch(table.concat(tuples, '', 1, 3))},
+               {true, convert_each(methods.unflatten_msgpack,
+                                   {unpack(tuples, 1, 3)}), 3},
+               'unflatten batch')
+-- spans several parse_msgpack_batch() calls
+test:is_deeply({methods.flatten_msgpack_batch(table.concat(objects))},
+               {true, table.concat(tuples), 1000},
+               'flatten large batch')
+test:is_deeply({methods.unflatten_msgpack_batch(table.concat(tuples))},
+               {true, convert_each(methods.unflatten_msgpack, tuples), 1000},
+               'unflatten large batch')
+test:is_deeply({methods.flatten_msgpack_batch('')}, {true, '', 0},
+               'empty batch')
+
+-- errors report the same message as the single-value routine
+local bad = msgpack.encode({ A = 'a', B = { X = '', Y = {} }, C = msgpack.NULL })
+local _, err = methods.flatten_msgpack(bad)
+test:is_deeply({methods.flatten_msgpack_batch(objects[1] .. objects[2] .. bad ..
+                                              objects[3])},
+               {false, err, 3}, 'flatten batch error')
+test:is_deeply({methods.flatten_msgpack_batch(table.concat(objects, '', 1, 300) ..
+                                              bad)},
+               {false, err, 301}, 'flatten batch error in a later chunk')
+_, err = methods.unflatten_msgpack(bad)
+test:is_deeply({methods.unflatten_msgpack_batch(tuples[1] .. bad)},
+               {false, err, 2}, 'unflatten batch error')
+test:is_deeply({methods.flatten_msgpack_batch(objects[1] ..
+                                              objects[2]:sub(1, -2))},
+               {false, 'Truncated data', 2}, 'truncated batch')
+test:is_deeply({methods.flatten_msgpack_batch(42)},
+               {false, 'Expecting a string', 1}, 'non-string batch')
+
+-- no batch mode with service fields
+_, methods = schema.compile({foobar, service_fields = {'int'}})
+test:is(methods.flatten_msgpack_batch, nil, 'no batch with service fields')
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
@@ -0,0 +1,81 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local fio     = require('fio')
+local bit     = require('bit')
+
+local test = tap.test('cache-tests')
+
+test:plan(10)
+
+local function create(default)
+    local _, res = schema.create({
+        name = 'FooBar',
+        type = 'record',
+        fields = {
+            { name = 'A', type = 'long' },
+            { name = 'B', type = 'string', default = default }
+        }
+    })
+    return res
+end
+
+local cache_dir = fio.tempdir()
+local function entries()
+    return fio.glob(cache_dir .. '/*.luac')
+end
+
+local foobar = create('b')
+local ok, methods = schema.compile({foobar, cache_dir = cache_dir})
+test:ok(ok, 'compile')
+test:is(#entries(), 1, 'entry stored')
+
+ok, methods = schema.compile({foobar, cache_dir = cache_dir})
+test:is_deeply({methods.flatten({ A = 1 })}, {true, {1, 'b'}}, 'entry loaded')
+
+-- the entry is used as is
+local path = entries()[1]
+local file = io.open(path, 'w')
+file:write('return function() error("stale", 0) end')
+file:close()
+test:is_deeply({pcall(schema.compile, {foobar, cache_dir = cache_dir})},
+               {false, 'stale'}, 'entry used')
+
+-- a broken entry is replaced
+file = io.open(path, 'w')
+file:write('garbage')
+file:close()
+ok, methods = schema.compile({foobar, cache_dir = cache_dir})
+test:is_deeply({methods.flatten({ A = 1 })}, {true, {1, 'b'}}, 'broken entry')
+
+-- entries are private, others' ones are refused
+test:is(bit.band(fio.stat(path).mode, tonumber('777', 8)), tonumber('600', 8),
+        'entry mode')
+fio.chmod(path, tonumber('666', 8))
+test:is_deeply({pcall(schema.compile, {foobar, cache_dir = cache_dir})},
+               {false, 'cache_dir: Unsafe path: ' .. path}, 'unsafe entry')
+fio.chmod(path, tonumber('600', 8))
+
+-- a missing directory is created private
+local sub_dir = cache_dir .. '/sub'
+ok, methods = schema.compile({foobar, cache_dir = sub_dir})
+test:is(bit.band(fio.stat(sub_dir).mode, tonumber('777', 8)),
+        tonumber('700', 8), 'directory created')
+for _, path in ipairs(fio.glob(sub_dir .. '/*')) do
+    fio.unlink(path)
+end
+fio.rmdir(sub_dir)
+
+-- defaults and options are part of the key
+schema.compile({create('c'), cache_dir = cache_dir})
+schema.compile({foobar, cache_dir = cache_dir, service_fields = {'int'}})
+test:is(#entries(), 3, 'distinct entries')
+ok, methods = schema.compile({create('c'), cache_dir = cache_dir})
+test:is_deeply({methods.flatten({ A = 1 })}, {true, {1, 'c'}}, 'default')
+
+for _, path in ipairs(fio.glob(cache_dir .. '/*')) do
+    fio.unlink(path)
+end
+fio.rmdir(cache_dir)
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
@@ -0,0 +1,51 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local msgpack = require('msgpack')
+
+local test = tap.test('check-flat-tests')
+
+test:plan(12)
+
+local _, rec = schema.create({
+    name = 'rec',
+    type = 'record',
+    fields = {
+        { name = 'id', type = 'long' },
+        { name = 'tags', type = { type = 'array', items = 'string' }},
+        { name = 'kind', type = { type = 'enum', name = 'kind',
+                                  symbols = { 'A', 'B' }}},
+        { name = 'next', type = { 'null', 'rec' }}
+    }
+})
+
+local obj = { id = 1, tags = {'a'}, kind = 'B', next = {
+    rec = { id = 2, tags = {}, kind = 'A', next = msgpack.NULL }}}
+
+for _, backend in ipairs({'lua', 'interp', 'native'}) do
+    local _, m = schema.compile({rec, backend = backend,
+                                 service_fields = {'string'}})
+    local _, tuple = m.flatten_msgpack(obj, 'sf')
+    test:is_deeply({m.check_flat(tuple)}, {true}, backend .. ': valid')
+    test:is_deeply({m.check_flat(msgpack.decode(tuple))}, {true},
+                   backend .. ': Lua input')
+    -- same checks as unflatten
+    local cases = {
+        {'sf', 1, {'a', 1}, 0, 0, msgpack.NULL},
+        {'sf', 1, {}, 5, 0, msgpack.NULL},
+        {1, 1, {}, 0, 0, msgpack.NULL},
+        {'sf', 1, {}, 0, 0},
+        {'sf', 1, {}, 0, 1, {2, {}, 0, 0, 'x'}}
+    }
+    local errors, expected = {}, {}
+    for i, t in ipairs(cases) do
+        errors[i] = {m.check_flat(t)}
+        expected[i] = {m.unflatten(t)}
+    end
+    test:is_deeply(errors, expected, backend .. ': errors')
+    test:is_deeply({m.check_flat(cases[1])},
+                   {false, '3/2: Expecting STR, encountered LONG'},
+                   backend .. ': location')
+end
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
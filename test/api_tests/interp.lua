@@ -0,0 +1,78 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local msgpack = require('msgpack')
+
+local test = tap.test('interp-tests')
+
+test:plan(8)
+
+local _, node = schema.create({
+    name = 'node',
+    type = 'record',
+    fields = {
+        { name = 'next', type = {'null', 'node'}},
+        { name = 'label', type = 'string' },
+        { name = 'weight', type = 'double', default = 0.1 }
+    }
+})
+local _, lua = schema.compile(node)
+local ok, interp = schema.compile({node, backend = 'interp'})
+test:ok(ok, 'compile')
+
+-- a deep list grows the interpreter stack
+local list = msgpack.NULL
+for i = 1, 2000 do
+    list = { node = { next = list, label = tostring(i), weight = i }}
+end
+local data = msgpack.encode(list.node)
+local _, tuple = lua.flatten_msgpack(data)
+test:is_deeply({interp.flatten_msgpack(data)}, {true, tuple}, 'flatten')
+test:is_deeply({interp.unflatten_msgpack(tuple)},
+               {lua.unflatten_msgpack(tuple)}, 'unflatten')
+test:is_deeply({interp.flatten({ label = 'a', next = { node = {}}})},
+               {lua.flatten({ label = 'a', next = { node = {}}})}, 'error')
+
+local state = schema.state_acquire()
+test:is_deeply({interp.bind(state).flatten_msgpack_batch(data .. data)},
+               {true, tuple .. tuple, 2}, 'bound batch')
+schema.state_release(state)
+
+local _, sf = schema.compile({node, backend = 'interp',
+                              service_fields = {'string', 'int'}})
+test:is_deeply({sf.unflatten({'x', 42, 0, msgpack.NULL, 'a', 1.5})},
+               {true, { label = 'a', next = msgpack.NULL, weight = 1.5 },
+                'x', 42}, 'service fields')
+
+-- messages below 64K are parsed into the compact layout, integers
+-- beyond 31 bits and doubles take the overflow slot; errors are
+-- reported from the general layout
+local _, nums = schema.create({
+    name = 'nums', type = 'record', fields = {
+        { name = 'a', type = { type = 'array', items = 'long' }},
+        { name = 'i', type = 'int' },
+        { name = 'd', type = 'double' }
+    }
+})
+local longs = { 0, -1, 2^30 - 1, 2^30, -2^30, -2^30 - 1, 2^31, -2^53, 2^53 }
+local wide = {}
+for i = 1, 10000 do wide[i] = longs[i % #longs + 1] end
+local _, nums_lua = schema.compile(nums)
+local _, nums_interp = schema.compile({nums, backend = 'interp'})
+local res, expected = {}, {}
+for i, input in ipairs({
+    { a = longs, i = -2^31, d = 3 },
+    { a = longs, i = 2^31, d = 0.5 },
+    { a = longs, i = 1, d = 'x' },
+    { a = wide, i = 2^31 - 1, d = 1 }
+}) do
+    local data = msgpack.encode(input)
+    res[i] = {nums_interp.flatten_msgpack(data)}
+    expected[i] = {nums_lua.flatten_msgpack(data)}
+end
+test:is_deeply(res, expected, 'compact layout')
+
+test:is_deeply({pcall(schema.compile, {node, backend = 'c++'})},
+               {false, 'backend: Invalid backend: c++'}, 'invalid backend')
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
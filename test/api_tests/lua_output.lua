@@ -0,0 +1,86 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local msgpack = require('msgpack')
+local ffi     = require('ffi')
+
+local test = tap.test('lua-output-tests')
+
+test:plan(9)
+
+-- flatten() / unflatten() build the result from the runtime state,
+-- it must match the decoded output of the _msgpack counterparts
+local _, rec = schema.create({
+    name = 'rec',
+    type = 'record',
+    fields = {
+        { name = 'a', type = 'long' },
+        { name = 'f', type = 'float' },
+        { name = 'd', type = 'double' },
+        { name = 's', type = 'string' },
+        { name = 'n', type = 'null' },
+        { name = 'o', type = 'long*' },
+        { name = 'u', type = { 'null', 'string', 'long' }},
+        { name = 'e', type = { type = 'enum', name = 'E',
+                               symbols = { 'X', 'Y' }}},
+        { name = 'm', type = { type = 'map', values = {
+            type = 'array', items = 'long' }}},
+        { name = 'def', type = 'string', default = 'zz' }
+    }
+})
+local _, m = schema.compile({rec})
+
+-- compares types as well, e.g. 1 and 1ULL differ
+local function same(a, b)
+    if type(a) ~= type(b) then return false end
+    if type(a) ~= 'table' then return tostring(a) == tostring(b) end
+    for k, v in pairs(a) do
+        if not same(v, b[k]) then return false end
+    end
+    for k in pairs(b) do
+        if type(a[k]) == 'nil' then return false end
+    end
+    return true
+end
+
+for i, obj in ipairs({
+    { a = -2^60, f = 1.1, d = 1.1, s = 'x', n = msgpack.NULL,
+      o = msgpack.NULL, u = { string = 'q' }, e = 'Y', m = { k = {1, 2} }},
+    { a = 2^62, f = 3, d = -0.5, s = '', n = msgpack.NULL, o = 5,
+      u = { long = 7 }, e = 'X', m = { z = {} }},
+    { a = ffi.new('int64_t', 9007199254740993LL), f = 0, d = 0, s = 's',
+      n = msgpack.NULL, o = msgpack.NULL, u = msgpack.NULL, e = 'X',
+      m = { a = {}, b = {-1} }}
+}) do
+    local _, tuple = m.flatten(obj)
+    local _, data = m.flatten_msgpack(obj)
+    test:ok(same(tuple, msgpack.decode(data)), 'flatten ' .. i)
+    local _, res = m.unflatten(tuple)
+    _, data = m.unflatten_msgpack(tuple)
+    test:ok(same(res, msgpack.decode(data)), 'unflatten ' .. i)
+end
+
+-- so do the metatables (msgpack.cfg.decode_save_metatables)
+local obj = { a = 1, f = 0, d = 0, s = '', n = msgpack.NULL,
+              o = msgpack.NULL, u = msgpack.NULL, e = 'X', m = { k = {} }}
+local _, tuple = m.flatten(obj)
+local _, data = m.flatten_msgpack(obj)
+local same_mt = getmetatable(tuple) == getmetatable(msgpack.decode(data))
+local _, res = m.unflatten(tuple)
+_, data = m.unflatten_msgpack(tuple)
+local decoded = msgpack.decode(data)
+test:ok(same_mt and getmetatable(res) == getmetatable(decoded) and
+        getmetatable(res.m.k) == getmetatable(decoded.m.k), 'metatables')
+
+-- string service fields are referenced by a pointer
+local _, sf = schema.compile({rec, service_fields = {'long', 'string'}})
+_, tuple = sf.flatten(obj, 42, 'sf')
+_, data = sf.flatten_msgpack(obj, 42, 'sf')
+test:ok(same(tuple, msgpack.decode(data)), 'service fields')
+
+-- a long following a string lands after the string's two slots
+_, sf = schema.compile({rec, service_fields = {'string', 'long'}})
+_, tuple = sf.flatten(obj, 'sf', 42)
+test:is_deeply({tuple[1], tuple[2]}, {'sf', 42}, 'string, long service fields')
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
@@ -0,0 +1,67 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local msgpack = require('msgpack')
+local buffer  = require('buffer')
+local ffi     = require('ffi')
+
+local test = tap.test('msgpack-to-tests')
+
+test:plan(11)
+
+local _, rec = schema.create({
+    name = 'rec',
+    type = 'record',
+    fields = {
+        { name = 'id', type = 'long' },
+        { name = 'name', type = 'string' }
+    }
+})
+local _, m = schema.compile({rec, service_fields = {'int'}})
+
+local obj = { id = 1, name = 'foo' }
+local data = msgpack.encode(obj)
+local _, tuple = m.flatten_msgpack(data, 42)
+
+local ibuf = buffer.ibuf()
+test:is_deeply({m.flatten_msgpack_to(ibuf, data, 42)}, {true, #tuple},
+               'flatten into ibuf')
+test:is_deeply({m.flatten_msgpack_to(ibuf, obj, 42)}, {true, #tuple},
+               'appended')
+test:is(ffi.string(ibuf.rpos, ibuf.wpos - ibuf.rpos), tuple .. tuple,
+        'ibuf contents')
+
+-- larger than the space reserved up front
+local big = { id = 2, name = string.rep('x', 100000) }
+local _, big_tuple = m.flatten_msgpack(big, 42)
+ibuf = buffer.ibuf()
+m.flatten_msgpack_to(ibuf, big, 42)
+test:is(ffi.string(ibuf.rpos, ibuf.wpos - ibuf.rpos), big_tuple,
+        'large output')
+
+-- the space reserved follows the output, not the largest one so far
+ibuf = buffer.ibuf()
+m.flatten_msgpack_to(ibuf, data, 42)
+test:ok(ibuf.epos - ibuf.buf < #big_tuple, 'reserve follows the output')
+
+local buf = ffi.new('char[?]', 64)
+test:is_deeply({m.unflatten_msgpack_to(buf, 64, tuple)}, {true, #data, 42},
+               'unflatten into a pointer')
+test:is_deeply(msgpack.decode(ffi.string(buf, #data)), obj,
+               'pointer contents')
+test:is_deeply({m.flatten_msgpack_to(buf, #tuple, data, 42)},
+               {true, #tuple}, 'exact capacity')
+test:is_deeply({m.flatten_msgpack_to(buf, 64, big, 42)},
+               {true, #big_tuple}, 'capacity exceeded')
+
+-- the output that didn't fit stays within the capacity
+local guarded = ffi.new('char[?]', 128)
+ffi.fill(guarded, 128, 0xaa)
+m.flatten_msgpack_to(guarded, 64, big, 42)
+test:is(ffi.string(guarded + 64, 64), string.rep('\xaa', 64),
+        'nothing written past the capacity')
+test:is_deeply({m.flatten_msgpack_to('buf', data, 42)},
+               {false, 'Expecting an ibuf or a pointer and a capacity'},
+               'invalid buffer')
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
@@ -0,0 +1,140 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local msgpack = require('msgpack')
+local fio     = require('fio')
+
+local test = tap.test('native-tests')
+
+test:plan(12)
+
+local _, node = schema.create({
+    name = 'node',
+    type = 'record',
+    fields = {
+        { name = 'next', type = {'null', 'node'}},
+        { name = 'label', type = 'string' },
+        { name = 'color', type = { type = 'enum', name = 'color',
+                                   symbols = {'RED', 'GREEN', 'BLUE'}}},
+        { name = 'weight', type = 'double', default = 0.1 }
+    }
+})
+local cache_dir = fio.tempdir()
+local _, lua = schema.compile(node)
+local ok, native = schema.compile({node, backend = 'native',
+                                   cache_dir = cache_dir})
+test:ok(ok, 'compile')
+test:is(#fio.glob(cache_dir .. '/*.so'), 1, 'shared object cached')
+schema.compile({node, backend = 'native', cache_dir = cache_dir})
+test:is(#fio.glob(cache_dir .. '/*.so'), 1, 'cache hit')
+
+local list = msgpack.NULL
+for i = 1, 500 do
+    list = { node = { next = list, label = tostring(i),
+                      color = i % 2 == 0 and 'RED' or 'BLUE', weight = i }}
+end
+local data = msgpack.encode(list.node)
+local _, tuple = lua.flatten_msgpack(data)
+test:is_deeply({native.flatten_msgpack(data)}, {true, tuple}, 'flatten')
+test:is_deeply({native.unflatten_msgpack(tuple)},
+               {lua.unflatten_msgpack(tuple)}, 'unflatten')
+local bad = { label = 'a', color = 'PINK', next = msgpack.NULL }
+test:is_deeply({native.flatten(bad)}, {lua.flatten(bad)}, 'error')
+test:is_deeply({native.flatten_msgpack_batch(data .. data)},
+               {true, tuple .. tuple, 2}, 'batch')
+
+local _, sf = schema.compile({node, backend = 'native', cache_dir = cache_dir,
+                              service_fields = {'string', 'int'}})
+test:is_deeply({sf.unflatten({'x', 42, 0, msgpack.NULL, 'a', 2, 1.5})},
+               {true, { label = 'a', color = 'BLUE', next = msgpack.NULL,
+                        weight = 1.5 }, 'x', 42}, 'service fields')
+
+-- fields in the schema order are predicted, other orders, duplicate and
+-- unknown keys fall back to the generic dispatch
+local function map(...)
+    local res = { string.char(0x80 + select('#', ...) / 2) }
+    for i = 1, select('#', ...) do
+        table.insert(res, msgpack.encode((select(i, ...))))
+    end
+    return table.concat(res)
+end
+local inputs = {
+    map('next', msgpack.NULL, 'label', 'a', 'color', 'RED', 'weight', 1.5),
+    map('weight', 1.5, 'color', 'RED', 'label', 'a', 'next', msgpack.NULL),
+    map('next', msgpack.NULL, 'label', 'a', 'label', 'b', 'color', 'RED'),
+    map('next', msgpack.NULL, 'label', 'a', 'labels', 'b', 'color', 'RED'),
+    map('next', msgpack.NULL, 'color', 'RED')
+}
+local _, nopred = schema.compile({node, backend = 'native',
+                                  cache_dir = cache_dir,
+                                  enable_field_prediction = false})
+local res, expected = {}, {}
+for i, input in ipairs(inputs) do
+    res[i] = {{native.flatten_msgpack(input)}, {nopred.flatten_msgpack(input)}}
+    local ok, tuple = lua.flatten_msgpack(input)
+    expected[i] = {{ok, tuple}, {ok, tuple}}
+end
+test:is_deeply(res, expected, 'field order prediction')
+
+-- messages below 64K are parsed into the compact layout, integers
+-- beyond 31 bits and doubles take the overflow slot; errors are
+-- reported from the general layout
+local _, nums = schema.create({
+    name = 'nums', type = 'record', fields = {
+        { name = 'a', type = { type = 'array', items = 'long' }},
+        { name = 'i', type = 'int' },
+        { name = 'd', type = 'double' }
+    }
+})
+local longs = { 0, -1, 2^30 - 1, 2^30, -2^30, -2^30 - 1, 2^31, -2^53, 2^53 }
+local wide = {}
+for i = 1, 10000 do wide[i] = longs[i % #longs + 1] end
+local _, nums_lua = schema.compile(nums)
+local _, nums_native = schema.compile({nums, backend = 'native',
+                                       cache_dir = cache_dir})
+local res, expected = {}, {}
+for i, input in ipairs({
+    { a = longs, i = -2^31, d = 3 },
+    { a = longs, i = 2^31, d = 0.5 },
+    { a = longs, i = 1, d = 'x' },
+    { a = wide, i = 2^31 - 1, d = 1 }
+}) do
+    local data = msgpack.encode(input)
+    res[i] = {nums_native.flatten_msgpack(data)}
+    expected[i] = {nums_lua.flatten_msgpack(data)}
+end
+test:is_deeply(res, expected, 'compact layout')
+
+-- without cache_dir objects go to a private directory
+local ok, default = schema.compile({node, backend = 'native'})
+test:is_deeply({ok, default.flatten_msgpack(data)}, {true, true, tuple},
+               'private directory')
+
+-- paths are quoted for the shell, objects others can write to are
+-- refused
+local quoted = cache_dir .. "/it's"
+fio.mkdir(quoted, tonumber('700', 8))
+local res = {}
+res[1] = schema.compile({node, backend = 'native', cache_dir = quoted})
+local object = fio.glob(quoted .. '/*.so')[1]
+fio.chmod(object, tonumber('777', 8))
+res[2], res[3] = pcall(schema.compile, {node, backend = 'native',
+                                        cache_dir = quoted})
+fio.chmod(object, tonumber('755', 8))
+fio.chmod(quoted, tonumber('777', 8))
+res[4], res[5] = pcall(schema.compile, {node, backend = 'native',
+                                        cache_dir = quoted})
+test:is_deeply(res, {true, false, 'native: Unsafe object path: ' .. object,
+                     false, 'cache_dir: Unsafe path: ' .. quoted},
+               'object path checks')
+
+for _, path in ipairs(fio.glob(quoted .. '/*')) do
+    fio.unlink(path)
+end
+fio.rmdir(quoted)
+for _, path in ipairs(fio.glob(cache_dir .. '/*')) do
+    fio.unlink(path)
+end
+fio.rmdir(cache_dir)
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
@@ -0,0 +1,111 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local fio     = require('fio')
+
+local test = tap.test('profile-tests')
+
+test:plan(9)
+
+local _, rec = schema.create({
+    name = 'rec',
+    type = 'record',
+    fields = {
+        { name = 'id', type = 'long' },
+        { name = 'u', type = {'null', 'int', 'string',
+                              { type = 'array', items = 'int' }}}
+    }
+})
+
+local _, plain = schema.compile(rec)
+test:is(plain.profile, nil, 'no profile by default')
+
+local _, m = schema.compile({rec, profile = true})
+for i = 1, 100 do
+    m.flatten({ id = i, u = i % 10 == 0 and { int = i } or { string = 'x' }})
+end
+m.unflatten({1, 3, {1, 2}})
+local profile = m.profile()
+-- conditionals are numbered in the order met, flatten first: the
+-- record key, the union null check and the union branch name
+test:is_deeply({profile[1], profile[2], profile[3]},
+               {{ id = 100, u = 100 }, { [0] = 100, [1] = 0 },
+                { int = 10, string = 90, array = 0 }}, 'hits counted')
+
+-- arms ordered by the hit count
+local dir = fio.tempdir()
+local _, pgo = schema.compile({rec, profile = profile,
+                               dump_src = dir .. '/pgo.lua'})
+local src = io.open(dir .. '/pgo.lua'):read('*a')
+os.remove(dir .. '/pgo.lua')
+fio.rmdir(dir)
+local unflatten_src = src:match('local function unflatten.*')
+local arms = {}
+for ci in unflatten_src:gmatch('r%.v%[[^%]]+%]%.ival == (%d+) then') do
+    table.insert(arms, tonumber(ci))
+end
+test:is_deeply({arms[1], arms[2], arms[3], arms[4]}, {3, 0, 1, 2},
+               'hot arm first')
+test:is(pgo.profile, nil, 'no counters in a profile-guided build')
+
+local input = { id = 1, u = { string = 'x' }}
+test:is_deeply({pgo.flatten(input)}, {plain.flatten(input)}, 'flatten')
+test:is_deeply({pgo.unflatten({1, 3, {1, 2}})},
+               {plain.unflatten({1, 3, {1, 2}})}, 'unflatten')
+
+-- nested conditionals keep their numbers when the arms move: records
+-- in a union, each with a nullable field of its own
+local nullable = {'null', 'int', 'string'}
+local _, urec = schema.create({
+    name = 'urec',
+    type = 'record',
+    fields = {
+        { name = 'u', type = {
+            { name = 'a', type = 'record',
+              fields = {{ name = 'x', type = nullable }}},
+            { name = 'b', type = 'record',
+              fields = {{ name = 'y', type = nullable }}}}}
+    }
+})
+local _, um = schema.compile({urec, profile = true})
+for _ = 1, 10 do um.unflatten({0, {2, 'x'}}) end
+for _ = 1, 30 do um.unflatten({1, {1, 5}}) end
+profile = um.profile()
+-- the number of the conditional with exactly these hits, if any
+local function find(hits)
+    for ci, branches in pairs(profile) do
+        local same = true
+        for k, n in pairs(branches) do
+            if hits[k] ~= n then same = false end
+        end
+        for k in pairs(hits) do
+            if branches[k] == nil then same = false end
+        end
+        if same then return ci end
+    end
+end
+local union = find({ [0] = 10, [1] = 30 })
+local x = find({ [0] = 0, [1] = 0, [2] = 10 })
+local y = find({ [0] = 0, [1] = 30, [2] = 0 })
+test:ok(union and x and y and x ~= y, 'nested hits counted')
+
+dir = fio.tempdir()
+schema.compile({urec, profile = profile, dump_src = dir .. '/pgo.lua'})
+src = io.open(dir .. '/pgo.lua'):read('*a')
+os.remove(dir .. '/pgo.lua')
+fio.rmdir(dir)
+arms = {}
+for ci in src:match('local function unflatten.*'):gmatch(
+        'r%.v%[[^%]]+%]%.ival == (%d+) then') do
+    table.insert(arms, tonumber(ci))
+end
+-- b, its y arms (int first), a, its x arms (string first)
+test:is_deeply({unpack(arms, 1, 8)}, {1, 1, 0, 2, 0, 2, 0, 1},
+               'nested arms ordered by their own hits')
+
+test:is_deeply({pcall(schema.compile, {rec, backend = 'interp',
+                                       profile = true})},
+               {false, 'profile: Not supported by the interp backend'},
+               'other backends')
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
@@ -0,0 +1,66 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local msgpack = require('msgpack')
+local fio     = require('fio')
+
+local test = tap.test('span-tests')
+
+test:plan(10)
+
+local _, rec = schema.create({
+    name = 'rec',
+    type = 'record',
+    fields = {
+        { name = 'id', type = 'long' },
+        { name = 'tags', type = { type = 'array', items = 'string' }},
+        { name = 'attrs', type = { type = 'map', values = 'long*' }},
+        { name = 'grid', type = { type = 'array', items = {
+            type = 'array', items = 'long' }}}
+    }
+})
+
+local dir = fio.tempdir()
+local _, lua = schema.compile({rec, dump_il = dir .. '/rec.il'})
+local il = io.open(dir .. '/rec.il'):read('*a')
+os.remove(dir .. '/rec.il')
+fio.rmdir(dir)
+-- tags, attrs and grid elements in flatten, unflatten and xflatten
+test:is(select(2, il:gsub('PUTSPAN', '')), 9, 'arrays and maps of scalars')
+
+-- array 16 holding 2 items, copied as is
+local tags = '\xdc\x00\x02\xa1a\xd9\x01b'
+local data = '\x84\xa2id\x01\xa4tags' .. tags ..
+             '\xa5attrs' .. msgpack.encode({ x = 1 }) ..
+             '\xa4grid' .. msgpack.encode({{1, 2}, {}})
+local ok, tuple = lua.flatten_msgpack(data)
+test:ok(ok and tuple:find(tags, 1, true), 'verbatim')
+test:is_deeply(msgpack.decode(tuple),
+               {1, {'a', 'b'}, { x = 1 }, {{1, 2}, {}}}, 'flatten')
+test:is_deeply({lua.unflatten(msgpack.decode(tuple))},
+               {true, { id = 1, tags = {'a', 'b'}, attrs = { x = 1 },
+                        grid = {{1, 2}, {}}}}, 'unflatten')
+test:is_deeply({lua.flatten({ id = 1, tags = {'a', 2}, attrs = { x = 1 },
+                              grid = {}})},
+               {false, 'tags/2: Expecting STR, encountered LONG'},
+               'elements checked')
+test:is_deeply({lua.flatten({ id = 1, tags = {}, attrs = { x = 'y' },
+                              grid = {}})},
+               {false, 'attrs/x: Expecting LONG, encountered STR'},
+               'values checked')
+
+local stream = schema.stream()
+stream:feed(data:sub(1, 10))
+stream:feed(data:sub(11))
+test:is_deeply({lua.flatten_msgpack(stream)}, {true, tuple}, 'stream')
+test:is_deeply({lua.flatten_msgpack_batch(data .. data)},
+               {true, tuple .. tuple, 2}, 'batch')
+
+for _, backend in ipairs({'interp', 'native'}) do
+    local _, m = schema.compile({rec, backend = backend})
+    local ok, res = m.flatten_msgpack(data)
+    test:is_deeply({ok, res, m.flatten_msgpack_batch(data)},
+                   {true, tuple, true, tuple, 1}, backend)
+end
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
@@ -0,0 +1,56 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local msgpack = require('msgpack')
+
+local test = tap.test('state-tests')
+
+test:plan(9)
+
+local _, foobar = schema.create({
+    name = 'FooBar',
+    type = 'record',
+    fields = {
+        { name = 'A', type = 'long' },
+        { name = 'B', type = { type = 'array', items = 'string' }},
+        { name = 'C', type = {'null', 'string'}}
+    }
+})
+local _, methods = schema.compile(foobar)
+
+local obj = { A = 42, B = { 'foo', 'bar' }, C = { string = 'baz' }}
+local data = msgpack.encode(obj)
+local _, tuple = methods.flatten_msgpack(data)
+
+local state = schema.state_acquire()
+local bound = methods.bind(state)
+test:is_deeply({bound.flatten_msgpack(data)}, {true, tuple},
+               'flatten_msgpack')
+test:is_deeply({bound.unflatten(tuple)}, {methods.unflatten(tuple)},
+               'unflatten')
+test:is_deeply({bound.flatten_msgpack_batch(data .. data)},
+               {true, tuple .. tuple, 2}, 'flatten_msgpack_batch')
+test:is_deeply({bound.flatten({ A = 'a' })}, {methods.flatten({ A = 'a' })},
+               'error')
+
+-- a huge value doesn't grow the shared state, table input bank
+-- included
+local before = schema.runtime_stats()
+local huge = { A = 1, B = {}, C = msgpack.NULL }
+for i = 1, 100000 do huge.B[i] = 'x' end
+local ok = bound.flatten(huge)
+local after = schema.runtime_stats()
+test:ok(ok and after.bytes == before.bytes and
+        after.tbank_capacity == before.tbank_capacity, 'isolated buffers')
+
+test:is(bound.bind(schema.state_acquire()).flatten_msgpack(data), true,
+        'bind a bound')
+schema.state_release(state)
+test:is(schema.state_acquire(), state, 'reuse a released state')
+test:is_deeply({pcall(methods.bind, {})}, {false, 'bind: Expecting a state'},
+               'bind a non-state')
+test:is_deeply({pcall(schema.state_release, 42)},
+               {false, 'state_release: Expecting a state'},
+               'release a non-state')
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
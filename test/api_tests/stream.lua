@@ -0,0 +1,78 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local msgpack = require('msgpack')
+
+local test = tap.test('stream-tests')
+
+test:plan(15)
+
+local _, foobar = schema.create({
+    name = 'FooBar',
+    type = 'record',
+    fields = {
+        { name = 'A', type = 'long' },
+        { name = 'B', type = 'string' },
+        { name = 'C', type = { type = 'array', items = {
+            name = 'nested',
+            type = 'record',
+            fields = {
+                { name = 'X', type = 'double' },
+                { name = 'Y', type = { type = 'map', values = 'string' }}
+            }
+        }}}
+    }
+})
+local _, methods = schema.compile(foobar)
+
+local obj = {
+    A = -100000,
+    B = string.rep('b', 300),
+    C = {
+        { X = 1.5, Y = { foo = 'bar', baz = string.rep('q', 70000) }},
+        { X = 2.5, Y = { [''] = 'empty' }},
+        { X = 3.5, Y = { [string.rep('k', 40)] = '' }}
+    }
+}
+local data = msgpack.encode(obj)
+local ok, expected = methods.flatten_msgpack(data)
+assert(ok, expected)
+
+-- feed data in chunks of the given size
+local function feed(stream, data, size)
+    local ok, complete, pending
+    for i = 1, #data, size do
+        ok, complete, pending = stream:feed(data:sub(i, i + size - 1))
+        if not ok or complete then break end
+        -- conversions in between don't interfere
+        methods.flatten_msgpack(data)
+    end
+    return ok, complete, pending
+end
+
+local stream = schema.stream()
+for _, size in ipairs({1, 2, 3, 7, 64, 1000, #data}) do
+    local ok, complete, pending = feed(stream, data, size)
+    test:is_deeply({ok, complete, pending, methods.flatten_msgpack(stream)},
+                   {true, true, 0, true, expected},
+                   'chunk size ' .. size)
+end
+
+test:is_deeply({feed(stream, data .. '\x01\x02', 100000)},
+               {true, true, 2}, 'pending')
+test:is_deeply({stream:feed('')}, {true, true, 1}, 'pending value')
+test:is_deeply({stream:feed('')}, {true, true, 0}, 'another one')
+
+-- a chunk spanning two values, the second one arrives in pieces
+stream:feed(data .. data:sub(1, 1000))
+test:is_deeply({feed(stream, data:sub(1001), 7)},
+               {true, true, 0}, 'value continued')
+test:is_deeply({methods.flatten_msgpack(stream)}, {true, expected},
+               'value continued, result')
+test:is_deeply({stream:feed(data:sub(1, 10))}, {true, false}, 'need more')
+test:is_deeply({methods.flatten_msgpack(stream)}, {false, 'Incomplete data'},
+               'incomplete')
+test:is_deeply({feed(schema.stream(), '\x92\x01\xc1', 1)},
+               {false, 'Invalid data'}, 'invalid data')
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
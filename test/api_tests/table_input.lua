@@ -0,0 +1,51 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local msgpack = require('msgpack')
+local ffi     = require('ffi')
+
+local test = tap.test('table-input-tests')
+
+test:plan(8)
+
+-- Lua tables are stored to the runtime state directly, the result
+-- must match the one for msgpack.encode()-d input
+local _, rec = schema.create({
+    name = 'rec',
+    type = 'record',
+    fields = {
+        { name = 'id', type = 'long' },
+        { name = 'name', type = 'string' },
+        { name = 'tags', type = { type = 'array', items = 'string' }},
+        { name = 'nums', type = { type = 'array', items = 'long' }},
+        { name = 'attrs', type = { type = 'map', values = 'double' }}
+    }
+})
+local _, m = schema.compile({rec})
+
+local function check(obj, name)
+    test:is_deeply({m.flatten_msgpack(obj)},
+                   {m.flatten_msgpack(msgpack.encode(obj))}, name)
+end
+
+check({ id = 1, name = 'foo', tags = {'a', string.rep('b', 300)},
+        nums = {1, -1, 300, -300, 2^40, -2^40}, attrs = { x = 0.5 }},
+      'table')
+check({ id = ffi.new('int64_t', -2^62), name = '', tags = {},
+        nums = {ffi.new('uint64_t', 5), ffi.new('int64_t', -5)},
+        attrs = {}}, 'int64 cdata')
+check({ id = 1, name = 'foo', tags = {'a', 2}, nums = {},
+        attrs = { x = 1 }}, 'error')
+check({ id = 1, name = 'foo', tags = {}, nums = {},
+        attrs = { x = 'y' }}, 'error in a map')
+-- msgpack.encode() consults the metatable
+check({ id = 1, name = 'foo', tags = setmetatable({}, { __serialize = 'seq' }),
+        nums = {}, attrs = { x = 1 }}, 'metatable')
+check({ id = 1, name = 'foo', tags = {[1] = 'a', [3] = 'c'},
+        nums = {}, attrs = { x = 1 }}, 'sparse array')
+check({ id = 1, name = 'foo', tags = {'a', 'b', [4] = 'd'},
+        nums = {}, attrs = { x = 1 }}, 'sparse array, key past the border')
+check({ id = 1, name = 'foo', tags = {[2] = 'b'},
+        nums = {}, attrs = { x = 1 }}, 'sparse array, no border')
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
@@ -0,0 +1,52 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local msgpack = require('msgpack')
+
+local test = tap.test('tuple-tests')
+
+test:plan(11)
+
+local _, rec = schema.create({
+    name = 'rec',
+    type = 'record',
+    fields = {
+        { name = 'id', type = 'long' },
+        { name = 'tags', type = { type = 'array', items = 'string' }}
+    }
+})
+local _, m = schema.compile({rec, service_fields = {'int'}})
+
+local obj = { id = 1, tags = {'a', 'b'} }
+local _, expected = m.flatten_msgpack(obj, 42)
+
+local ok, tuple = m.flatten_tuple(obj, 42)
+test:ok(ok and box.tuple.is(tuple), 'tuple')
+test:is_deeply(tuple:totable(), msgpack.decode(expected), 'contents')
+test:is(tuple:bsize(), #expected, 'same data')
+ok, tuple = m.flatten_tuple(msgpack.encode(obj), 42)
+test:is_deeply(tuple:totable(), {42, 1, {'a', 'b'}}, 'msgpack input')
+test:is_deeply({m.flatten_tuple({ id = 'x', tags = {} }, 42)},
+               {false, 'id: Expecting LONG, encountered STR'}, 'error')
+
+-- tuple input is parsed as is
+_, tuple = m.flatten_tuple(obj, 42)
+test:is_deeply({m.unflatten(tuple)}, {true, obj, 42}, 'unflatten a tuple')
+local _, data = m.unflatten_msgpack(tuple)
+test:is_deeply(msgpack.decode(data), obj, 'unflatten_msgpack a tuple')
+local big = { id = 2, tags = {string.rep('x', 100000)} }
+_, tuple = m.flatten_tuple(big, 42)
+test:is_deeply({m.unflatten(tuple)}, {true, big, 42}, 'large tuple')
+test:is_deeply({m.check_flat(tuple)}, {true}, 'check_flat a tuple')
+
+-- the copy of tuple data is shrunk along with the buffers
+test:ok(schema.runtime_stats().tuple_data_capacity >= tuple:bsize(),
+        'tuple data grows')
+_, tuple = m.flatten_tuple(obj, 42)
+schema.runtime_cfg({retain = 64 * 1024, trim_after = 3})
+for _ = 1, 3 do m.unflatten(tuple) end
+test:ok(schema.runtime_stats().tuple_data_capacity < 64 * 1024,
+        'tuple data trimmed')
+schema.runtime_cfg({})
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
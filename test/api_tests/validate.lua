@@ -0,0 +1,68 @@
+local schema  = require('avro_schema')
+local tap     = require('tap')
+local msgpack = require('msgpack')
+
+local test = tap.test('validate-tests')
+
+test:plan(15)
+
+local _, rec = schema.create({
+    name = 'rec',
+    type = 'record',
+    fields = {
+        { name = 'id', type = 'long' },
+        { name = 'tags', type = { type = 'array', items = 'string' }},
+        { name = 'kind', type = { type = 'enum', name = 'kind',
+                                  symbols = { 'A', 'B' }}},
+        { name = 'score', type = 'double', default = 0 },
+        { name = 'next', type = { 'null', 'rec' }}
+    }
+})
+
+local valid = { id = 1, tags = {'a'}, kind = 'A', next = {
+    rec = { id = 2, tags = {}, kind = 'B', next = msgpack.NULL }}}
+local cases = {
+    { id = 1, tags = {'a', 2}, kind = 'A', next = msgpack.NULL },
+    { id = 1, tags = {}, kind = 'C', next = msgpack.NULL },
+    { id = 1, tags = {}, kind = 'A', next = { rec = { id = 'x' }}},
+    { id = 1, tags = {}, next = msgpack.NULL }
+}
+
+for _, backend in ipairs({'lua', 'interp', 'native'}) do
+    local _, m = schema.compile({rec, backend = backend})
+    test:is_deeply({m.validate(valid)}, {true}, backend .. ': valid')
+    -- same checks as flatten
+    local errors, expected = {}, {}
+    for i, obj in ipairs(cases) do
+        errors[i] = {m.validate(obj)}
+        expected[i] = {m.flatten(obj)}
+    end
+    test:is_deeply(errors, expected, backend .. ': errors')
+    test:is_deeply({m.validate(msgpack.encode(cases[3]))},
+                   {false, 'next/rec/id: Expecting LONG, encountered STR'},
+                   backend .. ': msgpack input')
+    -- validation doesn't disturb the next conversion
+    local ok, tuple = m.flatten(valid)
+    local _, err = m.validate(cases[1])
+    test:is_deeply({ok, err, m.unflatten(tuple)},
+                   {true, 'tags/2: Expecting STR, encountered LONG',
+                    true, { id = 1, tags = {'a'}, kind = 'A', score = 0,
+                            next = { rec = { id = 2, tags = {}, kind = 'B',
+                                             score = 0,
+                                             next = msgpack.NULL }}}},
+                   backend .. ': state')
+end
+
+local dir = require('fio').tempdir()
+local _, m = schema.compile({rec, dump_il = dir .. '/rec.il'})
+local il = io.open(dir .. '/rec.il'):read('*a')
+os.remove(dir .. '/rec.il')
+require('fio').rmdir(dir)
+-- flatten, xflatten and validate
+test:is(select(2, il:gsub('PUTENUMS2I', '')), 3, 'enum checks kept')
+-- flatten, unflatten and xflatten
+test:is(select(2, il:gsub('PUTSPAN', '')), 3, 'no output in validate')
+test:ok(m.validate, 'compiled')
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
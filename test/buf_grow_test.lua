@@ -24,8 +24,9 @@ local _, s = schema.create({
             {name = 'A', type = 'long'},
             {name = 'B', type = 'long'},
             {name = 'C', type = 'long'},
+            -- not 'long', arrays of those are copied verbatim
             {name = 'D', type = {
-                type = 'array', items = 'long'
+                type = 'array', items = 'double'
             }}
         }
     }
@@ -0,0 +1,73 @@
+local msgpack = require('msgpack')
+local schema  = require('avro_schema')
+local tap     = require('tap')
+
+local test = tap.test('buf-trim')
+test:plan(11)
+
+local _, s = schema.create({
+    type = 'array', items = {
+        name = 'FooBar', type = 'record', fields = {
+            {name = 'A', type = 'long'},
+            {name = 'B', type = 'string'}
+        }
+    }
+})
+local _, m = schema.compile(s)
+
+local item = msgpack.encode({ A = 1, B = string.rep('x', 100) })
+local small = '\220\0\1' .. item
+local large = '\220\39\16' .. string.rep(item, 10000)
+
+local stats = schema.runtime_stats()
+local initial = stats.bytes
+test:is(stats.retain, nil, 'no trimming by default')
+
+local _, large_res = m.flatten_msgpack(large)
+local grown = schema.runtime_stats().bytes
+test:ok(grown > 10000 * 100, 'buffers grow')
+for _ = 1, 100 do m.flatten_msgpack(small) end
+test:is(schema.runtime_stats().bytes, grown, 'buffers retained')
+
+schema.runtime_cfg({retain = 64 * 1024, trim_after = 3})
+m.flatten_msgpack(small)
+m.flatten_msgpack(small)
+test:is(schema.runtime_stats().bytes, grown, 'not trimmed before trim_after')
+m.flatten_msgpack(small)
+stats = schema.runtime_stats()
+test:ok(stats.bytes < 64 * 1024 and stats.bytes >= initial, 'trimmed')
+test:is_deeply({m.flatten_msgpack(large)},
+               {true, large_res}, 'grow again')
+
+-- conversions exceeding retain restart the count
+m.flatten_msgpack(small)
+m.flatten_msgpack(small)
+m.flatten_msgpack(large)
+m.flatten_msgpack(small)
+m.flatten_msgpack(small)
+test:is(schema.runtime_stats().bytes, grown, 'count restarted')
+
+-- Lua table input is copied to a bank of its own, shrunk alike
+m.flatten({{ A = 1, B = string.rep('x', 100 * 1024) }})
+local tbank = schema.runtime_stats().tbank_capacity
+test:ok(tbank > 100 * 1024, 'table bank grows')
+for _ = 1, 3 do m.flatten({{ A = 1, B = 'x' }}) end
+test:ok(schema.runtime_stats().tbank_capacity < 64 * 1024,
+        'table bank trimmed')
+
+-- the compact layout of interp and native code is counted
+local _, mi = schema.compile({s, backend = 'interp'})
+mi.flatten_msgpack('\220\1\44' .. string.rep(item, 300))
+stats = schema.runtime_stats()
+test:ok(stats.cv_capacity > 0 and
+        stats.bytes == (stats.t_capacity + stats.ot_capacity) * 9 +
+                       (stats.bo_capacity + stats.cv_capacity) * 4 +
+                       stats.res_capacity + stats.sbuf_capacity,
+        'compact layout counted')
+
+test:is_deeply({pcall(schema.runtime_cfg, {trim_after = 0})},
+               {false, 'buf_cfg: trim_after: Expecting a positive number'},
+               'bad trim_after')
+
+test:check()
+os.exit(test.planned == test.total and test.failed == 0 and 0 or -1)
@@ -25,6 +25,19 @@ local string_array_items_nullable = [[{
     "type": "array",
     "items": "string*"
 }]]
+
+local long_array_items_nullable = [[{
+    "type": "array",
+    "items": "long*"
+}]]
+
+local long_array_array = [[{
+    "type": "array",
+    "items": {
+        "type": "array",
+        "items": "long"
+    }
+}]]
 -----------------------------------------------------------------------
 
 t {
@@ -40,6 +53,68 @@ t {
     output = '[[1, 2, 3, 4, 5, 6, 7, 8, 9, 10]]'
 }
 
+-- runs of single-byte scalars (parse_msgpack fast path)
+
+t {
+    schema = int_array,
+    func = 'flatten',
+    input  = [=[[-32, -30, -28, -26, -24, -22, -20, -18, -16, -14, -12, -10,
+                -8, -6, -4, -2, 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22,
+                24, 26, 28, 30, 32, 34, 36, 38]
+    ]=],
+    output = [=[[[-32, -30, -28, -26, -24, -22, -20, -18, -16, -14, -12, -10,
+                 -8, -6, -4, -2, 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22,
+                 24, 26, 28, 30, 32, 34, 36, 38]]
+    ]=]
+}
+
+t {
+    schema = int_array,
+    func = 'flatten',
+    input  = [=[[1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17,
+                18, 19, 1000, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+                32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46,
+                47, 48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, -33,
+                5, 6, 7, 8]
+    ]=],
+    output = [=[[[1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17,
+                 18, 19, 1000, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+                 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46,
+                 47, 48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, -33,
+                 5, 6, 7, 8]]
+    ]=]
+}
+
+t {
+    schema = long_array_items_nullable,
+    func = 'flatten',
+    input  = [=[[null, 1, 2, null, 4, 5, null, 7, 8, null, 10, 11, null, 13,
+                14, null, 16, 17, null, 19, 20, null, 22, 23, null, 25, 26,
+                null, 28, 29, null, 31, 32, null, 34, 35, null, 37, 38,
+                null]
+    ]=],
+    output = [=[[[null, 1, 2, null, 4, 5, null, 7, 8, null, 10, 11, null, 13,
+                 14, null, 16, 17, null, 19, 20, null, 22, 23, null, 25, 26,
+                 null, 28, 29, null, 31, 32, null, 34, 35, null, 37, 38,
+                 null]]
+    ]=]
+}
+
+t {
+    schema = long_array_array,
+    func = 'flatten',
+    input  = [=[[[1, 2, 3, 4, 5, 6], [7, 8, 9, 10], [], [11, 12, 13, 14, 15,
+                16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30,
+                31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45],
+                [46, 47, 48]]
+    ]=],
+    output = [=[[[[1, 2, 3, 4, 5, 6], [7, 8, 9, 10], [], [11, 12, 13, 14, 15,
+                 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30,
+                 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45],
+                 [46, 47, 48]]]
+    ]=]
+}
+
 t {
     schema = string_array,
     func = 'flatten',
@@ -43,3 +43,27 @@ for i = 1,#symbols do
         func = "unflatten", output = '"'..symbols[i]..'"', input = '['..(i-1)..']'
     }
 end
+
+-- below phf_threshold, searched in a table of fnv1a hashes
+local medium = [[{
+    "name": "medium", "type": "enum", "symbols": [
+        "symbol_1", "symbol_2", "symbol_3", "symbol_4",
+        "symbol_5", "symbol_6", "symbol_7", "symbol_8",
+        "symbol_9", "symbol_10", "symbol_11", "symbol_12",
+        "symbol_13", "symbol_14", "symbol_15", "symbol_16"
+    ]
+}]]
+
+for i = 1,16 do
+    _G["i"] = i
+
+    t {
+        schema = medium,
+        func = "flatten", input = '"symbol_'..i..'"', output = '['..(i-1)..']'
+    }
+end
+
+t {
+    schema = medium,
+    func = "flatten", input = '"symbol_17"', error = 'Bad value: "symbol_17"'
+}
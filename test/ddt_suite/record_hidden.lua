@@ -78,3 +78,19 @@ t {
     func = 'unflatten', input = '[100,200,300,400]',
     output = '{"A":100,"C":400}'
 }
+
+-- hidden array and map fields (contents skipped by the parser)
+t {
+    schema = [[{
+        "name": "hidden",
+        "type": "record",
+        "fields": [
+            {"name":"A", "type":"int"},
+            {"name":"B", "type":{"type":"array", "items":"int"}, "hidden":true},
+            {"name":"C", "type":{"type":"map", "values":"int"}, "hidden":true},
+            {"name":"D", "type":"int"}
+        ]
+    }]],
+    func = 'unflatten', input = '[100,[1,2,[3]],{"x":{"y":4}},400]',
+    output = '{"A":100,"D":400}'
+}
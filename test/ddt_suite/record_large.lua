@@ -86,3 +86,17 @@ t {
         1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25
     ]]=]
 }
+
+t {
+    error = 'Unknown key: "f26"',
+    schema = large,
+    func = 'flatten',
+    input = '{"f01": 1, "f26": 26}'
+}
+
+t {
+    error = 'Unknown key: "f1"',
+    schema = large,
+    func = 'flatten',
+    input = '{"f1": 1}'
+}
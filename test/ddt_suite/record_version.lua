@@ -140,3 +140,93 @@ t {
     input = '{"A":100, "B":200}',
     output = '[["=",4,100],["=",3,200]]'
 }
+
+-- dropped array and map fields (contents skipped by the parser)
+
+local foo_complex = [[{
+    "name": "foo",
+    "type": "record",
+    "fields": [
+        {"name": "A", "type": "int"},
+        {"name": "B", "type": "int"},
+        {"name": "C", "type": {"type": "array", "items": "int"}},
+        {"name": "D", "type": {"type": "map", "values": "int"}},
+        {"name": "E", "type": {
+            "name": "bar", "type": "record", "fields": [
+                {"name": "X", "type": "int"},
+                {"name": "Y", "type": {"type": "array", "items": "int"}}
+            ]
+        }}
+    ]
+}]]
+
+local foo_complex_reduced = [[{
+    "name": "foo",
+    "type": "record",
+    "fields": [
+        {"name": "A", "type": "int"},
+        {"name": "B", "type": "int"},
+        {"name": "E", "type": {
+            "name": "bar", "type": "record", "fields": [
+                {"name": "X", "type": "int"}
+            ]
+        }}
+    ]
+}]]
+
+t {
+    schema1 = foo_complex, schema2 = foo_complex_reduced,
+    func = 'flatten',
+    input = [=[{"A":1, "B":2, "C":[3,4,[5,[6]],{"7":8}], "D":{"9":10},
+                "E":{"X":11, "Y":[12,13]}}]=],
+    output = '[1,2,11]'
+}
+
+t {
+    schema1 = foo_complex, schema2 = foo_complex_reduced,
+    func = 'flatten',
+    input = '{"C":[], "D":{}, "A":1, "E":{"X":11, "Y":[]}, "B":2}',
+    output = '[1,2,11]'
+}
+
+t {
+    error = 'C: Expecting ARRAY, encountered MAP',
+    schema1 = foo_complex, schema2 = foo_complex_reduced,
+    func = 'flatten',
+    input = '{"A":1, "B":2, "C":{"3":4}, "D":{}, "E":{"X":11, "Y":[]}}'
+}
+
+t {
+    error = 'Key missing: "D"',
+    schema1 = foo_complex, schema2 = foo_complex_reduced,
+    func = 'flatten',
+    input = '{"A":1, "B":2, "C":[], "E":{"X":11, "Y":[]}}'
+}
+
+t {
+    schema1 = foo_complex, schema2 = foo_complex_reduced,
+    func = 'xflatten',
+    input = '{"A":1, "C":[3,4,[5]], "D":{"9":10}}',
+    output = '[["=",1,1]]'
+}
+
+t {
+    schema1 = foo_complex, schema2 = foo_complex_reduced,
+    func = 'unflatten',
+    input = '[1,2,[3,4,[5,[6]],{"7":8}],{"9":10},11,[12,13]]',
+    output = '{"A":1, "B":2, "E":{"X":11}}'
+}
+
+t {
+    error = '3: Expecting ARRAY, encountered MAP',
+    schema1 = foo_complex, schema2 = foo_complex_reduced,
+    func = 'unflatten',
+    input = '[1,2,{"3":4},{"9":10},11,[12,13]]'
+}
+
+t {
+    error = '6: Expecting ARRAY, encountered LONG',
+    schema1 = foo_complex, schema2 = foo_complex_reduced,
+    func = 'unflatten',
+    input = '[1,2,[],{},11,12]'
+}
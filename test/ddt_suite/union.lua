@@ -174,3 +174,83 @@ t {
     schema = '["int", "string", "double", "null"]',
     func   = 'unflatten', input  = '[3, 42]', output = 'null'
 }
+
+-- wide unions (a binary search rather than a chain in generated code)
+local wide = [=[[
+    {"type": "record", "name": "r1", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r2", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r3", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r4", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r5", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r6", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r7", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r8", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r9", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r10", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r11", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r12", "fields": [{"name": "x", "type": "int"}]}
+]]=]
+
+local wide_null = [=[[
+    {"type": "record", "name": "r1", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r2", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r3", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r4", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r5", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r6", "fields": [{"name": "x", "type": "int"}]},
+    "null",
+    {"type": "record", "name": "r7", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r8", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r9", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r10", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r11", "fields": [{"name": "x", "type": "int"}]},
+    {"type": "record", "name": "r12", "fields": [{"name": "x", "type": "int"}]}
+]]=]
+
+t {
+    schema = wide,
+    func   = 'flatten', input = '{"r12": {"x": 42}}', output = '[11, [42]]'
+}
+
+t {
+    schema = wide,
+    func   = 'unflatten', input = '[0, [42]]', output = '{"r1": {"x": 42}}'
+}
+
+t {
+    schema = wide,
+    func   = 'unflatten', input = '[11, [42]]', output = '{"r12": {"x": 42}}'
+}
+
+t {
+    error  = '1: Bad value: 12',
+    schema = wide,
+    func   = 'unflatten', input = '[12, [42]]'
+}
+
+t {
+    error  = '1: Bad value: -1',
+    schema = wide,
+    func   = 'unflatten', input = '[-1, [42]]'
+}
+
+t {
+    schema = wide_null,
+    func   = 'flatten', input = '{"r7": {"x": 42}}', output = '[7, [42]]'
+}
+
+t {
+    schema = wide_null,
+    func   = 'unflatten', input = '[12, [42]]', output = '{"r12": {"x": 42}}'
+}
+
+t {
+    schema = wide_null,
+    func   = 'unflatten', input = '[6, null]', output = 'null'
+}
+
+t {
+    error  = '1: Bad value: 13',
+    schema = wide_null,
+    func   = 'unflatten', input = '[13, [42]]'
+}
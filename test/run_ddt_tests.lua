@@ -13,6 +13,9 @@ local format, gsub   = string.format, string.gsub
 local insert, concat = table.insert, table.concat
 local sort           = table.sort
 
+-- run_ddt_tests.lua [backend]
+local backend        = arg[1]
+
 -- order-preserving JSON<->msgpack conversion, via external tool
 local function msgpack_helper(data, opts)
     if data=='' then error('Data empty') end
@@ -152,6 +155,7 @@ local function compile_stage(test, args)
     local compile_opts          = test.schema
     compile_opts.service_fields = service_fields
     compile_opts.downgrade      = compile_downgrade
+    compile_opts.backend        = backend
     -- would be deleted after #85
     compile_opts.alpha_nullable_record_xflatten = true
     local ok, schema_c